@@ -2,6 +2,7 @@
 #include <string.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 typedef struct
 {
@@ -27,7 +28,38 @@ typedef struct
     uint32_t important_colors;
 } __attribute__((packed)) bmp_basic_info_header_t;
 
-int bmp_open(bmp_t* bmp, const uint8_t* data, uint32_t size)
+static int get_output_pixel_size(bmp_output_format_t output_format)
+{
+    return output_format == BMP_OUTPUT_BGR565 ? 2 : 3;
+}
+
+static void write_bgr565(uint8_t* dst, const uint8_t* bgr)
+{
+    uint16_t value = ((uint16_t)(bgr[0] >> 3) << 11) | ((uint16_t)(bgr[1] >> 2) << 5) | (bgr[2] >> 3);
+    dst[0] = value >> 8;
+    dst[1] = value & 0xFF;
+}
+
+static int convert_to_bgr565(bmp_t* bmp, const uint8_t* src, int size, int offset_in_row, uint8_t* dst_row)
+{
+    int written = 0;
+    int pixel = offset_in_row / 3;
+    int channel = offset_in_row % 3;
+    for(int i = 0; i < size; i++)
+    {
+        bmp->partial_pixel[channel] = src[i];
+        if(++channel == 3)
+        {
+            write_bgr565(dst_row + pixel * 2, bmp->partial_pixel);
+            written += 2;
+            pixel++;
+            channel = 0;
+        }
+    }
+    return written;
+}
+
+int bmp_open(bmp_t* bmp, const uint8_t* data, uint32_t size, bmp_output_format_t output_format)
 {
     if(!bmp || !data || size < sizeof(bmp_file_header_t) + sizeof(bmp_basic_info_header_t))
         return -1;
@@ -46,6 +78,8 @@ int bmp_open(bmp_t* bmp, const uint8_t* data, uint32_t size)
     bmp->height = basic_info_header->height;
     bmp->pixel_array_size = basic_info_header->pixel_array_size;
     bmp->pixel_array_read = 0;
+    bmp->pixel_array_offset = file_header->pixel_array_offset;
+    bmp->output_format = output_format;
     return 0;
 }
 
@@ -58,10 +92,11 @@ int bmp_read_next(bmp_t* bmp, const uint8_t* src, uint32_t src_size, uint8_t* ds
         return 0;
     int total_bytes_in_row = (bmp->width * 3 + 3) & ~3;
     int useful_bytes_in_row = bmp->width * 3;
-    if(useful_bytes_in_row * bmp->height > dst_size)
+    int dst_bytes_in_row = bmp->width * get_output_pixel_size(bmp->output_format);
+    if(dst_bytes_in_row * bmp->height > dst_size)
         return -1;
     int pos = 0;
-    int useful_bytes_read = 0;
+    int bytes_written = 0;
     if(bmp->pixel_array_read == 0)
     {
         /** skip the head */
@@ -82,9 +117,17 @@ int bmp_read_next(bmp_t* bmp, const uint8_t* src, uint32_t src_size, uint8_t* ds
         if(bytes_read_in_row < useful_bytes_in_row)
         {
             int bytes_to_read = MIN(useful_bytes_in_row - bytes_read_in_row, src_size - pos);
-            memcpy(dst + row * useful_bytes_in_row + bytes_read_in_row, src + pos, bytes_to_read);
+            uint8_t* dst_row = dst + row * dst_bytes_in_row;
+            if(bmp->output_format == BMP_OUTPUT_BGR565)
+            {
+                bytes_written += convert_to_bgr565(bmp, src + pos, bytes_to_read, bytes_read_in_row, dst_row);
+            }
+            else
+            {
+                memcpy(dst_row + bytes_read_in_row, src + pos, bytes_to_read);
+                bytes_written += bytes_to_read;
+            }
             pos += bytes_to_read;
-            useful_bytes_read += bytes_to_read;
             bmp->pixel_array_read += bytes_to_read;
         }
         else
@@ -94,7 +137,87 @@ int bmp_read_next(bmp_t* bmp, const uint8_t* src, uint32_t src_size, uint8_t* ds
             bmp->pixel_array_read += bytes_to_skip;
         }
     }
-    return useful_bytes_read;
+    return bytes_written;
 }
 
 
+
+int bmp_next_pixel_run(bmp_t* bmp, const uint8_t* src, uint32_t src_size, uint32_t* pos, const uint8_t** run)
+{
+    if(!bmp || !src || !pos || !run)
+        return -1;
+    int total_bytes_in_row = (bmp->width * 3 + 3) & ~3;
+    int useful_bytes_in_row = bmp->width * 3;
+    if(*pos == 0 && bmp->pixel_array_read == 0)
+    {
+        /** skip the head */
+        if(bmp->pixel_array_offset >= src_size)
+            return -1;
+        *pos = bmp->pixel_array_offset;
+    }
+    while(*pos < src_size && bmp->pixel_array_read < bmp->pixel_array_size)
+    {
+        int bytes_read_in_row = bmp->pixel_array_read % total_bytes_in_row;
+        if(bytes_read_in_row < useful_bytes_in_row)
+        {
+            int run_size = MIN(useful_bytes_in_row - bytes_read_in_row, src_size - *pos);
+            *run = src + *pos;
+            *pos += run_size;
+            bmp->pixel_array_read += run_size;
+            return run_size;
+        }
+        int bytes_to_skip = MIN(total_bytes_in_row - bytes_read_in_row, src_size - *pos);
+        *pos += bytes_to_skip;
+        bmp->pixel_array_read += bytes_to_skip;
+    }
+    return 0;
+}
+
+int bmp_read_at(const bmp_t* bmp, uint32_t file_offset, const uint8_t* src, uint32_t src_size, uint8_t* dst, uint32_t dst_size)
+{
+    if(!bmp || !src || !dst)
+        return -1;
+    uint32_t total_bytes_in_row = (bmp->width * 3 + 3) & ~3;
+    uint32_t useful_bytes_in_row = bmp->width * 3;
+    int dst_pixel_size = get_output_pixel_size(bmp->output_format);
+    uint32_t dst_bytes_in_row = bmp->width * dst_pixel_size;
+    if(dst_bytes_in_row * bmp->height > dst_size)
+        return -1;
+    /** Only the pixel array in src */
+    uint32_t pos = MAX(file_offset, bmp->pixel_array_offset);
+    uint32_t end = MIN(file_offset + src_size, bmp->pixel_array_offset + total_bytes_in_row * bmp->height);
+    int bytes_written = 0;
+    while(pos < end)
+    {
+        uint32_t pixel_array_pos = pos - bmp->pixel_array_offset;
+        int row = bmp->height - 1 - pixel_array_pos / total_bytes_in_row;
+        uint32_t bytes_in_row = pixel_array_pos % total_bytes_in_row;
+        if(bytes_in_row >= useful_bytes_in_row)
+        {
+            /** padding */
+            pos += total_bytes_in_row - bytes_in_row;
+            continue;
+        }
+        uint32_t bytes_to_read = MIN(useful_bytes_in_row - bytes_in_row, end - pos);
+        const uint8_t* src_row = src + (pos - file_offset);
+        uint8_t* dst_row = dst + row * dst_bytes_in_row;
+        if(bmp->output_format == BMP_OUTPUT_BGR565)
+        {
+            /** Skip the split pixels on both sides */
+            uint32_t first_pixel = (bytes_in_row + 2) / 3;
+            uint32_t end_pixel = (bytes_in_row + bytes_to_read) / 3;
+            for(uint32_t pixel = first_pixel; pixel < end_pixel; pixel++)
+            {
+                write_bgr565(dst_row + pixel * 2, src_row + pixel * 3 - bytes_in_row);
+                bytes_written += 2;
+            }
+        }
+        else
+        {
+            memcpy(dst_row + bytes_in_row, src_row, bytes_to_read);
+            bytes_written += bytes_to_read;
+        }
+        pos += bytes_to_read;
+    }
+    return bytes_written;
+}
@@ -4,13 +4,25 @@
 
 /** Only supports uncompressed 8-8-8 pixel format */
 
+typedef enum
+{
+    /** Same as the file. B, G, R bytes. */
+    BMP_OUTPUT_BGR888,
+    /** Big endian 16bit, blue in the high bits. */
+    BMP_OUTPUT_BGR565
+} bmp_output_format_t;
+
 typedef struct
 {
     /** This is not the frame buffer size as there are paddings. */
     int pixel_array_size;
     int pixel_array_read;
+    uint32_t pixel_array_offset;
     uint32_t width;
     uint32_t height;
+    bmp_output_format_t output_format;
+    /** Pixels may be split between two reads */
+    uint8_t partial_pixel[3];
 } bmp_t;
 
 /**
@@ -19,9 +31,10 @@ typedef struct
  * @param bmp 
  * @param data 
  * @param size 
+ * @param output_format The pixel format written by bmp_read_next
  * @return int 
  */
-int bmp_open(bmp_t* bmp, const uint8_t* data, uint32_t size);
+int bmp_open(bmp_t* bmp, const uint8_t* data, uint32_t size, bmp_output_format_t output_format);
 
 /**
  * @brief 
@@ -31,6 +44,35 @@ int bmp_open(bmp_t* bmp, const uint8_t* data, uint32_t size);
  * @param src_size 
  * @param dst The whole frame buffer. DO NOT offset.
  * @param dst_size
- * @return int 
+ * @return int Bytes written to dst, in the output format.
  */
 int bmp_read_next(bmp_t* bmp, const uint8_t* src, uint32_t src_size, uint8_t* dst, uint32_t dst_size);
+
+/**
+ * @brief Find the next run of pixel bytes in src, in the file order. i.e. bottom -> up.
+ * The header and the row paddings are skipped. No conversion is done.
+ * Call this with the same src until it returns 0. Then move on to the next part of the file.
+ * 
+ * @param bmp 
+ * @param src 
+ * @param src_size 
+ * @param pos In and out. Set to 0 for each new src.
+ * @param run Set to the start of the run in src.
+ * @return int Size of the run. 0 if src is used up.
+ */
+int bmp_next_pixel_run(bmp_t* bmp, const uint8_t* src, uint32_t src_size, uint32_t* pos, const uint8_t** run);
+
+/**
+ * @brief Decode a part of the file at any position. No state is kept, the parts can come in any order.
+ * With BMP_OUTPUT_BGR565, only the pixels fully inside src are written. 
+ * Pass the bytes around the border again to complete the split pixels.
+ * 
+ * @param bmp Opened with the first part of the file
+ * @param file_offset Where src is in the file
+ * @param src 
+ * @param src_size 
+ * @param dst The whole frame buffer. DO NOT offset.
+ * @param dst_size 
+ * @return int Bytes written to dst, in the output format.
+ */
+int bmp_read_at(const bmp_t* bmp, uint32_t file_offset, const uint8_t* src, uint32_t src_size, uint8_t* dst, uint32_t dst_size);
@@ -5,10 +5,14 @@
 #define PICO_GPIO_NUM (29)
 #define BUTTON_DEBOUNCE_US (100000)
 #define BUTTON_DEBOUNCE_TICKS (pdMS_TO_TICKS(BUTTON_DEBOUNCE_US / 1000))
+/** From the press, including the debounce time */
+#define BUTTON_LONG_PRESS_US (600000)
+#define BUTTON_LONG_PRESS_TICKS (pdMS_TO_TICKS((BUTTON_LONG_PRESS_US - BUTTON_DEBOUNCE_US) / 1000))
 
 static button_t* buttons[PICO_GPIO_NUM] = {0};
 static void button_irq_handler(uint gpio, uint32_t events);
 static void button_timer_handler(TimerHandle_t timer);
+static void button_long_press_timer_handler(TimerHandle_t timer);
 
 int button_init(button_t* button)
 {
@@ -19,12 +23,23 @@ int button_init(button_t* button)
     if(buttons[button->pin])
         return -1;
     buttons[button->pin] = button;
-    button->internal.debounce_timer = xTimerCreate(
+    button->internal.debounce_timer = xTimerCreateStatic(
         "budeb",
         BUTTON_DEBOUNCE_TICKS,
         pdFALSE,
         button,
-        button_timer_handler);
+        button_timer_handler,
+        &button->internal.debounce_timer_buffer);
+    if(button->callback.on_long_press)
+    {
+        button->internal.long_press_timer = xTimerCreateStatic(
+            "bulong",
+            BUTTON_LONG_PRESS_TICKS,
+            pdFALSE,
+            button,
+            button_long_press_timer_handler,
+            &button->internal.long_press_timer_buffer);
+    }
     gpio_init(button->pin);
     gpio_set_dir(button->pin, GPIO_IN);
     gpio_pull_up(button->pin);
@@ -43,6 +58,8 @@ void button_deinit(button_t* button)
     buttons[button->pin] = NULL;
     gpio_set_irq_enabled(button->pin, GPIO_IRQ_EDGE_FALL, false);
     xTimerDelete(button->internal.debounce_timer, 0);
+    if(button->internal.long_press_timer)
+        xTimerDelete(button->internal.long_press_timer, 0);
     gpio_deinit(button->pin);
 }
 
@@ -68,5 +85,23 @@ static void button_timer_handler(TimerHandle_t timer)
     /** Pin should be low */
     if(gpio_get(button->pin))
         return;
+    /** Tell the click from the long press later */
+    if(button->internal.long_press_timer)
+    {
+        xTimerReset(button->internal.long_press_timer, 0);
+        return;
+    }
     button->callback.on_click(button->callback.on_click_ctx);
 }
+
+static void button_long_press_timer_handler(TimerHandle_t timer)
+{
+    button_t* button = pvTimerGetTimerID(timer);
+    if(!buttons[button->pin])
+        return;
+    /** Still held */
+    if(!gpio_get(button->pin))
+        button->callback.on_long_press(button->callback.on_long_press_ctx);
+    else
+        button->callback.on_click(button->callback.on_click_ctx);
+}
@@ -11,11 +11,17 @@ typedef struct
     {
         void(*on_click)(void* ctx);
         void* on_click_ctx;
+        /** Optional. With this, on_click comes once the button is found released before the long press time. */
+        void(*on_long_press)(void* ctx);
+        void* on_long_press_ctx;
     } callback;
     struct
     {
         uint64_t last_trigger_us;
         TimerHandle_t debounce_timer;
+        TimerHandle_t long_press_timer;
+        StaticTimer_t debounce_timer_buffer;
+        StaticTimer_t long_press_timer_buffer;
     } internal;
 } button_t;
 
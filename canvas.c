@@ -0,0 +1,238 @@
+#include <string.h>
+#include "canvas.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define FONT_FIRST_CHAR (0x20)
+#define FONT_LAST_CHAR (0x7E)
+
+/** 5*7 ascii font. One byte per column, bit 0 is the top. */
+static const uint8_t font[FONT_LAST_CHAR - FONT_FIRST_CHAR + 1][CANVAS_FONT_WIDTH] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, /** ' ' */
+    {0x00, 0x00, 0x5F, 0x00, 0x00}, /** ! */
+    {0x00, 0x07, 0x00, 0x07, 0x00}, /** " */
+    {0x14, 0x7F, 0x14, 0x7F, 0x14}, /** # */
+    {0x24, 0x2A, 0x7F, 0x2A, 0x12}, /** $ */
+    {0x23, 0x13, 0x08, 0x64, 0x62}, /** % */
+    {0x36, 0x49, 0x55, 0x22, 0x50}, /** & */
+    {0x00, 0x05, 0x03, 0x00, 0x00}, /** ' */
+    {0x00, 0x1C, 0x22, 0x41, 0x00}, /** ( */
+    {0x00, 0x41, 0x22, 0x1C, 0x00}, /** ) */
+    {0x08, 0x2A, 0x1C, 0x2A, 0x08}, /** * */
+    {0x08, 0x08, 0x3E, 0x08, 0x08}, /** + */
+    {0x00, 0x50, 0x30, 0x00, 0x00}, /** , */
+    {0x08, 0x08, 0x08, 0x08, 0x08}, /** - */
+    {0x00, 0x60, 0x60, 0x00, 0x00}, /** . */
+    {0x20, 0x10, 0x08, 0x04, 0x02}, /** / */
+    {0x3E, 0x51, 0x49, 0x45, 0x3E}, /** 0 */
+    {0x00, 0x42, 0x7F, 0x40, 0x00}, /** 1 */
+    {0x42, 0x61, 0x51, 0x49, 0x46}, /** 2 */
+    {0x21, 0x41, 0x45, 0x4B, 0x31}, /** 3 */
+    {0x18, 0x14, 0x12, 0x7F, 0x10}, /** 4 */
+    {0x27, 0x45, 0x45, 0x45, 0x39}, /** 5 */
+    {0x3C, 0x4A, 0x49, 0x49, 0x30}, /** 6 */
+    {0x01, 0x71, 0x09, 0x05, 0x03}, /** 7 */
+    {0x36, 0x49, 0x49, 0x49, 0x36}, /** 8 */
+    {0x06, 0x49, 0x49, 0x29, 0x1E}, /** 9 */
+    {0x00, 0x36, 0x36, 0x00, 0x00}, /** : */
+    {0x00, 0x56, 0x36, 0x00, 0x00}, /** ; */
+    {0x08, 0x14, 0x22, 0x41, 0x00}, /** < */
+    {0x14, 0x14, 0x14, 0x14, 0x14}, /** = */
+    {0x00, 0x41, 0x22, 0x14, 0x08}, /** > */
+    {0x02, 0x01, 0x51, 0x09, 0x06}, /** ? */
+    {0x32, 0x49, 0x79, 0x41, 0x3E}, /** @ */
+    {0x7E, 0x11, 0x11, 0x11, 0x7E}, /** A */
+    {0x7F, 0x49, 0x49, 0x49, 0x36}, /** B */
+    {0x3E, 0x41, 0x41, 0x41, 0x22}, /** C */
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, /** D */
+    {0x7F, 0x49, 0x49, 0x49, 0x41}, /** E */
+    {0x7F, 0x09, 0x09, 0x09, 0x01}, /** F */
+    {0x3E, 0x41, 0x49, 0x49, 0x7A}, /** G */
+    {0x7F, 0x08, 0x08, 0x08, 0x7F}, /** H */
+    {0x00, 0x41, 0x7F, 0x41, 0x00}, /** I */
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, /** J */
+    {0x7F, 0x08, 0x14, 0x22, 0x41}, /** K */
+    {0x7F, 0x40, 0x40, 0x40, 0x40}, /** L */
+    {0x7F, 0x02, 0x0C, 0x02, 0x7F}, /** M */
+    {0x7F, 0x04, 0x08, 0x10, 0x7F}, /** N */
+    {0x3E, 0x41, 0x41, 0x41, 0x3E}, /** O */
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, /** P */
+    {0x3E, 0x41, 0x51, 0x21, 0x5E}, /** Q */
+    {0x7F, 0x09, 0x19, 0x29, 0x46}, /** R */
+    {0x46, 0x49, 0x49, 0x49, 0x31}, /** S */
+    {0x01, 0x01, 0x7F, 0x01, 0x01}, /** T */
+    {0x3F, 0x40, 0x40, 0x40, 0x3F}, /** U */
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, /** V */
+    {0x3F, 0x40, 0x38, 0x40, 0x3F}, /** W */
+    {0x63, 0x14, 0x08, 0x14, 0x63}, /** X */
+    {0x07, 0x08, 0x70, 0x08, 0x07}, /** Y */
+    {0x61, 0x51, 0x49, 0x45, 0x43}, /** Z */
+    {0x00, 0x7F, 0x41, 0x41, 0x00}, /** [ */
+    {0x02, 0x04, 0x08, 0x10, 0x20}, /** \ */
+    {0x00, 0x41, 0x41, 0x7F, 0x00}, /** ] */
+    {0x04, 0x02, 0x01, 0x02, 0x04}, /** ^ */
+    {0x40, 0x40, 0x40, 0x40, 0x40}, /** _ */
+    {0x00, 0x01, 0x02, 0x04, 0x00}, /** ` */
+    {0x20, 0x54, 0x54, 0x54, 0x78}, /** a */
+    {0x7F, 0x48, 0x44, 0x44, 0x38}, /** b */
+    {0x38, 0x44, 0x44, 0x44, 0x20}, /** c */
+    {0x38, 0x44, 0x44, 0x48, 0x7F}, /** d */
+    {0x38, 0x54, 0x54, 0x54, 0x18}, /** e */
+    {0x08, 0x7E, 0x09, 0x01, 0x02}, /** f */
+    {0x0C, 0x52, 0x52, 0x52, 0x3E}, /** g */
+    {0x7F, 0x08, 0x04, 0x04, 0x78}, /** h */
+    {0x00, 0x44, 0x7D, 0x40, 0x00}, /** i */
+    {0x20, 0x40, 0x44, 0x3D, 0x00}, /** j */
+    {0x7F, 0x10, 0x28, 0x44, 0x00}, /** k */
+    {0x00, 0x41, 0x7F, 0x40, 0x00}, /** l */
+    {0x7C, 0x04, 0x18, 0x04, 0x78}, /** m */
+    {0x7C, 0x08, 0x04, 0x04, 0x78}, /** n */
+    {0x38, 0x44, 0x44, 0x44, 0x38}, /** o */
+    {0x7C, 0x14, 0x14, 0x14, 0x08}, /** p */
+    {0x08, 0x14, 0x14, 0x18, 0x7C}, /** q */
+    {0x7C, 0x08, 0x04, 0x04, 0x08}, /** r */
+    {0x48, 0x54, 0x54, 0x54, 0x20}, /** s */
+    {0x04, 0x3F, 0x44, 0x40, 0x20}, /** t */
+    {0x3C, 0x40, 0x40, 0x20, 0x7C}, /** u */
+    {0x1C, 0x20, 0x40, 0x20, 0x1C}, /** v */
+    {0x3C, 0x40, 0x30, 0x40, 0x3C}, /** w */
+    {0x44, 0x28, 0x10, 0x28, 0x44}, /** x */
+    {0x0C, 0x50, 0x50, 0x50, 0x3C}, /** y */
+    {0x44, 0x64, 0x54, 0x4C, 0x44}, /** z */
+    {0x00, 0x08, 0x36, 0x41, 0x00}, /** { */
+    {0x00, 0x00, 0x7F, 0x00, 0x00}, /** | */
+    {0x00, 0x41, 0x36, 0x08, 0x00}, /** } */
+    {0x08, 0x04, 0x08, 0x10, 0x08}, /** ~ */
+};
+
+static void mark_dirty(canvas_t* canvas, int y, int h);
+static void to_pixel(const canvas_t* canvas, uint32_t rgb, uint8_t* pixel);
+
+int canvas_init(canvas_t* canvas)
+{
+    if(!canvas || !canvas->frame || canvas->width <= 0 || canvas->height <= 0)
+        return -1;
+    canvas->internal.pixel_size = canvas->format == BMP_OUTPUT_BGR565 ? 2 : 3;
+    canvas->internal.dirty_row_begin = 0;
+    canvas->internal.dirty_row_end = 0;
+    return 0;
+}
+
+int canvas_get_pixel_size(const canvas_t* canvas)
+{
+    return canvas->internal.pixel_size;
+}
+
+void canvas_fill_rect(canvas_t* canvas, int x, int y, int w, int h, uint32_t rgb)
+{
+    int x_begin = MAX(x, 0);
+    int y_begin = MAX(y, 0);
+    int x_end = MIN(x + w, canvas->width);
+    int y_end = MIN(y + h, canvas->height);
+    if(x_begin >= x_end || y_begin >= y_end)
+        return;
+    int pixel_size = canvas->internal.pixel_size;
+    uint8_t pixel[3];
+    to_pixel(canvas, rgb, pixel);
+    /** Fill the first row pixel by pixel, then copy it to the others. */
+    uint8_t* first_row = canvas->frame + (y_begin * canvas->width + x_begin) * pixel_size;
+    for(int i = 0; i < x_end - x_begin; i++)
+        memcpy(first_row + i * pixel_size, pixel, pixel_size);
+    for(int row = y_begin + 1; row < y_end; row++)
+        memcpy(canvas->frame + (row * canvas->width + x_begin) * pixel_size, first_row, (x_end - x_begin) * pixel_size);
+    mark_dirty(canvas, y_begin, y_end - y_begin);
+}
+
+void canvas_draw_text(canvas_t* canvas, int x, int y, const char* text, int length, uint32_t rgb, uint32_t background_rgb, int scale)
+{
+    if(scale <= 0)
+        return;
+    for(int i = 0; i < length; i++)
+    {
+        uint8_t c = (uint8_t)text[i];
+        if(c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR)
+            c = '?';
+        const uint8_t* glyph = font[c - FONT_FIRST_CHAR];
+        int cell_x = x + i * CANVAS_FONT_ADVANCE * scale;
+        if(cell_x >= canvas->width)
+            break;
+        canvas_fill_rect(canvas, cell_x, y, CANVAS_FONT_ADVANCE * scale, (CANVAS_FONT_HEIGHT + 1) * scale, background_rgb);
+        for(int column = 0; column < CANVAS_FONT_WIDTH; column++)
+        {
+            for(int row = 0; row < CANVAS_FONT_HEIGHT; row++)
+            {
+                if(glyph[column] & (1 << row))
+                    canvas_fill_rect(canvas, cell_x + column * scale, y + row * scale, scale, scale, rgb);
+            }
+        }
+    }
+}
+
+void canvas_blit_row(canvas_t* canvas, int x, int y, const uint8_t* pixels, int w)
+{
+    if(y < 0 || y >= canvas->height)
+        return;
+    int x_begin = MAX(x, 0);
+    int x_end = MIN(x + w, canvas->width);
+    if(x_begin >= x_end)
+        return;
+    int pixel_size = canvas->internal.pixel_size;
+    memcpy(
+        canvas->frame + (y * canvas->width + x_begin) * pixel_size,
+        pixels + (x_begin - x) * pixel_size,
+        (x_end - x_begin) * pixel_size);
+    mark_dirty(canvas, y, 1);
+}
+
+bool canvas_take_dirty_rows(canvas_t* canvas, int* row, int* rows)
+{
+    if(canvas->internal.dirty_row_begin >= canvas->internal.dirty_row_end)
+        return false;
+    *row = canvas->internal.dirty_row_begin;
+    *rows = canvas->internal.dirty_row_end - canvas->internal.dirty_row_begin;
+    canvas_clear_dirty(canvas);
+    return true;
+}
+
+void canvas_clear_dirty(canvas_t* canvas)
+{
+    canvas->internal.dirty_row_begin = 0;
+    canvas->internal.dirty_row_end = 0;
+}
+
+bool canvas_is_dirty(const canvas_t* canvas)
+{
+    return canvas->internal.dirty_row_begin < canvas->internal.dirty_row_end;
+}
+
+static void mark_dirty(canvas_t* canvas, int y, int h)
+{
+    if(canvas->internal.dirty_row_begin >= canvas->internal.dirty_row_end)
+    {
+        canvas->internal.dirty_row_begin = y;
+        canvas->internal.dirty_row_end = y + h;
+        return;
+    }
+    canvas->internal.dirty_row_begin = MIN(canvas->internal.dirty_row_begin, y);
+    canvas->internal.dirty_row_end = MAX(canvas->internal.dirty_row_end, y + h);
+}
+
+/** Same byte order as the bmp decoder output. */
+static void to_pixel(const canvas_t* canvas, uint32_t rgb, uint8_t* pixel)
+{
+    uint8_t r = (rgb >> 16) & 0xFF;
+    uint8_t g = (rgb >> 8) & 0xFF;
+    uint8_t b = rgb & 0xFF;
+    if(canvas->format == BMP_OUTPUT_BGR565)
+    {
+        uint16_t value = ((uint16_t)(b >> 3) << 11) | ((uint16_t)(g >> 2) << 5) | (r >> 3);
+        pixel[0] = value >> 8;
+        pixel[1] = value & 0xFF;
+    }
+    else
+    {
+        pixel[0] = b;
+        pixel[1] = g;
+        pixel[2] = r;
+    }
+}
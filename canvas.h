@@ -0,0 +1,88 @@
+#pragma once
+
+/**
+ * Draw into a frame buffer in the lcd byte order, the same as what bmp_read_next writes.
+ * The rows that are drawn to are tracked, so only those need to go to the lcd.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bmp.h"
+
+#define CANVAS_FONT_WIDTH (5)
+#define CANVAS_FONT_HEIGHT (7)
+/** One blank column between the characters */
+#define CANVAS_FONT_ADVANCE (CANVAS_FONT_WIDTH + 1)
+
+typedef struct
+{
+    /** Rows top -> down */
+    uint8_t* frame;
+    int width;
+    int height;
+    bmp_output_format_t format;
+    struct
+    {
+        int pixel_size;
+        /** Rows drawn to since the last canvas_take_dirty_rows. Empty if begin >= end. */
+        int dirty_row_begin;
+        int dirty_row_end;
+    } internal;
+} canvas_t;
+
+int canvas_init(canvas_t* canvas);
+
+int canvas_get_pixel_size(const canvas_t* canvas);
+
+/**
+ * @brief Fill a rect. Parts outside of the frame are clipped.
+ *
+ * @param canvas
+ * @param x
+ * @param y
+ * @param w
+ * @param h
+ * @param rgb 0xRRGGBB
+ */
+void canvas_fill_rect(canvas_t* canvas, int x, int y, int w, int h, uint32_t rgb);
+
+/**
+ * @brief Draw text with the built in 5*7 font. Characters outside of 0x20-0x7E are drawn as '?'.
+ *
+ * @param canvas
+ * @param x
+ * @param y
+ * @param text
+ * @param length
+ * @param rgb 0xRRGGBB
+ * @param background_rgb 0xRRGGBB, fills the cell around each character
+ * @param scale 1 for 6*8 cells
+ */
+void canvas_draw_text(canvas_t* canvas, int x, int y, const char* text, int length, uint32_t rgb, uint32_t background_rgb, int scale);
+
+/**
+ * @brief Copy one row of pixels that are already in the frame format. Parts outside of the frame are clipped.
+ *
+ * @param canvas
+ * @param x
+ * @param y
+ * @param pixels
+ * @param w in pixels
+ */
+void canvas_blit_row(canvas_t* canvas, int x, int y, const uint8_t* pixels, int w);
+
+/**
+ * @brief Get and clear the rows drawn to.
+ *
+ * @param canvas
+ * @param row
+ * @param rows
+ * @return true Something was drawn.
+ */
+bool canvas_take_dirty_rows(canvas_t* canvas, int* row, int* rows);
+
+/** Forget the rows drawn to, e.g. The frame under them was replaced */
+void canvas_clear_dirty(canvas_t* canvas);
+
+/** Something was drawn since the last canvas_take_dirty_rows */
+bool canvas_is_dirty(const canvas_t* canvas);
@@ -0,0 +1,66 @@
+#include <string.h>
+#include <task.h>
+#include "cpu_load.h"
+
+#if configGENERATE_RUN_TIME_STATS
+static configRUN_TIME_COUNTER_TYPE get_total_time()
+{
+#ifdef portALT_GET_RUN_TIME_COUNTER_VALUE
+    configRUN_TIME_COUNTER_TYPE time = 0;
+    portALT_GET_RUN_TIME_COUNTER_VALUE(time);
+    return time;
+#else
+    return portGET_RUN_TIME_COUNTER_VALUE();
+#endif
+}
+
+static configRUN_TIME_COUNTER_TYPE get_idle_time(uint32_t core)
+{
+#if configNUMBER_OF_CORES > 1
+    return ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+#else
+    (void)core;
+    return ulTaskGetIdleRunTimeCounter();
+#endif
+}
+#endif
+
+int cpu_load_init(cpu_load_t* cpu_load)
+{
+    if(!cpu_load)
+        return -1;
+    memset(cpu_load, 0, sizeof(cpu_load_t));
+#if configGENERATE_RUN_TIME_STATS
+#if configNUMBER_OF_CORES > 1
+    cpu_load->stats.core_num = configNUMBER_OF_CORES < CPU_LOAD_MAX_CORES ? configNUMBER_OF_CORES : CPU_LOAD_MAX_CORES;
+#else
+    cpu_load->stats.core_num = 1;
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void cpu_load_update(cpu_load_t* cpu_load)
+{
+#if configGENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total_time = get_total_time();
+    configRUN_TIME_COUNTER_TYPE total_delta = total_time - cpu_load->internal.total_time;
+    for(uint32_t i = 0; i < cpu_load->stats.core_num; i++)
+    {
+        configRUN_TIME_COUNTER_TYPE idle_time = get_idle_time(i);
+        configRUN_TIME_COUNTER_TYPE idle_delta = idle_time - cpu_load->internal.idle_time[i];
+        cpu_load->internal.idle_time[i] = idle_time;
+        if(!cpu_load->internal.started || total_delta == 0)
+            continue;
+        if(idle_delta > total_delta)
+            idle_delta = total_delta;
+        cpu_load->stats.busy_percent[i] = 100 - (uint32_t)((uint64_t)idle_delta * 100 / total_delta);
+    }
+    cpu_load->internal.total_time = total_time;
+    cpu_load->internal.started = true;
+#else
+    (void)cpu_load;
+#endif
+}
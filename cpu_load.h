@@ -0,0 +1,50 @@
+#pragma once
+
+/**
+ * How busy each core is, from the FreeRTOS run time stats. The time the idle task of a core did not run is busy time.
+ * Needs configGENERATE_RUN_TIME_STATS. cpu_load_init fails without it.
+ * With SMP FreeRTOS there is one idle task per core, otherwise only core 0 is counted.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <FreeRTOS.h>
+
+#define CPU_LOAD_MAX_CORES (2)
+
+#if !defined(configNUMBER_OF_CORES) && defined(configNUM_CORES)
+/** The name before FreeRTOS V11 */
+#define configNUMBER_OF_CORES configNUM_CORES
+#endif
+
+#ifndef configRUN_TIME_COUNTER_TYPE
+#define configRUN_TIME_COUNTER_TYPE uint32_t
+#endif
+
+typedef struct
+{
+    struct
+    {
+        /** 0 to 100 per core, between the last two cpu_load_update */
+        uint32_t busy_percent[CPU_LOAD_MAX_CORES];
+        uint32_t core_num;
+    } stats;
+    struct
+    {
+        configRUN_TIME_COUNTER_TYPE idle_time[CPU_LOAD_MAX_CORES];
+        configRUN_TIME_COUNTER_TYPE total_time;
+        /** The first update only takes the counters */
+        bool started;
+    } internal;
+} cpu_load_t;
+
+/**
+ * @brief Check that the run time stats are on.
+ *
+ * @param cpu_load
+ * @return int -1 if the run time stats are off
+ */
+int cpu_load_init(cpu_load_t* cpu_load);
+
+/** Take the busy time since the last call. Only call it once the scheduler runs, every few seconds, as the counters wrap. */
+void cpu_load_update(cpu_load_t* cpu_load);
@@ -0,0 +1,14 @@
+#pragma once
+
+/**
+ * Diagnostic prints on the uart. They are compiled out unless the build sets USB_SCREEN_DEBUG.
+ * The arguments are still type checked, so a print does not rot while it is off.
+ */
+
+#include <stdio.h>
+
+#ifndef USB_SCREEN_DEBUG
+#define USB_SCREEN_DEBUG (0)
+#endif
+
+#define DEBUG_PRINTF(...) do { if(USB_SCREEN_DEBUG) printf(__VA_ARGS__); } while(0)
@@ -0,0 +1,181 @@
+#include <string.h>
+#include "decoder.h"
+#include "fat12.h"
+
+static int finish(decoder_t* decoder);
+static int get_file_blocks(decoder_t* decoder, uint32_t* blocks, uint32_t* file_size);
+static int decode_sector(decoder_t* decoder, const uint32_t* blocks, int block_num, uint32_t file_size, int index);
+static void decode_split_pixel(decoder_t* decoder, const uint32_t* blocks, int index);
+
+int decoder_init(decoder_t* decoder)
+{
+    if(!decoder || !decoder->disk || decoder->frame_size == 0)
+        return -1;
+    memset(&decoder->internal, 0, sizeof(decoder->internal));
+    return 0;
+}
+
+void decoder_set_frame(decoder_t* decoder, uint8_t* frame)
+{
+    decoder->internal.frame = frame;
+    memset(decoder->internal.decoded_blocks, 0, sizeof(decoder->internal.decoded_blocks));
+}
+
+void decoder_select_file(decoder_t* decoder, uint32_t file)
+{
+    if(decoder->internal.file == file)
+        return;
+    decoder->internal.file = file;
+    memset(decoder->internal.decoded_blocks, 0, sizeof(decoder->internal.decoded_blocks));
+    decoder->internal.bmp_valid = false;
+}
+
+void decoder_on_disk_write(decoder_t* decoder, uint32_t block)
+{
+    if(!decoder->internal.frame)
+        return;
+    uint32_t blocks[DECODER_MAX_FILE_BLOCKS];
+    uint32_t file_size = 0;
+    int block_num = get_file_blocks(decoder, blocks, &file_size);
+    if(block_num <= 0)
+        return;
+    int index = -1;
+    for(int i = 0; i < block_num; i++)
+    {
+        if(blocks[i] == block)
+        {
+            index = i;
+            break;
+        }
+    }
+    /** Not a data block of the file. The file may come later. */
+    if(index < 0)
+        return;
+    decoder->internal.decoded_blocks[index] = 0;
+    /** This fails if the header is not written yet. It will be decoded in decoder_finish then. */
+    decode_sector(decoder, blocks, block_num, file_size, index);
+}
+
+int decoder_finish(decoder_t* decoder, disk_snapshot_t* snapshot)
+{
+    if(!decoder->internal.frame)
+        return -1;
+    decoder->internal.snapshot = snapshot;
+    int rc = finish(decoder);
+    decoder->internal.snapshot = NULL;
+    return rc;
+}
+
+static int finish(decoder_t* decoder)
+{
+    uint32_t blocks[DECODER_MAX_FILE_BLOCKS];
+    uint32_t file_size = 0;
+    int block_num = get_file_blocks(decoder, blocks, &file_size);
+    if(block_num <= 0)
+        return -1;
+    /** The header first, as all the others depend on it. */
+    for(int i = 0; i < block_num; i++)
+    {
+        if(decoder->internal.decoded_blocks[i] == blocks[i])
+            continue;
+        if(decode_sector(decoder, blocks, block_num, file_size, i) != 0)
+            return -1;
+    }
+    const bmp_t* bmp = &decoder->internal.bmp;
+    uint32_t pixel_size = decoder->output_format == BMP_OUTPUT_BGR565 ? 2 : 3;
+    /** Only full frames */
+    if(bmp->width * bmp->height * pixel_size != decoder->frame_size)
+        return -1;
+    if(file_size < bmp->pixel_array_offset + ((bmp->width * 3 + 3) & ~3) * bmp->height)
+        return -1;
+    return 0;
+}
+
+static int get_file_blocks(decoder_t* decoder, uint32_t* blocks, uint32_t* file_size)
+{
+    fat12_file_reader_t reader = {0};
+    for(uint32_t i = 0; i <= decoder->internal.file; i++)
+    {
+        if(fat12_open_next_file(decoder->disk, &reader) != 0)
+            return -1;
+    }
+    *file_size = reader.size;
+    return fat12_get_file_blocks(decoder->disk, &reader, blocks, DECODER_MAX_FILE_BLOCKS);
+}
+
+/** From the snapshot if there is one */
+static int read_sector(decoder_t* decoder, uint32_t block, uint32_t offset, void* dst, uint32_t size)
+{
+    if(decoder->internal.snapshot)
+        return disk_snapshot_read(decoder->disk, decoder->internal.snapshot, block, offset, dst, size);
+    memcpy(dst, decoder->disk->mem + block * DISK_BLOCK_SIZE + offset, size);
+    return size;
+}
+
+static int decode_sector(decoder_t* decoder, const uint32_t* blocks, int block_num, uint32_t file_size, int index)
+{
+    const uint8_t* sector = decoder->disk->mem + blocks[index] * DISK_BLOCK_SIZE;
+    if(decoder->internal.snapshot)
+    {
+        if(read_sector(decoder, blocks[index], 0, decoder->internal.sector, DISK_BLOCK_SIZE) < 0)
+            return -1;
+        sector = decoder->internal.sector;
+    }
+    uint32_t sector_size = index == block_num - 1 ? file_size - index * DISK_BLOCK_SIZE : DISK_BLOCK_SIZE;
+    if(index == 0)
+    {
+        bmp_t bmp = {0};
+        if(bmp_open(&bmp, sector, sector_size, decoder->output_format) != 0)
+        {
+            decoder->internal.bmp_valid = false;
+            return -1;
+        }
+        /** Everything decoded with the old header is invalid. */
+        if(!decoder->internal.bmp_valid ||
+            bmp.width != decoder->internal.bmp.width ||
+            bmp.height != decoder->internal.bmp.height ||
+            bmp.pixel_array_offset != decoder->internal.bmp.pixel_array_offset)
+        {
+            memset(decoder->internal.decoded_blocks, 0, sizeof(decoder->internal.decoded_blocks));
+        }
+        decoder->internal.bmp = bmp;
+        decoder->internal.bmp_valid = true;
+    }
+    if(!decoder->internal.bmp_valid)
+        return -1;
+    if(bmp_read_at(
+        &decoder->internal.bmp, 
+        index * DISK_BLOCK_SIZE, 
+        sector, 
+        sector_size, 
+        decoder->internal.frame, 
+        decoder->frame_size) < 0)
+        return -1;
+    /** Whichever side of the border comes last completes the pixel. */
+    if(index > 0)
+        decode_split_pixel(decoder, blocks, index);
+    if(index < block_num - 1)
+        decode_split_pixel(decoder, blocks, index + 1);
+    decoder->internal.decoded_blocks[index] = blocks[index];
+    return 0;
+}
+
+/** Decode the pixel across the border between sector index - 1 and sector index. */
+static void decode_split_pixel(decoder_t* decoder, const uint32_t* blocks, int index)
+{
+    const bmp_t* bmp = &decoder->internal.bmp;
+    uint32_t border = index * DISK_BLOCK_SIZE;
+    if(border <= bmp->pixel_array_offset)
+        return;
+    uint32_t total_bytes_in_row = (bmp->width * 3 + 3) & ~3;
+    uint32_t bytes_in_row = (border - bmp->pixel_array_offset) % total_bytes_in_row;
+    if(bytes_in_row >= bmp->width * 3 || bytes_in_row % 3 == 0)
+        return;
+    uint32_t pixel_start = border - bytes_in_row % 3;
+    uint32_t size_before = border - pixel_start;
+    uint8_t pixel[3];
+    if(read_sector(decoder, blocks[index - 1], DISK_BLOCK_SIZE - size_before, pixel, size_before) < 0 ||
+        read_sector(decoder, blocks[index], 0, pixel + size_before, sizeof(pixel) - size_before) < 0)
+        return;
+    bmp_read_at(bmp, pixel_start, pixel, sizeof(pixel), decoder->internal.frame, decoder->frame_size);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+/**
+ * Decode a bmp file on the disk into a frame buffer while its sectors are being written. The first file by default.
+ * The caller needs to hold the disk lock for all the calls.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "disk.h"
+#include "bmp.h"
+
+/** Enough for a 50*160 24bit bmp */
+#define DECODER_MAX_FILE_BLOCKS (64)
+
+typedef struct
+{
+    disk_t* disk;
+    uint32_t frame_size;
+    bmp_output_format_t output_format;
+    struct
+    {
+        uint8_t* frame;
+        bmp_t bmp;
+        bool bmp_valid;
+        /** Which file on the disk, 0 for the first */
+        uint32_t file;
+        /** The sectors are read from here during decoder_finish, if there is one */
+        disk_snapshot_t* snapshot;
+        uint8_t sector[DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+        /** The block each file sector was decoded from. 0 if not decoded. */
+        uint32_t decoded_blocks[DECODER_MAX_FILE_BLOCKS];
+    } internal;
+} decoder_t;
+
+int decoder_init(decoder_t* decoder);
+
+/**
+ * @brief Set the frame buffer to decode into. The content of the frame is considered unknown.
+ * 
+ * @param decoder 
+ * @param frame frame_size bytes
+ */
+void decoder_set_frame(decoder_t* decoder, uint8_t* frame);
+
+/**
+ * @brief Decode the file-th file on the disk from now on. What is decoded so far is dropped if the file changes.
+ * 
+ * @param decoder 
+ * @param file 0 for the first file
+ */
+void decoder_select_file(decoder_t* decoder, uint32_t file);
+
+/**
+ * @brief Call this on every disk write. The block is decoded right away if it belongs to the file.
+ * 
+ * @param decoder 
+ * @param block 
+ */
+void decoder_on_disk_write(decoder_t* decoder, uint32_t block);
+
+/**
+ * @brief Decode whatever is not decoded yet from the disk.
+ * 
+ * @param decoder 
+ * @param snapshot Optional. Read the sectors from here, the disk can be written meanwhile.
+ * The file system is still read from the disk, check the snapshot for writes to it after.
+ * @return int 0 if the frame holds a full image.
+ */
+int decoder_finish(decoder_t* decoder, disk_snapshot_t* snapshot);
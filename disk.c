@@ -3,51 +3,189 @@
 
 #include "disk.h"
 
+static int find_snapshot_block(const disk_snapshot_t* snapshot, uint32_t block)
+{
+    for(uint32_t i = 0; i < snapshot->block_num; i++)
+    {
+        if(snapshot->blocks[i] == block)
+            return i;
+    }
+    return -1;
+}
+
+/** Call this with the write lock held, before the block is changed */
+static void keep_for_snapshot(disk_t* disk, uint32_t block)
+{
+    disk_snapshot_t* snapshot = disk->internal.snapshot;
+    /** A backend may change any part of mem on a write, e.g. a flash write back */
+    if(snapshot && !snapshot->overflow && (disk->backend.write || find_snapshot_block(snapshot, block) < 0))
+    {
+        if(disk->backend.write || snapshot->block_num >= DISK_SNAPSHOT_MAX_BLOCKS)
+        {
+            snapshot->overflow = true;
+        }
+        else
+        {
+            memcpy(snapshot->internal.mem[snapshot->block_num], disk->mem + block * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+            snapshot->blocks[snapshot->block_num] = block;
+            /** The copy is complete before the readers can find it */
+            __sync_synchronize();
+            snapshot->block_num++;
+        }
+    }
+    __sync_synchronize();
+}
+
 int disk_init(disk_t* disk)
 {
-    if(!disk)
+    if(!disk || !disk->mem || disk->block_num == 0)
         return -1;
-    if(disk->hooks.rwlock_wrlock || disk->hooks.rwlock_unlock)
+    if(disk->backend.write && !disk->backend.read)
+        return -1;
+    if(disk->hooks.rwlock_wrlock || disk->hooks.rwlock_rdlock || disk->hooks.rwlock_unlock)
     {
         if(!disk->hooks.rwlock_wrlock || !disk->hooks.rwlock_unlock)
             return -1;
     }
+    disk->internal.snapshot = NULL;
     return 0;
 }
 
 int disk_write(disk_t* disk, uint32_t block, uint32_t offset, void const* src, uint32_t size)
 {
-	if(block * DISK_BLOCK_SIZE + offset + size > sizeof(disk->mem))
-	{
-		return -1;
-	}
-	if(offset + size > DISK_BLOCK_SIZE)
-	{
-		return -1;
-	}
+    if(block >= disk->block_num)
+    {
+        return -1;
+    }
+    if(offset + size > DISK_BLOCK_SIZE)
+    {
+        return -1;
+    }
     if(disk->hooks.rwlock_wrlock)
         disk->hooks.rwlock_wrlock(disk->hooks.rwlock_ctx);
 
-	memcpy(disk->mem + block * DISK_BLOCK_SIZE + offset, src, size);
+    int rc = size;
+    keep_for_snapshot(disk, block);
+    if(disk->backend.write)
+        rc = disk->backend.write(block, offset, src, size, disk->backend.ctx);
+    else
+        memcpy(disk->mem + block * DISK_BLOCK_SIZE + offset, src, size);
 
     if(disk->hooks.rwlock_unlock)
         disk->hooks.rwlock_unlock(disk->hooks.rwlock_ctx);
 
+    if(rc < 0)
+        return -1;
     if(disk->callbacks.on_write)
         disk->callbacks.on_write(block, disk->callbacks.on_write_ctx);
-	return size;
+    return size;
 }
 
 int disk_read(disk_t* disk, uint32_t block, uint32_t offset, void* dest, uint32_t size)
 {
-	if(block * DISK_BLOCK_SIZE + offset + size > sizeof(disk->mem))
-	{
-		return -1;
-	}
-	if(offset + size > DISK_BLOCK_SIZE)
-	{
-		return -1;
-	}
-	memcpy(dest, disk->mem + block * DISK_BLOCK_SIZE + offset, size);
-	return size;
+    if(block >= disk->block_num)
+    {
+        return -1;
+    }
+    if(offset + size > DISK_BLOCK_SIZE)
+    {
+        return -1;
+    }
+    if(disk->callbacks.on_read && disk->callbacks.on_read(block, offset, dest, size, disk->callbacks.on_read_ctx))
+        return size;
+    /** The backend cache is only safe to read with one of the locks. mem is up to the user without a read lock. */
+    void (*lock)(void* ctx) = disk->hooks.rwlock_rdlock;
+    if(!lock && disk->backend.read)
+        lock = disk->hooks.rwlock_wrlock;
+    if(lock)
+        lock(disk->hooks.rwlock_ctx);
+    int rc = size;
+    if(disk->backend.read)
+        rc = disk->backend.read(block, offset, dest, size, disk->backend.ctx);
+    else
+        memcpy(dest, disk->mem + block * DISK_BLOCK_SIZE + offset, size);
+    if(lock)
+        disk->hooks.rwlock_unlock(disk->hooks.rwlock_ctx);
+    return rc < 0 ? -1 : (int)size;
+}
+
+int disk_snapshot_begin(disk_t* disk, disk_snapshot_t* snapshot)
+{
+    if(!disk || !snapshot)
+        return -1;
+    snapshot->block_num = 0;
+    snapshot->overflow = false;
+    if(disk->hooks.rwlock_wrlock)
+        disk->hooks.rwlock_wrlock(disk->hooks.rwlock_ctx);
+    int rc = 0;
+    if(disk->internal.snapshot)
+        rc = -1;
+    else
+        disk->internal.snapshot = snapshot;
+    if(disk->hooks.rwlock_unlock)
+        disk->hooks.rwlock_unlock(disk->hooks.rwlock_ctx);
+    return rc;
+}
+
+int disk_snapshot_read(disk_t* disk, disk_snapshot_t* snapshot, uint32_t block, uint32_t offset, void* dst, uint32_t size)
+{
+    if(block >= disk->block_num || offset + size > DISK_BLOCK_SIZE)
+        return -1;
+    int index = find_snapshot_block(snapshot, block);
+    if(index < 0)
+    {
+        memcpy(dst, disk->mem + block * DISK_BLOCK_SIZE + offset, size);
+        __sync_synchronize();
+        /** Not copied yet, so the write did not start while we read */
+        index = find_snapshot_block(snapshot, block);
+        if(index < 0)
+            return snapshot->overflow ? -1 : (int)size;
+    }
+    memcpy(dst, snapshot->internal.mem[index] + offset, size);
+    return snapshot->overflow ? -1 : (int)size;
+}
+
+bool disk_snapshot_end(disk_t* disk, disk_snapshot_t* snapshot)
+{
+    if(disk->hooks.rwlock_wrlock)
+        disk->hooks.rwlock_wrlock(disk->hooks.rwlock_ctx);
+    if(disk->internal.snapshot == snapshot)
+        disk->internal.snapshot = NULL;
+    if(disk->hooks.rwlock_unlock)
+        disk->hooks.rwlock_unlock(disk->hooks.rwlock_ctx);
+    return !snapshot->overflow;
+}
+
+int disk_store(disk_t* disk, uint32_t block, void const* src)
+{
+    if(!disk || block >= disk->block_num)
+        return -1;
+    if(disk->backend.write)
+        return disk->backend.write(block, 0, src, DISK_BLOCK_SIZE, disk->backend.ctx);
+    memcpy(disk->mem + block * DISK_BLOCK_SIZE, src, DISK_BLOCK_SIZE);
+    return DISK_BLOCK_SIZE;
+}
+
+int disk_flush(disk_t* disk)
+{
+    if(!disk)
+        return -1;
+    if(!disk->backend.flush)
+        return 0;
+    if(disk->hooks.rwlock_wrlock)
+        disk->hooks.rwlock_wrlock(disk->hooks.rwlock_ctx);
+    keep_for_snapshot(disk, 0);
+    int rc = disk->backend.flush(disk->backend.ctx);
+    if(disk->hooks.rwlock_unlock)
+        disk->hooks.rwlock_unlock(disk->hooks.rwlock_ctx);
+    return rc;
+}
+
+int disk_sync(disk_t* disk)
+{
+    if(disk_flush(disk) != 0)
+        return -1;
+    if(disk->callbacks.on_sync)
+        disk->callbacks.on_sync(disk->callbacks.on_sync_ctx);
+    return 0;
 }
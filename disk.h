@@ -1,30 +1,85 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
+/** Size of the RAM disks */
 #define DISK_BLOCK_NUM 64
 #define DISK_BLOCK_SIZE 512
+/** Blocks a snapshot can keep. The host rarely gets further than this in one decode. */
+#define DISK_SNAPSHOT_MAX_BLOCKS 8
+
+/**
+ * The disk as it was at disk_snapshot_begin, for reading without the lock.
+ * A block is copied here before its first write after that. The others are read from mem.
+ */
+typedef struct
+{
+    /** The blocks written since the snapshot began. Read only. */
+    uint32_t blocks[DISK_SNAPSHOT_MAX_BLOCKS];
+    uint32_t block_num;
+    /** More blocks were written than kept, or mem was changed in some other way. The snapshot is lost. */
+    bool overflow;
+    struct
+    {
+        uint8_t mem[DISK_SNAPSHOT_MAX_BLOCKS][DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+    } internal;
+} disk_snapshot_t;
 
 typedef struct
 {
-    uint8_t mem[DISK_BLOCK_NUM * DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+    /** 
+     * block_num * DISK_BLOCK_SIZE bytes, 4 byte aligned. The users read the blocks from here directly.
+     * With a backend this may be read only, e.g. the XIP mapping of the flash. Call disk_flush first then.
+     */
+    uint8_t* mem;
+    uint32_t block_num;
     struct
     {
         /** DO NOT put a lot of logic in this! */
         void (*on_write)(uint32_t block, void* ctx);
         void* on_write_ctx;
+        /** The host says everything it wrote is on the disk. e.g. SYNCHRONIZE CACHE */
+        void (*on_sync)(void* ctx);
+        void* on_sync_ctx;
+        /** 
+         * Optional. Fill a disk_read instead of the disk, e.g. a file made up on every read. Called without the lock.
+         * Return false to read the disk.
+         */
+        bool (*on_read)(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* ctx);
+        void* on_read_ctx;
     } callbacks;
     struct
     {
         /** 
-         * The disk itself only locks on write.
+         * The disk itself locks on write, and on disk_read if rwlock_rdlock is set.
          * Since the read may across multiple blocks,
          * you should manage the read lock by yourself.
+         * Or read without it, see disk_snapshot_begin.
          */
         void (*rwlock_wrlock)(void* ctx);
+        /** Optional. Unlocked by rwlock_unlock too. */
+        void (*rwlock_rdlock)(void* ctx);
         void (*rwlock_unlock)(void* ctx);
         void* rwlock_ctx;
     } hooks;
+    /** 
+     * Optional. For a disk that cannot be written through mem. 
+     * All of them are called with the write lock held.
+     */
+    struct
+    {
+        int (*write)(uint32_t block, uint32_t offset, void const* src, uint32_t size, void* ctx);
+        /** Must see the writes that are not flushed yet */
+        int (*read)(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* ctx);
+        /** mem shows all the writes after this */
+        int (*flush)(void* ctx);
+        void* ctx;
+    } backend;
+    struct
+    {
+        disk_snapshot_t* snapshot;
+    } internal;
 } disk_t;
 
 /**
@@ -37,3 +92,61 @@ int disk_init(disk_t* disk);
 
 int disk_write(disk_t* disk, uint32_t block, uint32_t offset, void const* src, uint32_t size);
 int disk_read(disk_t* disk, uint32_t block, uint32_t offset, void* dst, uint32_t size);
+
+/**
+ * @brief Keep the content of the disk from now on, until disk_snapshot_end. Only one at a time.
+ * The writes are not held off, they copy the old block to the snapshot first.
+ * 
+ * @param disk 
+ * @param snapshot 
+ * @return int 
+ */
+int disk_snapshot_begin(disk_t* disk, disk_snapshot_t* snapshot);
+
+/**
+ * @brief Read a block as it was at disk_snapshot_begin. No lock is needed.
+ * 
+ * @param disk 
+ * @param snapshot 
+ * @param block 
+ * @param offset 
+ * @param dst 
+ * @param size 
+ * @return int -1 if the snapshot is lost
+ */
+int disk_snapshot_read(disk_t* disk, disk_snapshot_t* snapshot, uint32_t block, uint32_t offset, void* dst, uint32_t size);
+
+/**
+ * @brief Stop keeping the content. The written blocks stay in the snapshot for the caller to look at.
+ * 
+ * @param disk 
+ * @param snapshot 
+ * @return true Everything read through the snapshot is from the same moment.
+ */
+bool disk_snapshot_end(disk_t* disk, disk_snapshot_t* snapshot);
+
+/**
+ * @brief Write a whole block without the lock and the callbacks. For setting up the disk before it is shared, e.g. fat12_format.
+ * 
+ * @param disk 
+ * @param block 
+ * @param src DISK_BLOCK_SIZE bytes
+ * @return int 
+ */
+int disk_store(disk_t* disk, uint32_t block, void const* src);
+
+/**
+ * @brief Make mem show all the writes. This takes the write lock. Does nothing without a backend.
+ * 
+ * @param disk 
+ * @return int 
+ */
+int disk_flush(disk_t* disk);
+
+/**
+ * @brief The writes so far are complete. This flushes the backend, then tells the user.
+ * 
+ * @param disk 
+ * @return int 
+ */
+int disk_sync(disk_t* disk);
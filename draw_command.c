@@ -0,0 +1,154 @@
+#include <string.h>
+#include "draw_command.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static int get_args_size(uint8_t opcode);
+static void on_args(draw_command_t* draw_command);
+static uint32_t on_payload(draw_command_t* draw_command, const uint8_t* data, uint32_t size);
+static void finish_command(draw_command_t* draw_command);
+
+static uint32_t get_rgb(const uint8_t* args)
+{
+    return ((uint32_t)args[0] << 16) | ((uint32_t)args[1] << 8) | args[2];
+}
+
+int draw_command_init(draw_command_t* draw_command)
+{
+    if(!draw_command || !draw_command->canvas)
+        return -1;
+    memset(&draw_command->stats, 0, sizeof(draw_command->stats));
+    memset(&draw_command->internal, 0, sizeof(draw_command->internal));
+    return 0;
+}
+
+void draw_command_feed(draw_command_t* draw_command, const uint8_t* data, uint32_t size)
+{
+    while(size > 0)
+    {
+        /** A new command */
+        if(draw_command->internal.opcode == 0)
+        {
+            int args_size = get_args_size(data[0]);
+            data++;
+            size--;
+            if(args_size < 0)
+            {
+                draw_command->stats.errors++;
+                continue;
+            }
+            draw_command->internal.opcode = data[-1];
+            draw_command->internal.args_size = args_size;
+            draw_command->internal.args_received = 0;
+            draw_command->internal.payload_size = 0;
+            draw_command->internal.payload_received = 0;
+            if(args_size == 0)
+                on_args(draw_command);
+            continue;
+        }
+        if(draw_command->internal.args_received < draw_command->internal.args_size)
+        {
+            uint32_t args_size = MIN(size, draw_command->internal.args_size - draw_command->internal.args_received);
+            memcpy(draw_command->internal.args + draw_command->internal.args_received, data, args_size);
+            draw_command->internal.args_received += args_size;
+            data += args_size;
+            size -= args_size;
+            if(draw_command->internal.args_received == draw_command->internal.args_size)
+                on_args(draw_command);
+            continue;
+        }
+        uint32_t payload_size = on_payload(draw_command, data, size);
+        data += payload_size;
+        size -= payload_size;
+    }
+}
+
+static int get_args_size(uint8_t opcode)
+{
+    switch(opcode)
+    {
+        case DRAW_COMMAND_FILL_RECT:
+            return 7;
+        case DRAW_COMMAND_BLIT:
+            return 4;
+        case DRAW_COMMAND_TEXT:
+            return 10;
+        case DRAW_COMMAND_COMMIT:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/** The arguments are complete. Carry out the command, or find out how much payload follows. */
+static void on_args(draw_command_t* draw_command)
+{
+    const uint8_t* args = draw_command->internal.args;
+    switch(draw_command->internal.opcode)
+    {
+        case DRAW_COMMAND_FILL_RECT:
+            canvas_fill_rect(draw_command->canvas, args[0], args[1], args[2], args[3], get_rgb(args + 4));
+            finish_command(draw_command);
+            break;
+        case DRAW_COMMAND_BLIT:
+            draw_command->internal.payload_size = args[2] * args[3] * canvas_get_pixel_size(draw_command->canvas);
+            if(draw_command->internal.payload_size == 0)
+                finish_command(draw_command);
+            break;
+        case DRAW_COMMAND_TEXT:
+            draw_command->internal.payload_size = args[9];
+            if(draw_command->internal.payload_size == 0)
+                finish_command(draw_command);
+            break;
+        case DRAW_COMMAND_COMMIT:
+            if(draw_command->callbacks.on_commit)
+                draw_command->callbacks.on_commit(draw_command->callbacks.on_commit_ctx);
+            finish_command(draw_command);
+            break;
+    }
+}
+
+static uint32_t on_payload(draw_command_t* draw_command, const uint8_t* data, uint32_t size)
+{
+    const uint8_t* args = draw_command->internal.args;
+    uint32_t payload_size = MIN(size, draw_command->internal.payload_size - draw_command->internal.payload_received);
+    if(draw_command->internal.opcode == DRAW_COMMAND_TEXT)
+    {
+        memcpy(draw_command->internal.text + draw_command->internal.payload_received, data, payload_size);
+        draw_command->internal.payload_received += payload_size;
+        if(draw_command->internal.payload_received == draw_command->internal.payload_size)
+        {
+            canvas_draw_text(
+                draw_command->canvas,
+                args[0],
+                args[1],
+                draw_command->internal.text,
+                draw_command->internal.payload_size,
+                get_rgb(args + 3),
+                get_rgb(args + 6),
+                args[2]);
+            finish_command(draw_command);
+        }
+        return payload_size;
+    }
+    /** Blit. Gather a row, as a row may be split between two usb packets. */
+    uint32_t row_size = args[2] * canvas_get_pixel_size(draw_command->canvas);
+    uint32_t offset_in_row = draw_command->internal.payload_received % row_size;
+    payload_size = MIN(payload_size, row_size - offset_in_row);
+    memcpy(draw_command->internal.row + offset_in_row, data, payload_size);
+    draw_command->internal.payload_received += payload_size;
+    if(offset_in_row + payload_size == row_size)
+    {
+        int row = (draw_command->internal.payload_received - 1) / row_size;
+        canvas_blit_row(draw_command->canvas, args[0], args[1] + row, draw_command->internal.row, args[2]);
+    }
+    if(draw_command->internal.payload_received == draw_command->internal.payload_size)
+        finish_command(draw_command);
+    return payload_size;
+}
+
+static void finish_command(draw_command_t* draw_command)
+{
+    draw_command->internal.opcode = 0;
+    draw_command->stats.commands++;
+}
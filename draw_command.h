@@ -0,0 +1,63 @@
+#pragma once
+
+/**
+ * A compact binary command set to draw on the frame instead of sending whole frames.
+ * Each command is an opcode byte followed by its arguments. Coordinates are 1 byte, colors are 3 bytes r g b.
+ *   FILL_RECT: x y w h r g b
+ *   BLIT:      x y w h, then w*h pixels in the lcd pixel format, rows top -> down
+ *   TEXT:      x y scale r g b background_r background_g background_b length, then length ascii characters
+ *   COMMIT:    send what was drawn to the lcd
+ * Unknown opcodes are counted as errors and skipped one byte at a time.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "canvas.h"
+
+#define DRAW_COMMAND_FILL_RECT (0x01)
+#define DRAW_COMMAND_BLIT (0x02)
+#define DRAW_COMMAND_TEXT (0x03)
+#define DRAW_COMMAND_COMMIT (0x04)
+
+#define DRAW_COMMAND_MAX_ARGS (10)
+#define DRAW_COMMAND_MAX_TEXT (255)
+
+typedef struct
+{
+    canvas_t* canvas;
+    struct
+    {
+        /** DO NOT put a lot of logic in this! */
+        void (*on_commit)(void* ctx);
+        void* on_commit_ctx;
+    } callbacks;
+    struct
+    {
+        uint32_t commands;
+        uint32_t errors;
+    } stats;
+    struct
+    {
+        uint8_t opcode;
+        uint8_t args[DRAW_COMMAND_MAX_ARGS];
+        uint32_t args_size;
+        uint32_t args_received;
+        /** The blit pixels or the text after the arguments */
+        uint32_t payload_size;
+        uint32_t payload_received;
+        uint8_t row[256 * 3];
+        char text[DRAW_COMMAND_MAX_TEXT];
+    } internal;
+} draw_command_t;
+
+int draw_command_init(draw_command_t* draw_command);
+
+/**
+ * @brief Feed the received bytes. The commands are carried out as soon as they are complete.
+ * The caller needs to make sure the canvas frame is not used by someone else meanwhile.
+ * 
+ * @param draw_command 
+ * @param data 
+ * @param size 
+ */
+void draw_command_feed(draw_command_t* draw_command, const uint8_t* data, uint32_t size);
@@ -1,7 +1,15 @@
 #include "fat12.h"
 #include <string.h>
 
+/** Root directory entries of the RAM disk. One block. */
 #define BOOT_ENTRY_NUM (16)
+/** Root directory entries of the larger disks, same as what the hosts format with */
+#define LARGE_BOOT_ENTRY_NUM (512)
+/** FAT12 end of chain markers are 0xFF8-0xFFF */
+#define FAT12_END_OF_CHAIN (0xFF8)
+/** Hosts take a volume with more clusters as FAT16 */
+#define FAT12_MAX_CLUSTER_NUM (4084)
+#define FIRST_CLUSTER (2)
 
 typedef struct
 {
@@ -53,6 +61,19 @@ typedef struct
     uint32_t file_size;
 } __attribute__((packed)) fat_directory_entry_t;
 
+/** Where everything is. Read from the boot sector, so a disk the host formatted itself works too. */
+typedef struct
+{
+    uint32_t block_num;
+    uint32_t sector_per_cluster;
+    uint32_t fat_block;
+    uint32_t root_block;
+    uint32_t root_entry_num;
+    uint32_t first_data_block;
+    /** Data clusters are FIRST_CLUSTER to cluster_end - 1 */
+    uint32_t cluster_end;
+} geometry_t;
+
 static const fat_boot_sector_t default_boot_sector = {
     .jmp_boot = {0xEB, 0x3C, 0x90},
     .oem_name = "MSDOS5.0",
@@ -93,36 +114,119 @@ static const fat_directory_entry_t volume_label_entry = {
     .file_size = 0
 };
 
+static int get_geometry(const disk_t* disk, geometry_t* geometry)
+{
+    const fat_boot_sector_t* boot = (const fat_boot_sector_t*)disk->mem;
+    if(boot->boot_sector_signature != 0xAA55 || boot->byte_per_sector != DISK_BLOCK_SIZE)
+        return -1;
+    if(boot->sector_per_cluster == 0 || boot->reserved_sectors == 0 || boot->fat_num == 0 || boot->root_entry_num == 0)
+        return -1;
+    geometry->block_num = boot->sector_num ? boot->sector_num : boot->sector_num_big;
+    if(geometry->block_num > disk->block_num)
+        geometry->block_num = disk->block_num;
+    geometry->sector_per_cluster = boot->sector_per_cluster;
+    geometry->fat_block = boot->reserved_sectors;
+    geometry->root_block = geometry->fat_block + boot->fat_num * boot->sector_per_fat;
+    geometry->root_entry_num = boot->root_entry_num;
+    geometry->first_data_block = geometry->root_block + 
+        (geometry->root_entry_num * sizeof(fat_directory_entry_t) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if(geometry->first_data_block >= geometry->block_num)
+        return -1;
+    geometry->cluster_end = FIRST_CLUSTER + (geometry->block_num - geometry->first_data_block) / geometry->sector_per_cluster;
+    if(geometry->cluster_end > FIRST_CLUSTER + FAT12_MAX_CLUSTER_NUM)
+        geometry->cluster_end = FIRST_CLUSTER + FAT12_MAX_CLUSTER_NUM;
+    return 0;
+}
+
+static uint32_t get_cluster_block(const geometry_t* geometry, uint16_t cluster)
+{
+    return geometry->first_data_block + (cluster - FIRST_CLUSTER) * geometry->sector_per_cluster;
+}
+
+static bool is_data_cluster(const geometry_t* geometry, uint16_t cluster)
+{
+    return cluster >= FIRST_CLUSTER && cluster < geometry->cluster_end;
+}
+
+static const fat_directory_entry_t* get_root_entry(const disk_t* disk, const geometry_t* geometry, int index)
+{
+    /** This is safe to do as disk->mem is aligned */
+    return (const fat_directory_entry_t*)(disk->mem + DISK_BLOCK_SIZE * geometry->root_block + index * sizeof(fat_directory_entry_t));
+}
+
 int fat12_format(disk_t* disk)
 {
-    if(!disk)
+    if(!disk || disk->block_num < 4)
         return -1;
+    fat_boot_sector_t boot = default_boot_sector;
+    /** The RAM disk keeps its 3 block layout. The larger ones get more files and larger clusters, FAT12 has at most 4084 clusters. */
+    if(disk->block_num > DISK_BLOCK_NUM)
+        boot.root_entry_num = LARGE_BOOT_ENTRY_NUM;
+    uint32_t root_blocks = (boot.root_entry_num * sizeof(fat_directory_entry_t) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    while((disk->block_num - 1 - root_blocks) / boot.sector_per_cluster > FAT12_MAX_CLUSTER_NUM)
+        boot.sector_per_cluster *= 2;
+    uint32_t cluster_num = (disk->block_num - 1 - root_blocks) / boot.sector_per_cluster;
+    /** 1.5 bytes per entry, including the 2 reserved ones */
+    boot.sector_per_fat = ((cluster_num + FIRST_CLUSTER) * 3 / 2 + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if(disk->block_num < 0x10000)
+        boot.sector_num = disk->block_num;
+    else
+    {
+        boot.sector_num = 0;
+        boot.sector_num_big = disk->block_num;
+    }
+    uint32_t root_block = boot.reserved_sectors + boot.sector_per_fat;
+
+    uint8_t block[DISK_BLOCK_SIZE] __attribute__((aligned(4)));
     /** Sector 0. Boot sector */
-    memcpy(disk->mem, &default_boot_sector, sizeof(fat_boot_sector_t));
-    /** Sector 1. FAT */
-    memset(disk->mem + DISK_BLOCK_SIZE, 0, DISK_BLOCK_SIZE);
-    memcpy(disk->mem + DISK_BLOCK_SIZE, default_fat_entry, sizeof(default_fat_entry));
-    /** Sector 2. Root directory */
-    memset(disk->mem + DISK_BLOCK_SIZE * 2, 0, DISK_BLOCK_SIZE);
-    memcpy(disk->mem + DISK_BLOCK_SIZE * 2, &volume_label_entry, sizeof(fat_directory_entry_t));
+    memcpy(block, &boot, sizeof(fat_boot_sector_t));
+    if(disk_store(disk, 0, block) < 0)
+        return -1;
+    /** FAT */
+    for(uint32_t i = 0; i < boot.sector_per_fat; i++)
+    {
+        memset(block, 0, DISK_BLOCK_SIZE);
+        if(i == 0)
+            memcpy(block, default_fat_entry, sizeof(default_fat_entry));
+        if(disk_store(disk, boot.reserved_sectors + i, block) < 0)
+            return -1;
+    }
+    /** Root directory */
+    for(uint32_t i = 0; i < root_blocks; i++)
+    {
+        memset(block, 0, DISK_BLOCK_SIZE);
+        if(i == 0)
+            memcpy(block, &volume_label_entry, sizeof(fat_directory_entry_t));
+        if(disk_store(disk, root_block + i, block) < 0)
+            return -1;
+    }
     return 0;
 }
 
+bool fat12_is_formatted(disk_t* disk)
+{
+    geometry_t geometry;
+    return disk && get_geometry(disk, &geometry) == 0;
+}
+
 int fat12_open_next_file(disk_t* disk, fat12_file_reader_t* reader)
 {
     if(!reader || !disk)
         return -1;
-    fat_directory_entry_t* entry = NULL;
+    geometry_t geometry;
+    if(get_geometry(disk, &geometry) != 0)
+        return -1;
+    const fat_directory_entry_t* entry = NULL;
     for(;;)
     {
         reader->entry++;
-        if(reader->entry >= BOOT_ENTRY_NUM)
+        if(reader->entry >= (int)geometry.root_entry_num)
             return -1;
-        /** This is safe to do as disk->mem is aligned */
-        entry = (fat_directory_entry_t*)(disk->mem + DISK_BLOCK_SIZE * 2 + reader->entry * sizeof(fat_directory_entry_t));
-        if(entry->filename[0] == 0 || entry->filename[0] == 0xE5 || entry->filename[0] == 0x05 || entry->filename[0] == 0x2E)
+        entry = get_root_entry(disk, &geometry, reader->entry);
+        if(entry->filename[0] == 0 || (uint8_t)entry->filename[0] == 0xE5 || entry->filename[0] == 0x05 || entry->filename[0] == 0x2E)
             continue;
-        if(entry->attribute.directory || entry->attribute.volume_id)
+        /** Not frames. e.g. The virtual files. */
+        if(entry->attribute.directory || entry->attribute.volume_id || entry->attribute.system)
             continue;
         break;
     }
@@ -131,6 +235,7 @@ int fat12_open_next_file(disk_t* disk, fat12_file_reader_t* reader)
     reader->size = entry->file_size;
     reader->size_read = 0;
     reader->current_sector = entry->first_logical_cluster;
+    reader->sector_in_cluster = 0;
     return 0;
 }
 
@@ -152,18 +257,298 @@ const uint8_t* fat12_read_file_next_sector(disk_t* disk, fat12_file_reader_t* re
 {
     if(!reader || !disk || !size)
         return NULL;
-    if(reader->current_sector == 0 || reader->current_sector == 0xFFF || reader->size == 0)
+    geometry_t geometry;
+    if(get_geometry(disk, &geometry) != 0)
+        return NULL;
+    if(!is_data_cluster(&geometry, reader->current_sector) || reader->size == 0)
         return NULL;
     if(reader->size_read >= reader->size)
         return NULL;
     int read_size = reader->size - reader->size_read < DISK_BLOCK_SIZE ? reader->size - reader->size_read : DISK_BLOCK_SIZE;
-    const uint8_t* sector = disk->mem + DISK_BLOCK_SIZE * (1 + reader->current_sector);
+    const uint8_t* sector = disk->mem + DISK_BLOCK_SIZE * (get_cluster_block(&geometry, reader->current_sector) + reader->sector_in_cluster);
     reader->size_read += read_size;
 
-    reader->current_sector = read_fat_entry_at(disk->mem + DISK_BLOCK_SIZE, reader->current_sector);
+    if(++reader->sector_in_cluster >= geometry.sector_per_cluster)
+    {
+        reader->sector_in_cluster = 0;
+        reader->current_sector = read_fat_entry_at(disk->mem + DISK_BLOCK_SIZE * geometry.fat_block, reader->current_sector);
+    }
 
     *size = read_size;
     return sector;
 }
 
+int fat12_get_file_blocks(disk_t* disk, const fat12_file_reader_t* reader, uint32_t* blocks, int max_blocks)
+{
+    if(!reader || !disk || !blocks)
+        return -1;
+    geometry_t geometry;
+    if(get_geometry(disk, &geometry) != 0)
+        return -1;
+    int block_num = (reader->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if(block_num > max_blocks)
+        return -1;
+    const uint8_t* fat = disk->mem + DISK_BLOCK_SIZE * geometry.fat_block;
+    uint16_t cluster = reader->current_sector;
+    for(int i = 0; i < block_num; i++)
+    {
+        if(!is_data_cluster(&geometry, cluster))
+            return -1;
+        uint32_t sector_in_cluster = i % geometry.sector_per_cluster;
+        blocks[i] = get_cluster_block(&geometry, cluster) + sector_in_cluster;
+        if(sector_in_cluster == geometry.sector_per_cluster - 1)
+            cluster = read_fat_entry_at(fat, cluster);
+    }
+    return block_num;
+}
+
+void fat12_write_tracker_reset(fat12_write_tracker_t* tracker, disk_t* disk)
+{
+    memset(tracker->written_blocks, 0, sizeof(tracker->written_blocks));
+    fat12_file_reader_t reader = {0};
+    if(fat12_open_next_file(disk, &reader) == 0)
+    {
+        tracker->file_cluster = reader.current_sector;
+        tracker->file_size = reader.size;
+    }
+    else
+    {
+        tracker->file_cluster = 0;
+        tracker->file_size = 0;
+    }
+}
+
+static bool is_block_written(const fat12_write_tracker_t* tracker, uint32_t block)
+{
+    if(block >= DISK_BLOCK_NUM)
+        return false;
+    return (tracker->written_blocks[block / 32] & (1u << (block % 32))) != 0;
+}
+
+bool fat12_write_tracker_on_write(fat12_write_tracker_t* tracker, disk_t* disk, uint32_t block)
+{
+    if(!tracker || !disk || block >= DISK_BLOCK_NUM)
+        return false;
+    tracker->written_blocks[block / 32] |= 1u << (block % 32);
+
+    fat12_file_reader_t reader = {0};
+    if(fat12_open_next_file(disk, &reader) != 0 || reader.size == 0)
+    {
+        tracker->stats.no_file++;
+        return false;
+    }
+    geometry_t geometry;
+    uint32_t blocks[DISK_BLOCK_NUM];
+    int block_num = fat12_get_file_blocks(disk, &reader, blocks, DISK_BLOCK_NUM);
+    /** The chain must end right where the size says. Otherwise the FAT is not updated yet. */
+    if(block_num <= 0 || get_geometry(disk, &geometry) != 0 ||
+        read_fat_entry_at(
+            disk->mem + DISK_BLOCK_SIZE * geometry.fat_block, 
+            FIRST_CLUSTER + (blocks[block_num - 1] - geometry.first_data_block) / geometry.sector_per_cluster) < FAT12_END_OF_CHAIN)
+    {
+        tracker->stats.broken_chain++;
+        return false;
+    }
+    for(int i = 0; i < block_num; i++)
+    {
+        if(!is_block_written(tracker, blocks[i]))
+        {
+            tracker->stats.data_pending++;
+            return false;
+        }
+    }
+    tracker->stats.complete++;
+    return true;
+}
 
+fat12_region_t fat12_get_block_region(disk_t* disk, uint32_t block)
+{
+    geometry_t geometry;
+    if(block == 0 || get_geometry(disk, &geometry) != 0)
+        return FAT12_REGION_BOOT;
+    if(block < geometry.fat_block)
+        return FAT12_REGION_BOOT;
+    if(block < geometry.root_block)
+        return FAT12_REGION_FAT;
+    if(block < geometry.first_data_block)
+        return FAT12_REGION_ROOT;
+    return FAT12_REGION_DATA;
+}
+
+int fat12_get_block_owner(disk_t* disk, uint32_t block)
+{
+    geometry_t geometry;
+    if(!disk || get_geometry(disk, &geometry) != 0)
+        return -1;
+    if(block < geometry.first_data_block || block >= geometry.block_num)
+        return -1;
+    uint16_t block_cluster = FIRST_CLUSTER + (block - geometry.first_data_block) / geometry.sector_per_cluster;
+    const uint8_t* fat = disk->mem + DISK_BLOCK_SIZE * geometry.fat_block;
+    for(int i = 0; i < (int)geometry.root_entry_num; i++)
+    {
+        const fat_directory_entry_t* entry = get_root_entry(disk, &geometry, i);
+        if(entry->filename[0] == 0 || (uint8_t)entry->filename[0] == 0xE5 || entry->attribute.volume_id)
+            continue;
+        /** Directories have no size. Follow the chain to the end for everyone. */
+        uint16_t cluster = entry->first_logical_cluster;
+        for(uint32_t j = FIRST_CLUSTER; j < geometry.cluster_end; j++)
+        {
+            if(!is_data_cluster(&geometry, cluster))
+                break;
+            if(cluster == block_cluster)
+                return i;
+            cluster = read_fat_entry_at(fat, cluster);
+        }
+    }
+    return -1;
+}
+
+bool fat12_write_tracker_is_file_touched(const fat12_write_tracker_t* tracker, disk_t* disk)
+{
+    if(!tracker || !disk)
+        return false;
+    fat12_file_reader_t reader = {0};
+    if(fat12_open_next_file(disk, &reader) != 0)
+        return false;
+    if(reader.current_sector != tracker->file_cluster || reader.size != tracker->file_size)
+        return true;
+    uint32_t blocks[DISK_BLOCK_NUM];
+    int block_num = fat12_get_file_blocks(disk, &reader, blocks, DISK_BLOCK_NUM);
+    for(int i = 0; i < block_num; i++)
+    {
+        if(is_block_written(tracker, blocks[i]))
+            return true;
+    }
+    return false;
+}
+
+/** Set the bytes of a FAT entry that are in the FAT block index, held in block */
+static void set_fat_entry_in_block(uint8_t* block, uint32_t index, uint16_t cluster, uint16_t value)
+{
+    for(uint32_t i = 0; i < 2; i++)
+    {
+        uint32_t byte = cluster * 3 / 2 + i;
+        if(byte / DISK_BLOCK_SIZE != index)
+            continue;
+        uint8_t* p = block + byte % DISK_BLOCK_SIZE;
+        if(cluster % 2 == 0)
+            *p = i == 0 ? value & 0xFF : (*p & 0xF0) | ((value >> 8) & 0x0F);
+        else
+            *p = i == 0 ? (*p & 0x0F) | ((value & 0x0F) << 4) : (value >> 4) & 0xFF;
+    }
+}
+
+int fat12_add_virtual_file(disk_t* disk, fat12_virtual_file_t* file)
+{
+    if(!disk || !file || !file->text || file->size == 0)
+        return -1;
+    file->internal.added = false;
+    geometry_t geometry;
+    if(get_geometry(disk, &geometry) != 0)
+        return -1;
+    uint32_t cluster_size = geometry.sector_per_cluster * DISK_BLOCK_SIZE;
+    uint32_t cluster_num = (file->size + cluster_size - 1) / cluster_size;
+    if(cluster_num >= geometry.cluster_end - FIRST_CLUSTER)
+        return -1;
+    /** One run at the end, the hosts fill the disk from the start */
+    uint16_t first_cluster = geometry.cluster_end - cluster_num;
+    const uint8_t* fat = disk->mem + DISK_BLOCK_SIZE * geometry.fat_block;
+    int entry_index = -1;
+    bool found = false;
+    for(int i = 0; i < (int)geometry.root_entry_num; i++)
+    {
+        const fat_directory_entry_t* entry = get_root_entry(disk, &geometry, i);
+        if(entry->filename[0] == 0 || (uint8_t)entry->filename[0] == 0xE5)
+        {
+            if(entry_index < 0)
+                entry_index = i;
+            /** The hosts stop at the first never used entry */
+            if(entry->filename[0] == 0)
+                break;
+            continue;
+        }
+        if(memcmp(entry->filename, file->filename, sizeof(entry->filename)) == 0)
+        {
+            if(entry->first_logical_cluster != first_cluster || entry->file_size != file->size)
+                return -1;
+            entry_index = i;
+            found = true;
+            break;
+        }
+    }
+    if(entry_index < 0)
+        return -1;
+    if(!found)
+    {
+        for(uint32_t i = 0; i < cluster_num; i++)
+        {
+            if(read_fat_entry_at(fat, first_cluster + i) != 0)
+                return -1;
+        }
+        const fat_boot_sector_t* boot = (const fat_boot_sector_t*)disk->mem;
+        uint8_t block[DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+        /** Only the FAT blocks with the chain in them, in every copy of the FAT */
+        uint32_t first_index = first_cluster * 3 / 2 / DISK_BLOCK_SIZE;
+        uint32_t last_index = ((uint32_t)first_cluster + cluster_num) * 3 / 2 / DISK_BLOCK_SIZE;
+        for(uint32_t copy = 0; copy < boot->fat_num; copy++)
+        {
+            for(uint32_t index = first_index; index <= last_index && index < boot->sector_per_fat; index++)
+            {
+                memcpy(block, fat + index * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+                for(uint32_t i = 0; i < cluster_num; i++)
+                {
+                    uint16_t next = i == cluster_num - 1 ? 0xFFF : first_cluster + i + 1;
+                    set_fat_entry_in_block(block, index, first_cluster + i, next);
+                }
+                if(disk_store(disk, geometry.fat_block + copy * boot->sector_per_fat + index, block) < 0)
+                    return -1;
+            }
+        }
+        uint32_t entry_block = geometry.root_block + entry_index * sizeof(fat_directory_entry_t) / DISK_BLOCK_SIZE;
+        memcpy(block, disk->mem + entry_block * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+        fat_directory_entry_t entry = {
+            .attribute = {.read_only = 1, .system = 1},
+            .first_logical_cluster = first_cluster,
+            .file_size = file->size
+        };
+        memcpy(entry.filename, file->filename, sizeof(entry.filename));
+        memcpy(block + entry_index * sizeof(fat_directory_entry_t) % DISK_BLOCK_SIZE, &entry, sizeof(entry));
+        if(disk_store(disk, entry_block, block) < 0)
+            return -1;
+    }
+    file->internal.entry = entry_index;
+    file->internal.first_cluster = first_cluster;
+    file->internal.first_block = get_cluster_block(&geometry, first_cluster);
+    file->internal.block_num = cluster_num * geometry.sector_per_cluster;
+    file->internal.added = true;
+    return 0;
+}
+
+bool fat12_read_virtual_file(disk_t* disk, fat12_virtual_file_t* file, uint32_t block, uint32_t offset, void* dst, uint32_t size)
+{
+    if(!file->internal.added || block < file->internal.first_block || block >= file->internal.first_block + file->internal.block_num)
+        return false;
+    if(offset + size > DISK_BLOCK_SIZE)
+        return false;
+    /** The host may have deleted it and put another file there */
+    geometry_t geometry;
+    if(get_geometry(disk, &geometry) != 0)
+        return false;
+    const fat_directory_entry_t* entry = get_root_entry(disk, &geometry, file->internal.entry);
+    if(memcmp(entry->filename, file->filename, sizeof(entry->filename)) != 0 || entry->first_logical_cluster != file->internal.first_cluster)
+        return false;
+    uint32_t file_offset = (block - file->internal.first_block) * DISK_BLOCK_SIZE + offset;
+    if(file_offset == 0)
+    {
+        uint32_t length = file->callbacks.on_read ? file->callbacks.on_read(file->text, file->size, file->callbacks.on_read_ctx) : 0;
+        if(length > file->size - 1)
+            length = file->size - 1;
+        memset(file->text + length, ' ', file->size - length);
+        file->text[file->size - 1] = '\n';
+    }
+    /** Past the end of the file, the rest of the cluster */
+    memset(dst, 0, size);
+    if(file_offset < file->size)
+        memcpy(dst, file->text + file_offset, file->size - file_offset < size ? file->size - file_offset : size);
+    return true;
+}
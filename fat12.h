@@ -1,9 +1,45 @@
 #pragma once
 
+#include <stdbool.h>
 #include "disk.h"
 
+/**
+ * @brief Make an empty FAT12 volume the size of the disk. Goes through disk_store.
+ * The geometry scales with the disk, the RAM disk keeps its 3 blocks of file system.
+ * 
+ * @param disk 
+ * @return int 
+ */
 int fat12_format(disk_t* disk);
 
+/**
+ * @brief The boot sector describes a FAT volume this can read. All the others read the geometry from there too.
+ * 
+ * @param disk 
+ * @return true 
+ */
+bool fat12_is_formatted(disk_t* disk);
+
+typedef enum
+{
+    FAT12_REGION_BOOT,
+    FAT12_REGION_FAT,
+    FAT12_REGION_ROOT,
+    FAT12_REGION_DATA
+} fat12_region_t;
+
+/** Everything before the FAT, and every block while the boot sector is not valid, counts as boot. */
+fat12_region_t fat12_get_block_region(disk_t* disk, uint32_t block);
+
+/**
+ * @brief Find the file or directory a data block belongs to by following the cluster chains.
+ * 
+ * @param disk 
+ * @param block 
+ * @return int The root directory entry of the owner. -1 if the block is free or not a data block.
+ */
+int fat12_get_block_owner(disk_t* disk, uint32_t block);
+
 typedef struct
 {
     int entry;
@@ -11,10 +47,127 @@ typedef struct
     char filename[11 + 1];
     uint32_t size;
     uint32_t size_read;
+    /** The current cluster */
     uint16_t current_sector;
+    uint16_t sector_in_cluster;
 } fat12_file_reader_t;
 
 int fat12_open_next_file(disk_t* disk, fat12_file_reader_t* reader);
 
 const uint8_t* fat12_read_file_next_sector(disk_t* disk, fat12_file_reader_t* reader, int* size);
 
+/**
+ * @brief Get the blocks of a file in order, by following the cluster chain.
+ * Call this right after fat12_open_next_file.
+ * 
+ * @param disk 
+ * @param reader 
+ * @param blocks 
+ * @param max_blocks 
+ * @return int Number of blocks. -1 if the chain is broken or too long.
+ */
+int fat12_get_file_blocks(disk_t* disk, const fat12_file_reader_t* reader, uint32_t* blocks, int max_blocks);
+
+/**
+ * Tell when the first file on the disk is fully written, regardless of the order the host writes
+ * the directory entry, the FAT and the data in.
+ */
+typedef struct
+{
+    /** Blocks written since the last reset. One bit per block. Only the RAM disk size is covered. */
+    uint32_t written_blocks[(DISK_BLOCK_NUM + 31) / 32];
+    /** The first file at the last reset */
+    uint16_t file_cluster;
+    uint32_t file_size;
+    /** Why the file was not complete after each write */
+    struct
+    {
+        uint32_t complete;
+        uint32_t no_file;
+        uint32_t broken_chain;
+        uint32_t data_pending;
+    } stats;
+} fat12_write_tracker_t;
+
+/**
+ * @brief Forget the written blocks and remember the current first file. The stats are kept.
+ * Call this with the disk lock held.
+ * 
+ * @param tracker 
+ * @param disk 
+ */
+void fat12_write_tracker_reset(fat12_write_tracker_t* tracker, disk_t* disk);
+
+/**
+ * @brief Call this on every disk write with the disk lock held.
+ * 
+ * @param tracker 
+ * @param disk 
+ * @param block 
+ * @return true The directory entry, the cluster chain and the file size agree,
+ * and every data block of the file has been written since the last reset.
+ */
+bool fat12_write_tracker_on_write(fat12_write_tracker_t* tracker, disk_t* disk, uint32_t block);
+
+/**
+ * @brief Call this with the disk lock held.
+ * 
+ * @param tracker 
+ * @param disk 
+ * @return true Any data block of the first file has been written since the last reset,
+ * or the first file is not the one at the last reset.
+ */
+bool fat12_write_tracker_is_file_touched(const fat12_write_tracker_t* tracker, disk_t* disk);
+
+/**
+ * A read only file in the root directory, made up on every host read, e.g. stats. Its content is never stored.
+ * It takes the first free root directory entry and the last clusters of the disk.
+ * It is a system file, fat12_open_next_file skips those, so it is never taken as the frame file.
+ * If the host deletes it, it comes back on the next format.
+ */
+typedef struct
+{
+    /** 8.3 as in the directory, space padded. e.g. "STATS   TXT" */
+    char filename[11];
+    /** Fixed, the hosts cache the size. The text is padded to it with spaces. */
+    uint32_t size;
+    /** size bytes. Made on a read of the first block of the file, the other blocks are read from here. */
+    char* text;
+    struct
+    {
+        /** Write at most size - 1 characters of text and return how many. Called in the usb task. */
+        uint32_t (*on_read)(char* text, uint32_t size, void* ctx);
+        void* on_read_ctx;
+    } callbacks;
+    struct
+    {
+        bool added;
+        int entry;
+        uint16_t first_cluster;
+        uint32_t first_block;
+        uint32_t block_num;
+    } internal;
+} fat12_virtual_file_t;
+
+/**
+ * @brief Put the file in the root directory, after fat12_format. Goes through disk_store.
+ * A file of the same name and size already there is taken over, e.g. on the flash disk from the last boot.
+ * 
+ * @param disk 
+ * @param file 
+ * @return int -1 if there is no free entry, or the last clusters are taken.
+ */
+int fat12_add_virtual_file(disk_t* disk, fat12_virtual_file_t* file);
+
+/**
+ * @brief Fill a read of the file. Call it from the disk on_read callback.
+ * 
+ * @param disk 
+ * @param file 
+ * @param block 
+ * @param offset 
+ * @param dst 
+ * @param size 
+ * @return true The block is in the file, dst is filled. false if it is not, or the host deleted the file.
+ */
+bool fat12_read_virtual_file(disk_t* disk, fat12_virtual_file_t* file, uint32_t block, uint32_t offset, void* dst, uint32_t size);
@@ -0,0 +1,147 @@
+#include <string.h>
+#include <hardware/flash.h>
+#include <hardware/regs/addressmap.h>
+#include <pico/flash.h>
+#include "flash_disk.h"
+
+/** Long enough for the other core to get out of the flash, if it is running */
+#define FLASH_SAFE_EXECUTE_TIMEOUT_MS (100)
+
+static int flash_disk_write(uint32_t block, uint32_t offset, void const* src, uint32_t size, void* ctx);
+static int flash_disk_read(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* ctx);
+static int flash_disk_flush(void* ctx);
+
+typedef struct
+{
+    uint32_t flash_offset;
+    const uint8_t* data;
+    bool erase;
+} write_back_t;
+
+int flash_disk_init(flash_disk_t* flash_disk, disk_t* disk)
+{
+    if(!flash_disk || !disk)
+        return -1;
+    if(flash_disk->flash_offset % FLASH_SECTOR_SIZE != 0 || flash_disk->size % FLASH_SECTOR_SIZE != 0 || flash_disk->size == 0)
+        return -1;
+    memset(&flash_disk->stats, 0, sizeof(flash_disk->stats));
+    flash_disk->internal.cache_offset = -1;
+    flash_disk->internal.cache_dirty = false;
+    disk->mem = (uint8_t*)(XIP_BASE + flash_disk->flash_offset);
+    disk->block_num = flash_disk->size / DISK_BLOCK_SIZE;
+    disk->backend.write = flash_disk_write;
+    disk->backend.read = flash_disk_read;
+    disk->backend.flush = flash_disk_flush;
+    disk->backend.ctx = flash_disk;
+    return 0;
+}
+
+static const uint8_t* get_flash(const flash_disk_t* flash_disk, uint32_t offset)
+{
+    return (const uint8_t*)(XIP_BASE + flash_disk->flash_offset + offset);
+}
+
+/** Runs with the other core and the interrupts kept away from the flash */
+static void write_back_unsafe(void* param)
+{
+    const write_back_t* write_back = param;
+    if(write_back->erase)
+        flash_range_erase(write_back->flash_offset, FLASH_SECTOR_SIZE);
+    for(uint32_t i = 0; i < FLASH_SECTOR_SIZE; i += FLASH_PAGE_SIZE)
+    {
+        /** Erased pages are all 1s already */
+        bool blank = true;
+        for(uint32_t j = 0; j < FLASH_PAGE_SIZE; j += 4)
+        {
+            if(*(const uint32_t*)(write_back->data + i + j) != 0xFFFFFFFF)
+            {
+                blank = false;
+                break;
+            }
+        }
+        if(!blank)
+            flash_range_program(write_back->flash_offset + i, write_back->data + i, FLASH_PAGE_SIZE);
+    }
+}
+
+static int flash_disk_flush(void* ctx)
+{
+    flash_disk_t* flash_disk = ctx;
+    if(flash_disk->internal.cache_offset < 0 || !flash_disk->internal.cache_dirty)
+        return 0;
+    const uint8_t* flash = get_flash(flash_disk, flash_disk->internal.cache_offset);
+    const uint32_t* old_words = (const uint32_t*)flash;
+    const uint32_t* new_words = (const uint32_t*)flash_disk->internal.cache;
+    bool changed = false;
+    bool need_erase = false;
+    for(uint32_t i = 0; i < FLASH_SECTOR_SIZE / 4; i++)
+    {
+        if(old_words[i] == new_words[i])
+            continue;
+        changed = true;
+        /** Programming can only clear bits */
+        if((old_words[i] & new_words[i]) != new_words[i])
+        {
+            need_erase = true;
+            break;
+        }
+    }
+    flash_disk->internal.cache_dirty = false;
+    if(!changed)
+    {
+        flash_disk->stats.unchanged++;
+        return 0;
+    }
+    write_back_t write_back = {
+        .flash_offset = flash_disk->flash_offset + flash_disk->internal.cache_offset,
+        .data = flash_disk->internal.cache,
+        .erase = need_erase
+    };
+    /** Without an erase, programming the unchanged words again keeps them. */
+    if(flash_safe_execute(write_back_unsafe, &write_back, FLASH_SAFE_EXECUTE_TIMEOUT_MS) != PICO_OK)
+    {
+        flash_disk->stats.errors++;
+        /** Try again on the next flush */
+        flash_disk->internal.cache_dirty = true;
+        return -1;
+    }
+    flash_disk->stats.write_backs++;
+    if(!need_erase)
+        flash_disk->stats.program_only++;
+    return 0;
+}
+
+static int flash_disk_write(uint32_t block, uint32_t offset, void const* src, uint32_t size, void* ctx)
+{
+    flash_disk_t* flash_disk = ctx;
+    uint32_t disk_offset = block * DISK_BLOCK_SIZE + offset;
+    int32_t sector_offset = disk_offset - disk_offset % FLASH_SECTOR_SIZE;
+    if(disk_offset + size > flash_disk->size)
+        return -1;
+    if(flash_disk->internal.cache_offset != sector_offset)
+    {
+        if(flash_disk_flush(flash_disk) != 0)
+            return -1;
+        memcpy(flash_disk->internal.cache, get_flash(flash_disk, sector_offset), FLASH_SECTOR_SIZE);
+        flash_disk->internal.cache_offset = sector_offset;
+    }
+    /** A block never crosses an erase sector */
+    memcpy(flash_disk->internal.cache + disk_offset - sector_offset, src, size);
+    flash_disk->internal.cache_dirty = true;
+    flash_disk->stats.writes++;
+    return size;
+}
+
+static int flash_disk_read(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* ctx)
+{
+    flash_disk_t* flash_disk = ctx;
+    uint32_t disk_offset = block * DISK_BLOCK_SIZE + offset;
+    int32_t sector_offset = disk_offset - disk_offset % FLASH_SECTOR_SIZE;
+    if(disk_offset + size > flash_disk->size)
+        return -1;
+    if(flash_disk->internal.cache_offset == sector_offset)
+        memcpy(dst, flash_disk->internal.cache + disk_offset - sector_offset, size);
+    else
+        memcpy(dst, get_flash(flash_disk, disk_offset), size);
+    return size;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+/**
+ * A disk on a region of the qspi flash, for files that stay over power cycles.
+ * The blocks are read straight from the XIP mapping. The writes are collected in RAM for one erase sector,
+ * and written back with one erase and program when a write goes to another erase sector, or on disk_flush.
+ * The hosts write a file in order, so this erases each sector once instead of once per block.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <hardware/flash.h>
+#include "disk.h"
+
+typedef struct
+{
+    /** From the start of the flash. Erase sector aligned. */
+    uint32_t flash_offset;
+    /** Multiple of the erase sector */
+    uint32_t size;
+    struct
+    {
+        uint32_t writes;
+        /** Erase sectors written back. writes / write_backs is how well the writes were coalesced. */
+        uint32_t write_backs;
+        /** Written back without an erase, as only 1 bits were cleared */
+        uint32_t program_only;
+        /** Not written back, as the content did not change */
+        uint32_t unchanged;
+        uint32_t errors;
+    } stats;
+    struct
+    {
+        uint8_t cache[FLASH_SECTOR_SIZE] __attribute__((aligned(4)));
+        /** From flash_offset. -1 if nothing is cached. */
+        int32_t cache_offset;
+        bool cache_dirty;
+    } internal;
+} flash_disk_t;
+
+/**
+ * @brief Point the disk to the flash region and put the cache in between. The content of the flash is kept.
+ * Call disk_init after this.
+ * 
+ * @param flash_disk 
+ * @param disk 
+ * @return int 
+ */
+int flash_disk_init(flash_disk_t* flash_disk, disk_t* disk);
@@ -0,0 +1,108 @@
+#include <hardware/dma.h>
+#include "frame_hash.h"
+
+#define FRAME_HASH_SEED (0xFFFFFFFF)
+#define FNV_PRIME (16777619u)
+
+int frame_hash_init(frame_hash_t* frame_hash)
+{
+    if(!frame_hash)
+        return -1;
+    frame_hash->stats.hits = 0;
+    frame_hash->stats.misses = 0;
+    frame_hash->internal.hash = FRAME_HASH_SEED;
+    frame_hash->internal.displayed_valid = false;
+    /** This still works without dma. Just slower. */
+    frame_hash->internal.dma_channel = dma_claim_unused_channel(false);
+    return 0;
+}
+
+void frame_hash_deinit(frame_hash_t* frame_hash)
+{
+    if(!frame_hash || frame_hash->internal.dma_channel < 0)
+        return;
+    dma_channel_unclaim(frame_hash->internal.dma_channel);
+    frame_hash->internal.dma_channel = -1;
+}
+
+void frame_hash_begin(frame_hash_t* frame_hash)
+{
+    frame_hash->internal.hash = FRAME_HASH_SEED;
+}
+
+static void update_dma(frame_hash_t* frame_hash, const uint8_t* data, uint32_t size)
+{
+    /** The data goes nowhere. Only the sniffer sees it. */
+    static uint32_t sink;
+    int channel = frame_hash->internal.dma_channel;
+    bool word_aligned = ((uintptr_t)data % 4) == 0 && size % 4 == 0;
+    dma_channel_config config = dma_channel_get_default_config(channel);
+    channel_config_set_transfer_data_size(&config, word_aligned ? DMA_SIZE_32 : DMA_SIZE_8);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_sniff_enable(&config, true);
+    /** It carries on from the last piece through the accumulator. */
+    dma_sniffer_set_data_accumulator(frame_hash->internal.hash);
+    dma_sniffer_enable(channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+    dma_channel_configure(channel, &config, &sink, data, word_aligned ? size / 4 : size, true);
+    dma_channel_wait_for_finish_blocking(channel);
+    frame_hash->internal.hash = dma_sniffer_get_data_accumulator();
+    dma_sniffer_disable();
+}
+
+static void update_cpu(frame_hash_t* frame_hash, const uint8_t* data, uint32_t size)
+{
+    /** fnv-1a. Only needs to be consistent with itself. */
+    uint32_t hash = frame_hash->internal.hash;
+    for(uint32_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    frame_hash->internal.hash = hash;
+}
+
+void frame_hash_update(frame_hash_t* frame_hash, const uint8_t* data, uint32_t size)
+{
+    if(size == 0)
+        return;
+    if(frame_hash->internal.dma_channel >= 0)
+        update_dma(frame_hash, data, size);
+    else
+        update_cpu(frame_hash, data, size);
+}
+
+bool frame_hash_end(frame_hash_t* frame_hash)
+{
+    if(frame_hash->internal.displayed_valid && frame_hash->internal.hash == frame_hash->internal.displayed_hash)
+    {
+        frame_hash->stats.hits++;
+        return true;
+    }
+    frame_hash->stats.misses++;
+    return false;
+}
+
+void frame_hash_set_displayed(frame_hash_t* frame_hash)
+{
+    frame_hash->internal.displayed_hash = frame_hash->internal.hash;
+    frame_hash->internal.displayed_valid = true;
+}
+
+void frame_hash_invalidate(frame_hash_t* frame_hash)
+{
+    frame_hash->internal.displayed_valid = false;
+}
+
+uint32_t frame_hash_get(const frame_hash_t* frame_hash)
+{
+    return frame_hash->internal.hash;
+}
+
+bool frame_hash_get_displayed(const frame_hash_t* frame_hash, uint32_t* hash)
+{
+    if(!frame_hash->internal.displayed_valid)
+        return false;
+    *hash = frame_hash->internal.displayed_hash;
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+/**
+ * Tell if a frame is the same as the one on the lcd without keeping a copy of it.
+ * The crc32 is calculated by the dma sniffer, the cpu only waits for about 1 cycle per 4 bytes.
+ * There is only one sniffer. Do not use it somewhere else at the same time.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    struct
+    {
+        /** Frames that were the same as the one on the lcd */
+        uint32_t hits;
+        uint32_t misses;
+    } stats;
+    struct
+    {
+        /** -1 if there is no free dma channel. The hash is calculated by the cpu then. */
+        int dma_channel;
+        uint32_t hash;
+        uint32_t displayed_hash;
+        bool displayed_valid;
+    } internal;
+} frame_hash_t;
+
+int frame_hash_init(frame_hash_t* frame_hash);
+
+void frame_hash_deinit(frame_hash_t* frame_hash);
+
+/** Start a new hash */
+void frame_hash_begin(frame_hash_t* frame_hash);
+
+/** Add data to the hash. A frame can be added in pieces. */
+void frame_hash_update(frame_hash_t* frame_hash, const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Finish the hash and compare it with the displayed frame. Updates the stats.
+ * 
+ * @param frame_hash 
+ * @return true The frame is already on the lcd. Skip the write.
+ */
+bool frame_hash_end(frame_hash_t* frame_hash);
+
+/** Call this after the frame is written to the lcd. */
+void frame_hash_set_displayed(frame_hash_t* frame_hash);
+
+/** Call this if what is on the lcd is unknown. e.g. A write failed. */
+void frame_hash_invalidate(frame_hash_t* frame_hash);
+
+/** The hash of the last frame_hash_end */
+uint32_t frame_hash_get(const frame_hash_t* frame_hash);
+
+/**
+ * @brief Get the hash of the frame on the lcd.
+ * 
+ * @param frame_hash 
+ * @param hash 
+ * @return true The lcd content is known.
+ */
+bool frame_hash_get_displayed(const frame_hash_t* frame_hash, uint32_t* hash);
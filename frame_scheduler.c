@@ -0,0 +1,52 @@
+#include <string.h>
+#include "frame_scheduler.h"
+
+int frame_scheduler_init(frame_scheduler_t* frame_scheduler)
+{
+    if(!frame_scheduler || !frame_scheduler->hooks.enter_critical_section || !frame_scheduler->hooks.exit_critical_section)
+        return -1;
+    memset(&frame_scheduler->stats, 0, sizeof(frame_scheduler->stats));
+    memset(&frame_scheduler->internal, 0, sizeof(frame_scheduler->internal));
+    return 0;
+}
+
+bool frame_scheduler_request(frame_scheduler_t* frame_scheduler, uint32_t sources)
+{
+    frame_scheduler->hooks.enter_critical_section(frame_scheduler->hooks.critical_section_ctx);
+    bool wake = frame_scheduler->internal.pending == 0;
+    frame_scheduler->stats.requests++;
+    if(frame_scheduler->internal.pending & sources)
+        frame_scheduler->stats.coalesced++;
+    frame_scheduler->internal.pending |= sources;
+    frame_scheduler->hooks.exit_critical_section(frame_scheduler->hooks.critical_section_ctx);
+    return wake;
+}
+
+uint32_t frame_scheduler_poll(frame_scheduler_t* frame_scheduler, uint64_t now_us, uint32_t* wait_us)
+{
+    *wait_us = 0;
+    frame_scheduler->hooks.enter_critical_section(frame_scheduler->hooks.critical_section_ctx);
+    uint32_t pending = frame_scheduler->internal.pending;
+    if(pending && frame_scheduler->internal.has_frame)
+    {
+        uint64_t elapsed_us = now_us - frame_scheduler->internal.last_frame_us;
+        if(elapsed_us < frame_scheduler->min_interval_us)
+        {
+            if(!frame_scheduler->internal.delayed)
+                frame_scheduler->stats.delayed++;
+            frame_scheduler->internal.delayed = true;
+            *wait_us = frame_scheduler->min_interval_us - elapsed_us;
+            pending = 0;
+        }
+    }
+    if(pending)
+    {
+        frame_scheduler->internal.pending = 0;
+        frame_scheduler->internal.delayed = false;
+        frame_scheduler->internal.has_frame = true;
+        frame_scheduler->internal.last_frame_us = now_us;
+        frame_scheduler->stats.frames++;
+    }
+    frame_scheduler->hooks.exit_critical_section(frame_scheduler->hooks.critical_section_ctx);
+    return pending;
+}
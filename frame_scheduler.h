@@ -0,0 +1,62 @@
+#pragma once
+
+/**
+ * Decide when the lcd task draws. A redraw asked for while one is pending is folded into it,
+ * only the latest content is drawn. The frames are kept at least min_interval_us apart.
+ * Each source of frames has a bit, e.g. the bmp file and the raw frames, so they are drawn together and paced together.
+ * This does not depend on the pico sdk. The caller gives the time.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    /** 0 for no limit */
+    uint32_t min_interval_us;
+    struct
+    {
+        /** Both the requests and the polls are made in these. They may come from different tasks. */
+        void (*enter_critical_section)(void* ctx);
+        void (*exit_critical_section)(void* ctx);
+        void* critical_section_ctx;
+    } hooks;
+    struct
+    {
+        uint32_t requests;
+        /** Requests folded into a frame that was already pending. They are never drawn on their own. */
+        uint32_t coalesced;
+        uint32_t frames;
+        /** Frames held back for the interval */
+        uint32_t delayed;
+    } stats;
+    struct
+    {
+        /** The sources asked for since the last frame */
+        uint32_t pending;
+        bool delayed;
+        bool has_frame;
+        uint64_t last_frame_us;
+    } internal;
+} frame_scheduler_t;
+
+int frame_scheduler_init(frame_scheduler_t* frame_scheduler);
+
+/**
+ * @brief Ask for a frame.
+ *
+ * @param frame_scheduler
+ * @param sources The bits of the sources that changed
+ * @return true Nothing was pending. Wake the lcd task. Otherwise it is already woken.
+ */
+bool frame_scheduler_request(frame_scheduler_t* frame_scheduler, uint32_t sources);
+
+/**
+ * @brief In the lcd task. Take the pending sources if a frame is due.
+ *
+ * @param frame_scheduler
+ * @param now_us
+ * @param wait_us Set if a frame is pending but not due. Poll again after this. 0 if there is nothing to wait for.
+ * @return uint32_t The sources to draw. 0 for none.
+ */
+uint32_t frame_scheduler_poll(frame_scheduler_t* frame_scheduler, uint64_t now_us, uint32_t* wait_us);
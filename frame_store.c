@@ -0,0 +1,158 @@
+#include <string.h>
+#include <hardware/flash.h>
+#include <hardware/regs/addressmap.h>
+#include <pico/flash.h>
+#include "frame_store.h"
+
+/** Long enough for the other core to get out of the flash, if it is running */
+#define FLASH_SAFE_EXECUTE_TIMEOUT_MS (100)
+#define FRAME_STORE_MAGIC (0x46524D31)
+
+/** In its own page in front of the frame */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t frame_size;
+    uint32_t hash;
+} slot_header_t;
+
+typedef struct
+{
+    uint32_t flash_offset;
+    const uint8_t* data;
+    uint32_t size;
+} flash_op_t;
+
+static uint32_t get_slot_offset(const frame_store_t* frame_store, uint32_t slot)
+{
+    return frame_store->flash_offset + slot * frame_store->internal.slot_size;
+}
+
+static const slot_header_t* get_slot_header(const frame_store_t* frame_store, uint32_t slot)
+{
+    return (const slot_header_t*)(XIP_BASE + get_slot_offset(frame_store, slot));
+}
+
+int frame_store_init(frame_store_t* frame_store)
+{
+    if(!frame_store || frame_store->frame_size == 0)
+        return -1;
+    if(frame_store->flash_offset % FLASH_SECTOR_SIZE != 0 || frame_store->size % FLASH_SECTOR_SIZE != 0)
+        return -1;
+    memset(&frame_store->stats, 0, sizeof(frame_store->stats));
+    frame_store->internal.slot_size =
+        (FLASH_PAGE_SIZE + frame_store->frame_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+    frame_store->internal.slot_num = frame_store->size / frame_store->internal.slot_size;
+    /** With one slot, a save cut by a power loss leaves nothing */
+    if(frame_store->internal.slot_num < 2)
+        return -1;
+    frame_store->internal.latest_slot = -1;
+    frame_store->internal.latest_sequence = 0;
+    frame_store->internal.latest_hash = 0;
+    for(uint32_t i = 0; i < frame_store->internal.slot_num; i++)
+    {
+        const slot_header_t* header = get_slot_header(frame_store, i);
+        if(header->magic != FRAME_STORE_MAGIC || header->frame_size != frame_store->frame_size)
+            continue;
+        /** Wraps after 4 billion saves, the flash is long dead by then */
+        if(frame_store->internal.latest_slot >= 0 && header->sequence <= frame_store->internal.latest_sequence)
+            continue;
+        frame_store->internal.latest_slot = i;
+        frame_store->internal.latest_sequence = header->sequence;
+        frame_store->internal.latest_hash = header->hash;
+    }
+    return 0;
+}
+
+const uint8_t* frame_store_load(const frame_store_t* frame_store, uint32_t* hash)
+{
+    if(!frame_store || !hash || frame_store->internal.latest_slot < 0)
+        return NULL;
+    *hash = frame_store->internal.latest_hash;
+    return (const uint8_t*)(XIP_BASE + get_slot_offset(frame_store, frame_store->internal.latest_slot) + FLASH_PAGE_SIZE);
+}
+
+/** Runs with the other core and the interrupts kept away from the flash */
+static void erase_unsafe(void* param)
+{
+    const flash_op_t* op = param;
+    flash_range_erase(op->flash_offset, op->size);
+}
+
+static void program_unsafe(void* param)
+{
+    const flash_op_t* op = param;
+    flash_range_program(op->flash_offset, op->data, op->size);
+}
+
+static int run(void (*func)(void*), uint32_t flash_offset, const uint8_t* data, uint32_t size)
+{
+    flash_op_t op = {
+        .flash_offset = flash_offset,
+        .data = data,
+        .size = size
+    };
+    return flash_safe_execute(func, &op, FLASH_SAFE_EXECUTE_TIMEOUT_MS) == PICO_OK ? 0 : -1;
+}
+
+/** One erase sector per call, so the interrupts are not away for the whole slot */
+static int write_slot(frame_store_t* frame_store, uint32_t slot, const uint8_t* frame, uint32_t hash)
+{
+    static uint8_t page[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+    uint32_t slot_offset = get_slot_offset(frame_store, slot);
+    for(uint32_t i = 0; i < frame_store->internal.slot_size; i += FLASH_SECTOR_SIZE)
+    {
+        if(run(erase_unsafe, slot_offset + i, NULL, FLASH_SECTOR_SIZE) != 0)
+            return -1;
+    }
+    uint32_t frame_offset = slot_offset + FLASH_PAGE_SIZE;
+    uint32_t full_pages_size = frame_store->frame_size / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+    for(uint32_t i = 0; i < full_pages_size; i += FLASH_SECTOR_SIZE)
+    {
+        uint32_t size = full_pages_size - i < FLASH_SECTOR_SIZE ? full_pages_size - i : FLASH_SECTOR_SIZE;
+        if(run(program_unsafe, frame_offset + i, frame + i, size) != 0)
+            return -1;
+    }
+    if(full_pages_size < frame_store->frame_size)
+    {
+        memset(page, 0xFF, sizeof(page));
+        memcpy(page, frame + full_pages_size, frame_store->frame_size - full_pages_size);
+        if(run(program_unsafe, frame_offset + full_pages_size, page, sizeof(page)) != 0)
+            return -1;
+    }
+    /** The frame is complete. Make it count. */
+    slot_header_t header = {
+        .magic = FRAME_STORE_MAGIC,
+        .sequence = frame_store->internal.latest_sequence + 1,
+        .frame_size = frame_store->frame_size,
+        .hash = hash
+    };
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    if(run(program_unsafe, slot_offset, page, sizeof(page)) != 0)
+        return -1;
+    return 0;
+}
+
+int frame_store_save(frame_store_t* frame_store, const uint8_t* frame, uint32_t hash)
+{
+    if(!frame_store || !frame || frame_store->internal.slot_num == 0)
+        return -1;
+    if(frame_store->internal.latest_slot >= 0 && frame_store->internal.latest_hash == hash)
+    {
+        frame_store->stats.unchanged++;
+        return 0;
+    }
+    uint32_t slot = (frame_store->internal.latest_slot + 1) % frame_store->internal.slot_num;
+    if(write_slot(frame_store, slot, frame, hash) != 0)
+    {
+        frame_store->stats.errors++;
+        return -1;
+    }
+    frame_store->internal.latest_slot = slot;
+    frame_store->internal.latest_sequence++;
+    frame_store->internal.latest_hash = hash;
+    frame_store->stats.saves++;
+    return 0;
+}
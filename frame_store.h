@@ -0,0 +1,64 @@
+#pragma once
+
+/**
+ * Keep the last frame on a region of the qspi flash, so it can be shown at boot before the host writes anything.
+ * The region is split into slots of whole erase sectors. Each save goes to the slot after the last one,
+ * so every sector is erased once per slot_num saves. The slot header is programmed last,
+ * a save cut by a power loss leaves the previous frame in place.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    /** From the start of the flash. Erase sector aligned. */
+    uint32_t flash_offset;
+    /** Multiple of the erase sector. Room for at least 2 slots. */
+    uint32_t size;
+    uint32_t frame_size;
+    struct
+    {
+        uint32_t saves;
+        /** The frame was already stored */
+        uint32_t unchanged;
+        uint32_t errors;
+    } stats;
+    struct
+    {
+        uint32_t slot_size;
+        uint32_t slot_num;
+        /** -1 if there is no frame */
+        int32_t latest_slot;
+        uint32_t latest_sequence;
+        uint32_t latest_hash;
+    } internal;
+} frame_store_t;
+
+/**
+ * @brief Find the latest frame in the region. The content of the flash is kept.
+ *
+ * @param frame_store
+ * @return int
+ */
+int frame_store_init(frame_store_t* frame_store);
+
+/**
+ * @brief Get the latest frame. It is read through the XIP mapping.
+ *
+ * @param frame_store
+ * @param hash The hash given to frame_store_save. Check the frame with it before use.
+ * @return const uint8_t* frame_size bytes. NULL if there is no frame.
+ */
+const uint8_t* frame_store_load(const frame_store_t* frame_store, uint32_t* hash);
+
+/**
+ * @brief Store the frame in the next slot. Does nothing if the latest frame has the same hash.
+ * This keeps the interrupts away for an erase sector at a time, about 50ms. Do not call this often.
+ *
+ * @param frame_store
+ * @param frame frame_size bytes, in RAM
+ * @param hash
+ * @return int
+ */
+int frame_store_save(frame_store_t* frame_store, const uint8_t* frame, uint32_t hash);
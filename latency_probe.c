@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "latency_probe.h"
+
+static const char* const stage_names[LATENCY_STAGE_NUM] = {
+    [LATENCY_STAGE_WRITE] = "write",
+    [LATENCY_STAGE_QUEUE] = "queue",
+    [LATENCY_STAGE_DECODE] = "decode",
+    [LATENCY_STAGE_LCD] = "lcd",
+    [LATENCY_STAGE_TOTAL] = "total",
+    [LATENCY_STAGE_LOCK_WAIT] = "lock wait",
+    [LATENCY_STAGE_WAKE] = "lcd wake",
+};
+
+static void enter(latency_probe_t* latency_probe)
+{
+    latency_probe->hooks.enter_critical_section(latency_probe->hooks.critical_section_ctx);
+}
+
+static void leave(latency_probe_t* latency_probe)
+{
+    latency_probe->hooks.exit_critical_section(latency_probe->hooks.critical_section_ctx);
+}
+
+int latency_probe_init(latency_probe_t* latency_probe)
+{
+    if(!latency_probe || !latency_probe->hooks.enter_critical_section || !latency_probe->hooks.exit_critical_section)
+        return -1;
+    memset(&latency_probe->stats, 0, sizeof(latency_probe->stats));
+    memset(&latency_probe->internal, 0, sizeof(latency_probe->internal));
+    return 0;
+}
+
+static void add(latency_probe_t* latency_probe, latency_stage_t stage, uint32_t us)
+{
+    latency_histogram_t* histogram = &latency_probe->stats.stages[stage];
+    uint32_t bucket = 0;
+    while(bucket < LATENCY_BUCKET_NUM - 1 && us >= (uint32_t)LATENCY_FIRST_BUCKET_US << bucket)
+        bucket++;
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += us;
+    if(us > histogram->max_us)
+        histogram->max_us = us;
+}
+
+void latency_probe_write(latency_probe_t* latency_probe, uint32_t now_us)
+{
+    enter(latency_probe);
+    if(!latency_probe->internal.writing)
+    {
+        latency_probe->internal.first_write_us = now_us;
+        latency_probe->internal.writing = true;
+    }
+    leave(latency_probe);
+}
+
+void latency_probe_file_end(latency_probe_t* latency_probe, uint32_t now_us)
+{
+    enter(latency_probe);
+    /** Only the latest content is drawn */
+    if(latency_probe->internal.file_ended)
+        latency_probe->stats.frames_dropped++;
+    else if(latency_probe->internal.writing)
+        add(latency_probe, LATENCY_STAGE_WRITE, now_us - latency_probe->internal.first_write_us);
+    latency_probe->internal.file_end_us = now_us;
+    latency_probe->internal.file_ended = true;
+    leave(latency_probe);
+}
+
+void latency_probe_ignore(latency_probe_t* latency_probe)
+{
+    enter(latency_probe);
+    if(latency_probe->internal.writing && !latency_probe->internal.file_ended)
+    {
+        latency_probe->internal.writing = false;
+        latency_probe->stats.writes_ignored++;
+    }
+    leave(latency_probe);
+}
+
+void latency_probe_decode_begin(latency_probe_t* latency_probe, uint32_t now_us)
+{
+    enter(latency_probe);
+    /** e.g. A redraw after the sleep. The frame starts here then. */
+    latency_probe->internal.frame_write_us = now_us;
+    if(latency_probe->internal.file_ended)
+        add(latency_probe, LATENCY_STAGE_QUEUE, now_us - latency_probe->internal.file_end_us);
+    if(latency_probe->internal.writing)
+        latency_probe->internal.frame_write_us = latency_probe->internal.first_write_us;
+    latency_probe->internal.decode_begin_us = now_us;
+    latency_probe->internal.writing = false;
+    latency_probe->internal.file_ended = false;
+    leave(latency_probe);
+}
+
+void latency_probe_decode_end(latency_probe_t* latency_probe, uint32_t now_us, bool ok, bool unchanged)
+{
+    enter(latency_probe);
+    add(latency_probe, LATENCY_STAGE_DECODE, now_us - latency_probe->internal.decode_begin_us);
+    if(!ok)
+        latency_probe->stats.frames_dropped++;
+    else if(unchanged)
+        latency_probe->stats.frames_unchanged++;
+    leave(latency_probe);
+}
+
+void latency_probe_lcd_begin(latency_probe_t* latency_probe, uint32_t now_us)
+{
+    enter(latency_probe);
+    latency_probe->internal.lcd_begin_us = now_us;
+    latency_probe->internal.lcd_writing = true;
+    leave(latency_probe);
+}
+
+void latency_probe_lcd_end(latency_probe_t* latency_probe, uint32_t done_us, bool ok)
+{
+    enter(latency_probe);
+    if(latency_probe->internal.lcd_writing && !ok)
+    {
+        latency_probe->stats.frames_dropped++;
+    }
+    else if(latency_probe->internal.lcd_writing)
+    {
+        add(latency_probe, LATENCY_STAGE_LCD, done_us - latency_probe->internal.lcd_begin_us);
+        add(latency_probe, LATENCY_STAGE_TOTAL, done_us - latency_probe->internal.frame_write_us);
+        latency_probe->stats.frames_shown++;
+    }
+    latency_probe->internal.lcd_writing = false;
+    leave(latency_probe);
+}
+
+void latency_probe_add(latency_probe_t* latency_probe, latency_stage_t stage, uint32_t us)
+{
+    enter(latency_probe);
+    add(latency_probe, stage, us);
+    leave(latency_probe);
+}
+
+static void append(char* text, uint32_t size, uint32_t* length, const char* format, ...)
+{
+    if(*length + 1 >= size)
+        return;
+    va_list args;
+    va_start(args, format);
+    int rc = vsnprintf(text + *length, size - *length, format, args);
+    va_end(args);
+    if(rc < 0)
+        return;
+    *length += (uint32_t)rc < size - *length ? (uint32_t)rc : size - *length - 1;
+}
+
+uint32_t latency_probe_format(const latency_probe_t* latency_probe, char* text, uint32_t size)
+{
+    if(!latency_probe || !text || size == 0)
+        return 0;
+    uint32_t length = 0;
+    text[0] = '\0';
+    append(text, size, &length, "frames shown: %lu\nframes unchanged: %lu\nframes dropped: %lu\nwrites ignored: %lu\n\n",
+        (unsigned long)latency_probe->stats.frames_shown,
+        (unsigned long)latency_probe->stats.frames_unchanged,
+        (unsigned long)latency_probe->stats.frames_dropped,
+        (unsigned long)latency_probe->stats.writes_ignored);
+    append(text, size, &length, "%-9s %6s %8s %8s", "us", "count", "avg", "max");
+    for(uint32_t i = 0; i < LATENCY_BUCKET_NUM - 1; i++)
+        append(text, size, &length, " <%5lu", (unsigned long)LATENCY_FIRST_BUCKET_US << i);
+    append(text, size, &length, " %6s\n", "more");
+    for(uint32_t i = 0; i < LATENCY_STAGE_NUM; i++)
+    {
+        const latency_histogram_t* histogram = &latency_probe->stats.stages[i];
+        append(text, size, &length, "%-9s %6lu %8lu %8lu", stage_names[i],
+            (unsigned long)histogram->count,
+            (unsigned long)(histogram->count ? histogram->total_us / histogram->count : 0),
+            (unsigned long)histogram->max_us);
+        for(uint32_t j = 0; j < LATENCY_BUCKET_NUM; j++)
+            append(text, size, &length, " %6lu", (unsigned long)histogram->buckets[j]);
+        append(text, size, &length, "\n");
+    }
+    return length;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+/**
+ * Where the time goes between a host write and the pixels changing, for the bmp file path.
+ * The probes take timestamps on the hot path and fold the time between them into fixed histograms.
+ * A frame starts with its first write, ends with the last sector found (the tracker, a sync or the timer),
+ * then it is decoded and written to the lcd. The probes are called from the usb task and the lcd task.
+ * This does not depend on the pico sdk. The caller gives the time.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Bucket i counts less than 64 << i us, the last one all the rest */
+#define LATENCY_BUCKET_NUM (12)
+#define LATENCY_FIRST_BUCKET_US (64)
+
+typedef enum
+{
+    /** The first write of the frame to the last sector found */
+    LATENCY_STAGE_WRITE,
+    /** The last sector found to the decode start: the scheduler, the lcd task wake and the lcd still busy */
+    LATENCY_STAGE_QUEUE,
+    /** Decoding what is left of the frame into the back buffer */
+    LATENCY_STAGE_DECODE,
+    /** The first band started to the last band done */
+    LATENCY_STAGE_LCD,
+    /** The first write of the frame to the last band done */
+    LATENCY_STAGE_TOTAL,
+    /** Waits for the state lock */
+    LATENCY_STAGE_LOCK_WAIT,
+    /** An event set for the lcd task to the lcd task running. Part of the queue stage. */
+    LATENCY_STAGE_WAKE,
+    LATENCY_STAGE_NUM
+} latency_stage_t;
+
+typedef struct
+{
+    uint32_t buckets[LATENCY_BUCKET_NUM];
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+} latency_histogram_t;
+
+typedef struct
+{
+    struct
+    {
+        /** The probes are made in these. latency_probe_format is not, a report may be a little torn. */
+        void (*enter_critical_section)(void* ctx);
+        void (*exit_critical_section)(void* ctx);
+        void* critical_section_ctx;
+    } hooks;
+    struct
+    {
+        latency_histogram_t stages[LATENCY_STAGE_NUM];
+        /** On the lcd */
+        uint32_t frames_shown;
+        /** Decoded to the frame already on the lcd, nothing written */
+        uint32_t frames_unchanged;
+        /** Never on the lcd: folded into a later file end, or the decode or the lcd write failed */
+        uint32_t frames_dropped;
+        /** Writes that ended in no frame, e.g. only other files changed */
+        uint32_t writes_ignored;
+    } stats;
+    struct
+    {
+        bool writing;
+        uint32_t first_write_us;
+        bool file_ended;
+        uint32_t file_end_us;
+        /** The frame between the decode start and the lcd done */
+        uint32_t frame_write_us;
+        uint32_t decode_begin_us;
+        bool lcd_writing;
+        uint32_t lcd_begin_us;
+    } internal;
+} latency_probe_t;
+
+int latency_probe_init(latency_probe_t* latency_probe);
+
+/** A host write came in. Only the first one since the last decode start is kept. */
+void latency_probe_write(latency_probe_t* latency_probe, uint32_t now_us);
+
+/** The last sector of the frame was found. A file end not decoded yet is dropped. */
+void latency_probe_file_end(latency_probe_t* latency_probe, uint32_t now_us);
+
+/** The writes since the first one made no frame */
+void latency_probe_ignore(latency_probe_t* latency_probe);
+
+/** The writes after this belong to the next frame */
+void latency_probe_decode_begin(latency_probe_t* latency_probe, uint32_t now_us);
+
+/**
+ * @brief The decode is over.
+ *
+ * @param latency_probe
+ * @param now_us
+ * @param ok false if the frame is dropped
+ * @param unchanged The frame is already on the lcd, no lcd write follows
+ */
+void latency_probe_decode_end(latency_probe_t* latency_probe, uint32_t now_us, bool ok, bool unchanged);
+
+void latency_probe_lcd_begin(latency_probe_t* latency_probe, uint32_t now_us);
+
+/** Give the time the last band was done, e.g. taken in the dma irq */
+void latency_probe_lcd_end(latency_probe_t* latency_probe, uint32_t done_us, bool ok);
+
+/** Count a time that has no probe pair, e.g. a lock wait */
+void latency_probe_add(latency_probe_t* latency_probe, latency_stage_t stage, uint32_t us);
+
+/**
+ * @brief Write the counters and the histograms as text.
+ *
+ * @param latency_probe
+ * @param text
+ * @param size
+ * @return uint32_t The length, at most size - 1
+ */
+uint32_t latency_probe_format(const latency_probe_t* latency_probe, char* text, uint32_t size);
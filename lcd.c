@@ -1,9 +1,155 @@
 #include "lcd.h"
 #include <hardware/gpio.h>
+#include <hardware/irq.h>
+
+/** The 50 columns of the panel are mapped to column 15 -> 64 of the driver */
+#define LCD_COLUMN_OFFSET (15)
+
+/** Memory access control, all normal, BGR pixel */
+#define LCD_MADCTL_DEFAULT (0x08)
+/** Memory access control, row address order bit */
+#define LCD_MADCTL_BOTTOM_UP (0x80)
+
+#if LCD_PIXEL_FORMAT == LCD_PIXEL_FORMAT_RGB565
+#define LCD_COLMOD (0x55)
+#else
+#define LCD_COLMOD (0x66)
+#endif
+
+/** 
+ * Set in the data size of a command table entry. The entry is followed by a delay in ms.
+ * So the data size is limited to 127.
+ */
+#define LCD_INIT_DELAY (0x80)
+
+/** 
+ * Command table entries: command, data size, data..., [delay ms]
+ * The delays are the datasheet minimums.
+ */
+static const uint8_t init_sequence[] = {
+    /** Enable inter_command */
+    0xFE, 0,
+    0xEF, 0,
+    /** Unknown command */
+    0x86, 1, 0xFF,
+    /** Unknown command */
+    0x87, 1, 0xFF,
+    /** Unknown command */
+    0x8E, 1, 0xFF,
+    /** Unknown command */
+    0x8F, 1, 0xFF,
+    /** Unknown command */
+    0x80, 1, 0x13,
+    /** Unknown command */
+    0x81, 1, 0x40,
+    /** Unknown command */
+    0x82, 1, 0x0A,
+    /** Unknown command */
+    0x83, 1, 0x0B,
+    /** Unknown command */
+    0x84, 1, 0x60,
+    /** Unknown command */
+    0x85, 1, 0x80,
+    /** Unknown command */
+    0x89, 1, 0x10,
+    /** Unknown command */
+    0x8A, 1, 0x0F,
+    /** Unknown command */
+    0x8B, 1, 0x02,
+    /** Unknown command */
+    0x8C, 1, 0x59,
+    /** Unknown command */
+    0x8D, 1, 0x55,
+    /** Set pixel format. 0x66: 18bit 6-6-6, actual data: 8-8-8. 0x55: 16bit 5-6-5 */
+    0x3A, 1, LCD_COLMOD,
+    /** Inversion, 1 dot */
+    0xEC, 1, 0x00,
+    /** Unknown command */
+    0x7E, 1, 0x30,
+    /** Unknown command */
+    0x74, 7, 0x05, 0x4D, 0x00, 0x00, 0x01, 0x00, 0x00,
+    /** Blanking porch control. With one parameter missing */
+    0xB5, 2, 0x0D, 0x0D,
+    /** Display function control, source 1->240, gate 1->160 */
+    0xB6, 2, 0x00, 0x00,
+    /** Unknown command */
+    0x60, 4, 0x38, 0x09, 0x1E, 0x7A,
+    /** Unknown command */
+    0x63, 4, 0x38, 0xAE, 0x1E, 0x7A,
+    /** Unknown command */
+    0x64, 6, 0x38, 0x0B, 0x70, 0xAB, 0x1E, 0x7A,
+    /** Unknown command */
+    0x66, 6, 0x38, 0x0F, 0x70, 0xAF, 0x1E, 0x7A,
+    /** Unknown command */
+    0x68, 7, 0x00, 0x08, 0x07, 0x00, 0x07, 0x55, 0x6A,
+    /** Unknown command */
+    0x6A, 2, 0x00, 0x00,
+    /** Unknown command */
+    0x6C, 7, 0x22, 0x02, 0x22, 0x02, 0x22, 0x22, 0x50,
+    /** Unknown command */
+    0x6E, 32,
+        0x00, 0x00, 0x00, 0x02, 0x14, 0x12, 0x0C, 0x0A,
+        0x1E, 0x1D, 0x08, 0x00, 0x16, 0x15, 0x00, 0x00,
+        0x00, 0x00, 0x15, 0x16, 0x00, 0x07, 0x1D, 0x1E,
+        0x09, 0x0B, 0x11, 0x13, 0x01, 0x00, 0x00, 0x00,
+    /** Unknown command */
+    0x98, 1, 0x3E,
+    /** Unknown command */
+    0x99, 1, 0x3E,
+    /** Unknown command */
+    0x9B, 1, 0x3B,
+    /** Unknown command */
+    0x93, 3, 0x33, 0x7F, 0x00,
+    /** Unknown command */
+    0x91, 2, 0x0E, 0x09,
+    /** Unknown command */
+    0x70, 6, 0x04, 0x02, 0x0D, 0x04, 0x02, 0x0D,
+    /** Unknown command */
+    0x71, 3, 0x04, 0x02, 0x0D,
+    /** Power control 2 */
+    0xC3, 1, 0x26,
+    /** Power control 3 */
+    0xC4, 1, 0x26,
+    /** Power control 4 */
+    0xC9, 1, 0x1C,
+    /** Set gamma 1 */
+    0xF0, 6, 0x02, 0x03, 0x0A, 0x06, 0x00, 0x1A,
+    /** Set gamma 2 */
+    0xF1, 6, 0x38, 0x78, 0x1B, 0x2E, 0x2F, 0xC8,
+    /** Set gamma 3 */
+    0xF2, 6, 0x02, 0x03, 0x0A, 0x06, 0x00, 0x1A,
+    /** Set gamma 4 */
+    0xF3, 6, 0x38, 0x74, 0x12, 0x2E, 0x2F, 0xDF,
+    /** Dual single gate select, single gate mode */
+    0xBF, 1, 0x00,
+    /** Unknown command */
+    0xF9, 1, 0x40,
+    /** Memory access control, all normal, BGR pixel */
+    0x36, 1, LCD_MADCTL_DEFAULT,
+    /** Column address set, 15 -> 64 */
+    0x2A, 4, 0x00, 0x0F, 0x00, 0x40,
+    /** Page address set, 0 -> 159 */
+    0x2B, 4, 0x00, 0x00, 0x00, 0x9F,
+    /** Sleep out. 5ms before the next command. 120ms before sleep in, see lcd_enter_sleep. */
+    0x11, LCD_INIT_DELAY | 0, 5,
+    /** Display on */
+    0x29, 0,
+};
+
+static lcd_t* dma_lcds[NUM_DMA_CHANNELS] = {0};
+static bool dma_irq_installed = false;
 
 static int init_lcd_hardware(lcd_t* lcd);
+static int run_command_table(lcd_t* lcd, const uint8_t* table, int size);
 static void loop_sleep(uint32_t ms, void* ctx);
 static int send_command(lcd_t* lcd, uint8_t* command_and_data, int size);
+static bool is_region_valid(int x, int y, int w, int h);
+static int set_window(lcd_t* lcd, int x, int y, int w, int h);
+static int set_madctl(lcd_t* lcd, uint8_t madctl);
+static int init_dma(lcd_t* lcd);
+static void deinit_dma(lcd_t* lcd);
+static void start_next_band_from_isr(lcd_t* lcd);
+static void dma_irq_handler(void);
 
 int lcd_init(lcd_t* lcd)
 {
@@ -37,6 +183,8 @@ int lcd_init(lcd_t* lcd)
     gpio_init(lcd->pin_dc);
     gpio_set_dir(lcd->pin_dc, GPIO_OUT);
     gpio_put(lcd->pin_dc, 1);
+    /** Async writes will fail without dma. The others still work. */
+    init_dma(lcd);
 
     /** init screen */
     if(init_lcd_hardware(lcd) != 0)
@@ -50,6 +198,7 @@ int lcd_init(lcd_t* lcd)
 
 void lcd_deinit(lcd_t* lcd)
 {
+    deinit_dma(lcd);
     spi_deinit(lcd->spi);
     gpio_set_function(lcd->pin_clk, GPIO_FUNC_NULL);
     gpio_set_function(lcd->pin_mosi, GPIO_FUNC_NULL);
@@ -69,6 +218,10 @@ int lcd_enter_sleep(lcd_t* lcd)
         } \
     } while (0)
 
+    /** The init sequence does not wait for this. */
+    uint64_t since_sleep_out_us = time_us_64() - lcd->internal.sleep_out_us;
+    if(since_sleep_out_us < 120 * 1000)
+        lcd->hooks.sleep((120 * 1000 - since_sleep_out_us + 999) / 1000, lcd->hooks.sleep_ctx);
     /** Display off */
     SEND_COMMAND_OR_RETURN(0x28);
     /** Sleep in */
@@ -96,6 +249,7 @@ int lcd_exit_sleep(lcd_t* lcd)
     SEND_COMMAND_OR_RETURN(0x11);
     /** It is necessary to wait 120ms after sending sleep out command before sleep in command can be sent. */
     lcd->hooks.sleep(120 + 10, lcd->hooks.sleep_ctx);
+    lcd->internal.sleep_out_us = time_us_64();
     /** Display on. */
     SEND_COMMAND_OR_RETURN(0x29);
 
@@ -106,8 +260,27 @@ int lcd_exit_sleep(lcd_t* lcd)
 
 int lcd_write_frame(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE])
 {
-    if(!lcd || !frame)
+    return lcd_write_region(lcd, 0, 0, LCD_WIDTH, LCD_HEIGHT, frame);
+}
+
+int lcd_write_frame_async(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE], void (*on_done)(void* ctx), void* ctx)
+{
+    return lcd_write_region_async(lcd, 0, 0, LCD_WIDTH, LCD_HEIGHT, frame, on_done, ctx);
+}
+
+int lcd_write_region(lcd_t* lcd, int x, int y, int w, int h, const uint8_t* pixels)
+{
+    if(!lcd || !pixels)
+        return -1;
+    if(!is_region_valid(x, y, w, h))
         return -1;
+    if(lcd->internal.busy || lcd->internal.streaming)
+        return -1;
+    if(set_madctl(lcd, LCD_MADCTL_DEFAULT) != 0)
+        return -1;
+    if(set_window(lcd, x, y, w, h) != 0)
+        return -1;
+    int size = w * h * LCD_PIXEL_SIZE;
     int rc = 0;
     if(lcd->hooks.enter_critical_section)
         lcd->hooks.enter_critical_section(lcd->hooks.critical_section_ctx);
@@ -121,7 +294,7 @@ int lcd_write_frame(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE])
     }
 
     gpio_put(lcd->pin_dc, 1);
-    if(spi_write_blocking(lcd->spi, frame, LCD_FRAME_SIZE) != LCD_FRAME_SIZE)
+    if(spi_write_blocking(lcd->spi, pixels, size) != size)
     {
         rc = -1;
         goto finish;
@@ -135,135 +308,206 @@ finish:
     return rc;
 }
 
+int lcd_write_region_async(lcd_t* lcd, int x, int y, int w, int h, const uint8_t* pixels, void (*on_done)(void* ctx), void* ctx)
+{
+    if(!lcd || !pixels)
+        return -1;
+    if(!is_region_valid(x, y, w, h))
+        return -1;
+    if(lcd->internal.dma_channel < 0 || lcd->internal.busy || lcd->internal.streaming)
+        return -1;
+    if(set_madctl(lcd, LCD_MADCTL_DEFAULT) != 0)
+        return -1;
+    if(set_window(lcd, x, y, w, h) != 0)
+        return -1;
+    int rc = 0;
+    if(lcd->hooks.enter_critical_section)
+        lcd->hooks.enter_critical_section(lcd->hooks.critical_section_ctx);
 
-static int init_lcd_hardware(lcd_t* lcd)
+    gpio_put(lcd->pin_dc, 0);
+    gpio_put(lcd->pin_ncs, 0);
+    if(spi_write_blocking(lcd->spi, (uint8_t[]){0x2C}, 1) != 1)
+    {
+        gpio_put(lcd->pin_ncs, 1);
+        rc = -1;
+        goto finish;
+    }
+
+    gpio_put(lcd->pin_dc, 1);
+    lcd->internal.on_done = on_done;
+    lcd->internal.on_done_ctx = ctx;
+    lcd->internal.busy = true;
+    /** nCS is released in the dma irq */
+    dma_channel_transfer_from_buffer_now(lcd->internal.dma_channel, pixels, w * h * LCD_PIXEL_SIZE);
+
+finish:
+    if(lcd->hooks.exit_critical_section)
+        lcd->hooks.exit_critical_section(lcd->hooks.critical_section_ctx);
+
+    return rc;
+}
+
+int lcd_write_bands_async(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE], const lcd_band_t* bands, int band_num, void (*on_done)(void* ctx), void* ctx)
 {
-#define SEND_COMMAND_OR_RETURN(...)  \
-    do \
-    { \
-        if(send_command(lcd, (uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__})) != 0) \
-        { \
-            return -1; \
-        } \
-    } while (0)
+    if(!lcd || !frame || !bands || band_num <= 0)
+        return -1;
+    /** The bands of the write in flight are still in use */
+    if(lcd->internal.dma_channel < 0 || lcd->internal.busy || lcd->internal.streaming)
+        return -1;
+    for(int i = 0; i < band_num; i++)
+    {
+        if(!is_region_valid(0, bands[i].row, LCD_WIDTH, bands[i].rows))
+            return -1;
+    }
+    lcd->internal.band_frame = frame;
+    lcd->internal.bands = bands;
+    lcd->internal.band_num = band_num;
+    lcd->internal.band_next = 1;
+    /** The window is full width from here on, the irq only moves the rows. */
+    int rc = lcd_write_region_async(lcd, 0, bands[0].row, LCD_WIDTH, bands[0].rows,
+        frame + bands[0].row * LCD_ROW_SIZE, on_done, ctx);
+    if(rc != 0)
+        lcd->internal.band_num = 0;
+    return rc;
+}
+
+int lcd_stream_begin(lcd_t* lcd, bool bottom_up)
+{
+    if(!lcd)
+        return -1;
+    if(lcd->internal.busy || lcd->internal.streaming)
+        return -1;
+    /** With the row address order flipped, page 0 is the bottom row. */
+    if(set_madctl(lcd, bottom_up ? (LCD_MADCTL_DEFAULT | LCD_MADCTL_BOTTOM_UP) : LCD_MADCTL_DEFAULT) != 0)
+        return -1;
+    if(set_window(lcd, 0, 0, LCD_WIDTH, LCD_HEIGHT) != 0)
+        return -1;
+    int rc = 0;
+    if(lcd->hooks.enter_critical_section)
+        lcd->hooks.enter_critical_section(lcd->hooks.critical_section_ctx);
+
+    gpio_put(lcd->pin_dc, 0);
+    gpio_put(lcd->pin_ncs, 0);
+    if(spi_write_blocking(lcd->spi, (uint8_t[]){0x2C}, 1) != 1)
+    {
+        gpio_put(lcd->pin_ncs, 1);
+        rc = -1;
+        goto finish;
+    }
+    /** nCS is held low until lcd_stream_end */
+    gpio_put(lcd->pin_dc, 1);
+    lcd->internal.streaming = true;
+
+finish:
+    if(lcd->hooks.exit_critical_section)
+        lcd->hooks.exit_critical_section(lcd->hooks.critical_section_ctx);
+
+    return rc;
+}
 
-    /** reset */
-    lcd->hooks.sleep(50, lcd->hooks.sleep_ctx);
+int lcd_stream_write(lcd_t* lcd, const uint8_t* pixels, int size)
+{
+    if(!lcd || !pixels || size < 0)
+        return -1;
+    if(!lcd->internal.streaming)
+        return -1;
+    int rc = 0;
+    if(lcd->hooks.enter_critical_section)
+        lcd->hooks.enter_critical_section(lcd->hooks.critical_section_ctx);
+
+    if(spi_write_blocking(lcd->spi, pixels, size) != size)
+        rc = -1;
+
+    if(lcd->hooks.exit_critical_section)
+        lcd->hooks.exit_critical_section(lcd->hooks.critical_section_ctx);
+
+    return rc;
+}
+
+int lcd_stream_end(lcd_t* lcd)
+{
+    if(!lcd)
+        return -1;
+    if(!lcd->internal.streaming)
+        return -1;
+    gpio_put(lcd->pin_ncs, 1);
+    lcd->internal.streaming = false;
+    return 0;
+}
+
+
+static int init_lcd_hardware(lcd_t* lcd)
+{
+    /** 
+     * Reset. Low pulse >= 10us. 
+     * The reset takes up to 120ms if the lcd was not in sleep mode. e.g. after a soft reboot.
+     */
     gpio_put(lcd->pin_nrst, 0);
-    lcd->hooks.sleep(50, lcd->hooks.sleep_ctx);
+    lcd->hooks.sleep(1, lcd->hooks.sleep_ctx);
     gpio_put(lcd->pin_nrst, 1);
     lcd->hooks.sleep(120, lcd->hooks.sleep_ctx);
 
-    /** Enable inter_command */
-    SEND_COMMAND_OR_RETURN(0xFE);
-    SEND_COMMAND_OR_RETURN(0xEF);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x86, 0xFF);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x87, 0xFF);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x8E, 0xFF);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x8F, 0xFF);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x80, 0x13);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x81, 0x40);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x82, 0x0A);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x83, 0x0B);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x84, 0x60);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x85, 0x80);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x89, 0x10);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x8A, 0x0F);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x8B, 0x02);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x8C, 0x59);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x8D, 0x55);
-    /** Set pixel format, 18bit 6-6-6, actual data: 8-8-8 */
-    SEND_COMMAND_OR_RETURN(0x3A, 0x66);
-    /** Inversion, 1 dot */
-    SEND_COMMAND_OR_RETURN(0xEC, 0x00);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x7E, 0x30);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x74, 0x05, 0x4D, 0x00, 0x00, 0x01, 0x00, 0x00);
-    /** Blanking porch control. With one parameter missing */
-    SEND_COMMAND_OR_RETURN(0xB5, 0x0D, 0x0D);
-    /** Display function control, source 1->240, gate 1->160 */
-    SEND_COMMAND_OR_RETURN(0xB6, 0x00, 0x00);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x60, 0x38, 0x09, 0x1E, 0x7A);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x63, 0x38, 0xAE, 0x1E, 0x7A);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x64, 0x38, 0x0B, 0x70, 0xAB, 0x1E, 0x7A);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x66, 0x38, 0x0F, 0x70, 0xAF, 0x1E, 0x7A);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x68, 0x00, 0x08, 0x07, 0x00, 0x07, 0x55, 0x6A);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x6A, 0x00, 0x00);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x6C, 0x22, 0x02, 0x22, 0x02, 0x22, 0x22, 0x50);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x6E, 0x00, 0x00, 0x00, 0x02, 0x14, 0x12, 0x0C, 
-                           0x0A, 0x1E, 0x1D, 0x08, 0x00, 0x16, 0x15, 0x00,
-                           0x00, 0x00, 0x00, 0x15, 0x16, 0x00, 0x07, 0x1D,
-                           0x1E, 0x09, 0x0B, 0x11, 0x13, 0x01, 0x00, 0x00,
-                           0x00);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x98, 0x3E);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x99, 0x3E);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x9B, 0x3B);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x93, 0x33, 0x7F, 0x00);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x91, 0x0E, 0x09);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x70, 0x04, 0x02, 0x0D, 0x04, 0x02, 0x0D);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0x71, 0x04, 0x02, 0x0D);
-    /** Power control 2 */
-    SEND_COMMAND_OR_RETURN(0xC3, 0x26);
-    /** Power control 3 */
-    SEND_COMMAND_OR_RETURN(0xC4, 0x26);
-    /** Power control 4 */
-    SEND_COMMAND_OR_RETURN(0xC9, 0x1C);
-    /** Set gamma 1 */
-    SEND_COMMAND_OR_RETURN(0xF0, 0x02, 0x03, 0x0A, 0x06, 0x00, 0x1A);
-    /** Set gamma 2 */
-    SEND_COMMAND_OR_RETURN(0xF1, 0x38, 0x78, 0x1B, 0x2E, 0x2F, 0xC8);
-    /** Set gamma 3 */
-    SEND_COMMAND_OR_RETURN(0xF2, 0x02, 0x03, 0x0A, 0x06, 0x00, 0x1A);
-    /** Set gamma 4 */
-    SEND_COMMAND_OR_RETURN(0xF3, 0x38, 0x74, 0x12, 0x2E, 0x2F, 0xDF);
-    /** Dual single gate select, single gate mode */
-    SEND_COMMAND_OR_RETURN(0xBF, 0x00);
-    /** Unknown command */
-    SEND_COMMAND_OR_RETURN(0xF9, 0x40);
-    /** Memory access control, all normal, BGR pixel */
-    SEND_COMMAND_OR_RETURN(0x36, 0x08);
-    /** Column address set, 15 -> 64 */
-    SEND_COMMAND_OR_RETURN(0x2A, 0x00, 0x0F, 0x00, 0x40);
-    /** Page address set, 0 -> 159 */
-    SEND_COMMAND_OR_RETURN(0x2B, 0x00, 0x00, 0x00, 0x9F);
-    /** This IS necessary after reset. */
-    if(lcd_exit_sleep(lcd) != 0)
+    if(run_command_table(lcd, init_sequence, sizeof(init_sequence)) != 0)
         return -1;
+    /** The table ends with sleep out and display on */
+    lcd->internal.sleep_out_us = time_us_64();
+    lcd->internal.madctl = LCD_MADCTL_DEFAULT;
+    lcd->internal.window.x = 0;
+    lcd->internal.window.y = 0;
+    lcd->internal.window.w = LCD_WIDTH;
+    lcd->internal.window.h = LCD_HEIGHT;
 
     return 0;
+}
 
-#undef SEND_COMMAND_OR_RETURN
+/** One critical section for all the commands between two delays. */
+static int run_command_table(lcd_t* lcd, const uint8_t* table, int size)
+{
+    if(lcd->internal.busy || lcd->internal.streaming)
+        return -1;
+    int rc = 0;
+    int pos = 0;
+    while(pos < size)
+    {
+        int delay_ms = 0;
+        if(lcd->hooks.enter_critical_section)
+            lcd->hooks.enter_critical_section(lcd->hooks.critical_section_ctx);
+        /** nCS is held low for the whole batch. The commands are separated by dc. */
+        gpio_put(lcd->pin_ncs, 0);
+        while(pos < size && delay_ms == 0)
+        {
+            const uint8_t* command = table + pos;
+            int data_size = command[1] & ~LCD_INIT_DELAY;
+            bool has_delay = (command[1] & LCD_INIT_DELAY) != 0;
+            pos += 2 + data_size + (has_delay ? 1 : 0);
+            gpio_put(lcd->pin_dc, 0);
+            if(spi_write_blocking(lcd->spi, command, 1) != 1)
+            {
+                rc = -1;
+                break;
+            }
+            if(data_size > 0)
+            {
+                gpio_put(lcd->pin_dc, 1);
+                if(spi_write_blocking(lcd->spi, command + 2, data_size) != data_size)
+                {
+                    rc = -1;
+                    break;
+                }
+            }
+            if(has_delay)
+                delay_ms = command[2 + data_size];
+        }
+        gpio_put(lcd->pin_ncs, 1);
+        gpio_put(lcd->pin_dc, 1);
+        if(lcd->hooks.exit_critical_section)
+            lcd->hooks.exit_critical_section(lcd->hooks.critical_section_ctx);
+        if(rc != 0)
+            return rc;
+        if(delay_ms > 0)
+            lcd->hooks.sleep(delay_ms, lcd->hooks.sleep_ctx);
+    }
+    return 0;
 }
 
 static void loop_sleep(uint32_t ms, void* ctx)
@@ -275,6 +519,8 @@ static int send_command(lcd_t* lcd, uint8_t* command_and_data, int size)
 {
     if(!lcd || !command_and_data || size < 1)
         return -1;
+    if(lcd->internal.busy || lcd->internal.streaming)
+        return -1;
     int rc = 0;
 
     if(lcd->hooks.enter_critical_section)
@@ -307,3 +553,143 @@ finish:
 
     return rc;
 }
+
+static bool is_region_valid(int x, int y, int w, int h)
+{
+    if(x < 0 || y < 0 || w <= 0 || h <= 0)
+        return false;
+    if(x + w > LCD_WIDTH || y + h > LCD_HEIGHT)
+        return false;
+    return true;
+}
+
+static int set_window(lcd_t* lcd, int x, int y, int w, int h)
+{
+    if(lcd->internal.window.x == x && lcd->internal.window.y == y &&
+        lcd->internal.window.w == w && lcd->internal.window.h == h)
+        return 0;
+    /** The window is unknown if any of the commands failed */
+    lcd->internal.window.w = 0;
+    uint16_t x_start = LCD_COLUMN_OFFSET + x;
+    uint16_t x_end = x_start + w - 1;
+    uint16_t y_start = y;
+    uint16_t y_end = y_start + h - 1;
+    /** Column address set */
+    if(send_command(lcd, (uint8_t[]){0x2A, x_start >> 8, x_start & 0xFF, x_end >> 8, x_end & 0xFF}, 5) != 0)
+        return -1;
+    /** Page address set */
+    if(send_command(lcd, (uint8_t[]){0x2B, y_start >> 8, y_start & 0xFF, y_end >> 8, y_end & 0xFF}, 5) != 0)
+        return -1;
+    lcd->internal.window.x = x;
+    lcd->internal.window.y = y;
+    lcd->internal.window.w = w;
+    lcd->internal.window.h = h;
+    return 0;
+}
+
+static int set_madctl(lcd_t* lcd, uint8_t madctl)
+{
+    if(lcd->internal.madctl == madctl)
+        return 0;
+    if(send_command(lcd, (uint8_t[]){0x36, madctl}, 2) != 0)
+        return -1;
+    lcd->internal.madctl = madctl;
+    return 0;
+}
+
+static int init_dma(lcd_t* lcd)
+{
+    lcd->internal.dma_channel = dma_claim_unused_channel(false);
+    lcd->internal.busy = false;
+    if(lcd->internal.dma_channel < 0)
+        return -1;
+    dma_channel_config config = dma_channel_get_default_config(lcd->internal.dma_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_dreq(&config, spi_get_dreq(lcd->spi, true));
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    dma_channel_configure(
+        lcd->internal.dma_channel,
+        &config,
+        &spi_get_hw(lcd->spi)->dr,
+        NULL,
+        0,
+        false);
+    dma_lcds[lcd->internal.dma_channel] = lcd;
+    if(!dma_irq_installed)
+    {
+        irq_add_shared_handler(DMA_IRQ_0, dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(DMA_IRQ_0, true);
+        dma_irq_installed = true;
+    }
+    dma_channel_set_irq0_enabled(lcd->internal.dma_channel, true);
+    return 0;
+}
+
+static void deinit_dma(lcd_t* lcd)
+{
+    if(lcd->internal.dma_channel < 0)
+        return;
+    dma_channel_set_irq0_enabled(lcd->internal.dma_channel, false);
+    dma_channel_abort(lcd->internal.dma_channel);
+    dma_lcds[lcd->internal.dma_channel] = NULL;
+    dma_channel_unclaim(lcd->internal.dma_channel);
+    lcd->internal.dma_channel = -1;
+    lcd->internal.band_num = 0;
+    lcd->internal.busy = false;
+}
+
+/** Only the page address changes between the bands. No task can use the lcd meanwhile, it is busy. */
+static void start_next_band_from_isr(lcd_t* lcd)
+{
+    const lcd_band_t* band = &lcd->internal.bands[lcd->internal.band_next++];
+    uint16_t y_start = band->row;
+    uint16_t y_end = y_start + band->rows - 1;
+    uint8_t page_set[] = {0x2B, y_start >> 8, y_start & 0xFF, y_end >> 8, y_end & 0xFF};
+    gpio_put(lcd->pin_ncs, 0);
+    gpio_put(lcd->pin_dc, 0);
+    spi_write_blocking(lcd->spi, page_set, 1);
+    gpio_put(lcd->pin_dc, 1);
+    spi_write_blocking(lcd->spi, page_set + 1, sizeof(page_set) - 1);
+    gpio_put(lcd->pin_ncs, 1);
+    lcd->internal.window.y = band->row;
+    lcd->internal.window.h = band->rows;
+    gpio_put(lcd->pin_dc, 0);
+    gpio_put(lcd->pin_ncs, 0);
+    spi_write_blocking(lcd->spi, (uint8_t[]){0x2C}, 1);
+    gpio_put(lcd->pin_dc, 1);
+    /** nCS is released in the dma irq */
+    dma_channel_transfer_from_buffer_now(lcd->internal.dma_channel,
+        lcd->internal.band_frame + band->row * LCD_ROW_SIZE, band->rows * LCD_ROW_SIZE);
+}
+
+static void dma_irq_handler(void)
+{
+    for(int i = 0; i < NUM_DMA_CHANNELS; i++)
+    {
+        lcd_t* lcd = dma_lcds[i];
+        if(!lcd || !dma_channel_get_irq0_status(i))
+            continue;
+        dma_channel_acknowledge_irq0(i);
+        /** 
+         * The dma is done when the last byte enters the FIFO. 
+         * Wait for the FIFO to be shifted out. This is at most 8 bytes.
+         */
+        while(spi_is_busy(lcd->spi))
+            tight_loop_contents();
+        /** Same as spi_write_blocking, drop the rx data and the overrun flag. */
+        while(spi_is_readable(lcd->spi))
+            (void)spi_get_hw(lcd->spi)->dr;
+        spi_get_hw(lcd->spi)->icr = SPI_SSPICR_RORIC_BITS;
+        gpio_put(lcd->pin_ncs, 1);
+        if(lcd->internal.band_next < lcd->internal.band_num)
+        {
+            start_next_band_from_isr(lcd);
+            continue;
+        }
+        lcd->internal.band_num = 0;
+        lcd->internal.busy = false;
+        if(lcd->internal.on_done)
+            lcd->internal.on_done(lcd->internal.on_done_ctx);
+    }
+}
@@ -3,16 +3,42 @@
 /**
  * This is not a general gc9d01 library as there are too many undocumented commands in the configuration process.
  * This is only for the 1.12 inch 50*160 lcd with the gc9d01 driver.
- * DMA support was removed as the spi FIFO is too small for dma to be meaningful.
+ * Frames can be pushed with DMA through lcd_write_frame_async. The gain is not the FIFO depth,
+ * but that the cpu and the interrupts are free while the frame is being shifted out.
  */
 
 #include <pico/stdlib.h>
 #include <hardware/spi.h>
+#include <hardware/dma.h>
+
+/** 18bit color, sent as 8-8-8. */
+#define LCD_PIXEL_FORMAT_RGB666 (0)
+/** 16bit color, sent as 5-6-5. 1/3 less data per frame. */
+#define LCD_PIXEL_FORMAT_RGB565 (1)
+
+/** Select with the compiler definitions. */
+#ifndef LCD_PIXEL_FORMAT
+#define LCD_PIXEL_FORMAT LCD_PIXEL_FORMAT_RGB666
+#endif
 
 #define LCD_WIDTH (50)
 #define LCD_HEIGHT (160)
+#if LCD_PIXEL_FORMAT == LCD_PIXEL_FORMAT_RGB565
+#define LCD_PIXEL_SIZE (2)
+#elif LCD_PIXEL_FORMAT == LCD_PIXEL_FORMAT_RGB666
 #define LCD_PIXEL_SIZE (3)
-#define LCD_FRAME_SIZE (LCD_WIDTH*LCD_HEIGHT*LCD_PIXEL_SIZE)
+#else
+#error "Unsupported LCD_PIXEL_FORMAT"
+#endif
+#define LCD_ROW_SIZE (LCD_WIDTH*LCD_PIXEL_SIZE)
+#define LCD_FRAME_SIZE (LCD_ROW_SIZE*LCD_HEIGHT)
+
+/** Full width rows of a frame */
+typedef struct
+{
+    int row;
+    int rows;
+} lcd_band_t;
 
 typedef struct
 {
@@ -38,6 +64,32 @@ typedef struct
     {
         int spi_baudrate;
     } options;
+    struct
+    {
+        /** The address window currently programmed into the lcd. */
+        struct
+        {
+            int x;
+            int y;
+            int w;
+            int h;
+        } window;
+        /** The memory access control (0x36) value currently programmed into the lcd. */
+        uint8_t madctl;
+        bool streaming;
+        /** Sleep in is only allowed 120ms after sleep out. */
+        uint64_t sleep_out_us;
+        /** -1 if no dma channel is available. Async writes will fail in that case. */
+        int dma_channel;
+        volatile bool busy;
+        void (*on_done)(void* ctx);
+        void* on_done_ctx;
+        /** The bands of lcd_write_bands_async still to go. Started from the dma irq. */
+        const uint8_t* band_frame;
+        const lcd_band_t* bands;
+        int band_num;
+        int band_next;
+    } internal;
 } lcd_t;
 
 /**
@@ -64,7 +116,9 @@ int lcd_exit_sleep(lcd_t* lcd);
 
 /**
  * @brief Write one frame to the LCD. 
- * Pixel format: BGR888
+ * Pixel format: 
+ *  LCD_PIXEL_FORMAT_RGB666: BGR888, one byte per channel
+ *  LCD_PIXEL_FORMAT_RGB565: BGR565, big endian 16bit with blue in the high bits
  * Left -> right, top -> bottom
  * 
  * @param lcd 
@@ -72,3 +126,87 @@ int lcd_exit_sleep(lcd_t* lcd);
  * @return int 
  */
 int lcd_write_frame(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE]);
+
+/**
+ * @brief Start writing one frame to the LCD with DMA and return immediately.
+ * The frame MUST stay untouched until on_done is called.
+ * on_done is called from the DMA IRQ. Use the FromISR APIs in it.
+ * All the other lcd functions will fail until the write is done.
+ * 
+ * @param lcd 
+ * @param frame Same format as lcd_write_frame
+ * @param on_done Can be NULL
+ * @param ctx 
+ * @return int 
+ */
+int lcd_write_frame_async(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE], void (*on_done)(void* ctx), void* ctx);
+
+/**
+ * @brief Write a rectangle of the LCD. Only the rectangle is sent through spi.
+ * Pixel format: Same as lcd_write_frame
+ * Left -> right, top -> bottom. The pixels are packed, row size is w * LCD_PIXEL_SIZE.
+ * 
+ * @param lcd 
+ * @param x 
+ * @param y 
+ * @param w 
+ * @param h 
+ * @param pixels w * h pixels
+ * @return int 
+ */
+int lcd_write_region(lcd_t* lcd, int x, int y, int w, int h, const uint8_t* pixels);
+
+/**
+ * @brief Async version of lcd_write_region. Same rules as lcd_write_frame_async apply.
+ * 
+ * @param lcd 
+ * @param x 
+ * @param y 
+ * @param w 
+ * @param h 
+ * @param pixels w * h pixels
+ * @param on_done Can be NULL
+ * @param ctx 
+ * @return int 
+ */
+int lcd_write_region_async(lcd_t* lcd, int x, int y, int w, int h, const uint8_t* pixels, void (*on_done)(void* ctx), void* ctx);
+
+/**
+ * @brief Write bands of a frame with DMA and return immediately.
+ * Each band is started from the DMA IRQ once the one before it is shifted out,
+ * so the cpu is free for the whole frame, not only for its last band.
+ * Same rules as lcd_write_frame_async apply. The bands MUST stay untouched as well.
+ * on_done is called once, after the last band.
+ * 
+ * @param lcd 
+ * @param frame Same format as lcd_write_frame. Only the rows of the bands are read.
+ * @param bands Top -> down, not overlapping
+ * @param band_num 
+ * @param on_done Can be NULL
+ * @param ctx 
+ * @return int 
+ */
+int lcd_write_bands_async(lcd_t* lcd, const uint8_t frame[LCD_FRAME_SIZE], const lcd_band_t* bands, int band_num, void (*on_done)(void* ctx), void* ctx);
+
+/**
+ * @brief Start writing one frame piece by piece with lcd_stream_write. 
+ * All the other lcd functions will fail until lcd_stream_end is called.
+ * 
+ * @param lcd 
+ * @param bottom_up Set this to receive the rows bottom -> up. As in a bmp file.
+ * @return int 
+ */
+int lcd_stream_begin(lcd_t* lcd, bool bottom_up);
+
+/**
+ * @brief Send the next pixels of the frame started with lcd_stream_begin.
+ * Pixel format: Same as lcd_write_frame
+ * 
+ * @param lcd 
+ * @param pixels 
+ * @param size Does not need to be a multiple of LCD_PIXEL_SIZE
+ * @return int 
+ */
+int lcd_stream_write(lcd_t* lcd, const uint8_t* pixels, int size);
+
+int lcd_stream_end(lcd_t* lcd);
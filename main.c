@@ -5,7 +5,6 @@
 
 /** FreeRTOS */
 #include <FreeRTOS.h>
-#include <queue.h>
 #include <task.h>
 #include <timers.h>
 #include <semphr.h>
@@ -22,64 +21,323 @@
 #include "usb_drive.h"
 #include "lcd.h"
 #include "button.h"
+#include "decoder.h"
+#include "frame_hash.h"
+#include "frame_store.h"
+#include "rwlock.h"
+#include "screen_tasks.h"
+#include "latency_probe.h"
+#include "debug.h"
+#if USB_SCREEN_FLASH_DISK
+#include "flash_disk.h"
+#endif
+#if USB_SCREEN_RAW_LUN
+#include "raw_slots.h"
+#endif
+#if CFG_TUD_CDC
+#include "canvas.h"
+#include "draw_command.h"
+#endif
 
-/** This is ample time */
-#define FILE_WRITE_FINISH_TIMEOUT_MS (30)
+/** 
+ * The write tracker tells when the file is complete.
+ * This is only a fallback in case the host leaves the file in a state the tracker never accepts.
+ */
+#define FILE_WRITE_FINISH_TIMEOUT_MS (100)
 #define FILE_WRITE_FINISH_TIMEOUT_TICK (pdMS_TO_TICKS(FILE_WRITE_FINISH_TIMEOUT_MS))
+/** What a frame is drawn from. Drawn together when pending together. */
+#define FRAME_SOURCE_FILE (1u << 0)
+#define FRAME_SOURCE_RAW (1u << 1)
+#define FRAME_SOURCE_DRAWING (1u << 2)
+#if LCD_PIXEL_FORMAT == LCD_PIXEL_FORMAT_RGB565
+#define BMP_OUTPUT_FORMAT BMP_OUTPUT_BGR565
+#else
+#define BMP_OUTPUT_FORMAT BMP_OUTPUT_BGR888
+#endif
+/** Decodes from a snapshot before the writes are held off */
+#define DECODE_OPTIMISTIC_TRIES (3)
+/** Unchanged rows between two changed bands are sent anyway if there are no more than this. */
+#define FRAME_BAND_MERGE_ROWS (2)
+#if USB_SCREEN_FLASH_DISK
+/** At the end of the flash, away from the firmware. 40 bmp files of a full frame. */
+#define FLASH_DISK_SIZE (1024 * 1024)
+#define FLASH_DISK_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_DISK_SIZE)
+#define FLASH_DISK_BLOCK_NUM (FLASH_DISK_SIZE / DISK_BLOCK_SIZE)
+#endif
+/** Right below the flash disk, or at the end of the flash */
+#define FRAME_STORE_SIZE (96 * 1024)
+#if USB_SCREEN_FLASH_DISK
+#define FRAME_STORE_OFFSET (FLASH_DISK_OFFSET - FRAME_STORE_SIZE)
+#else
+#define FRAME_STORE_OFFSET (PICO_FLASH_SIZE_BYTES - FRAME_STORE_SIZE)
+#endif
+/** A frame is saved once it stays on the lcd this long. Keeps the flash from wearing out on animations. */
+#define FRAME_SAVE_DELAY_MS (3000)
+#define FRAME_SAVE_DELAY_TICK (pdMS_TO_TICKS(FRAME_SAVE_DELAY_MS))
+#if USB_SCREEN_STATS_FILE
+/** STATS.TXT in the root directory. The text is padded to this. */
+#define STATS_FILE_SIZE (2048)
+#endif
+#if USB_SCREEN_RAW_LUN
+/** Frame slots on the raw LUN, the host writes one while the other is shown */
+#define RAW_SLOT_NUM (2)
+#endif
 
+static void disk_rdlock(void* );
 static void disk_lock(void* );
 static void disk_unlock(void* );
+static void state_lock();
+static void state_unlock();
 static void on_disk_write(uint32_t , void* );
+static void track_disk_write(uint32_t block, fat12_region_t region);
+static void on_disk_sync(void* );
 static void disk_write_finish_timer_handler(TimerHandle_t timer);
+static void check_file_end();
+static void frame_save_timer_handler(TimerHandle_t timer);
 static void usb_device_task(void *param);
 static void lcd_task(void* param);
-static int read_frame_buffer();
+static void wait_lcd_write();
+static int start_write_rows(int row, int rows, const uint8_t* pixels);
+static int show_back_buffer();
+static int show_stored_frame();
+static void save_frame();
+#if USB_SCREEN_FLASH_DISK
+static int show_next_file();
+static void select_written_file();
+#endif
+#if USB_SCREEN_RAW_LUN
+static void on_raw_disk_write(uint32_t block, void* );
+static void on_raw_disk_sync(void* );
+static int show_raw_frame();
+#endif
+#if CFG_TUD_CDC
+static int show_drawing();
+static void on_cdc_available(void* );
+static void take_draw_commands();
+static void on_draw_commit(void* );
+#endif
+static void lcd_enter_critical_section(void* );
+static void lcd_exit_critical_section(void* );
+#if USB_SCREEN_STATS_REPORT
+static void on_stats_report(void* );
+#endif
+static void on_lcd_wake(uint32_t wake_us, void* );
+#if USB_SCREEN_STATS_FILE
+static bool on_disk_read(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* );
+static uint32_t on_stats_file_read(char* text, uint32_t size, void* );
+#endif
 static void button_on_click(void* );
+#if USB_SCREEN_FLASH_DISK
+static void button_on_long_press(void* );
+#endif
 
 static lcd_t lcd = {0};
-static uint8_t frame_buffer[LCD_FRAME_SIZE] = {0};
+/** 
+ * The next frame is decoded into the back buffer while the front buffer is being pushed to the lcd.
+ * The back buffer is filled by the decoder as the sectors are written through usb.
+ * The buffers are swapped when the back buffer is shown.
+ */
+static uint8_t frame_buffers[2][LCD_FRAME_SIZE] = {0};
+/** What is on the lcd now. Only the rows of the back buffer that differ from this are sent. */
+static uint8_t* front_buffer = frame_buffers[0];
+static uint8_t* back_buffer = frame_buffers[1];
+static bool front_buffer_valid = false;
+static bool lcd_write_pending = false;
+/** Taken in the dma irq, for the latency of the last band */
+static volatile uint32_t lcd_write_done_us = 0;
+/** The last band of a probed frame is in flight */
+static bool lcd_write_probed = false;
 static disk_t disk = {0};
+#if USB_SCREEN_FLASH_DISK
+/** The files stay over power cycles. The button switches between them. */
+static flash_disk_t flash_disk = {0};
+/** The file on the lcd, 0 for the first file on the disk */
+static uint32_t shown_file = 0;
+/** Data blocks written since the last frame from the disk. One bit per block. Tells which file the host copied. */
+static uint32_t written_blocks[(FLASH_DISK_BLOCK_NUM + 31) / 32] = {0};
+#else
+static uint8_t disk_mem[DISK_BLOCK_NUM * DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+#endif
+#if USB_SCREEN_RAW_LUN
+/** LUN 1. The frames are in slots in the lcd pixel format, same as usb_screen_raw. */
+static disk_t raw_disk = {0};
+static uint8_t raw_disk_mem[RAW_SLOTS_BLOCK_NUM(LCD_FRAME_SIZE, RAW_SLOT_NUM) * DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+/** The slot is copied to the front buffer with the read lock held, so the writes never wait for the lcd */
+static raw_slots_t raw_slots = {0};
+#endif
+static decoder_t decoder = {0};
+/** What the lcd task decodes from. 4 KB, so keep it out of the task stack. */
+static disk_snapshot_t disk_snapshot = {0};
+static fat12_write_tracker_t write_tracker = {0};
+static frame_hash_t frame_hash = {0};
+/** The last frame that stayed on the lcd. Shown at boot before the host writes anything. */
+static frame_store_t frame_store = {0};
+#if CFG_TUD_CDC
+/** 
+ * The drawing commands draw on a copy of the front buffer, on top of what is on the lcd.
+ * So the usb task never writes to a buffer the dma may be reading. show_drawing copies the drawn rows over.
+ */
+static uint8_t drawing_buffer[LCD_FRAME_SIZE] = {0};
+static canvas_t canvas = {0};
+static draw_command_t draw_command = {0};
+#endif
+/** Which path decided the file was written */
+static struct
+{
+	uint32_t tracker;
+	uint32_t sync;
+	uint32_t timer;
+} file_end_stats = {0};
+/** Writes and redraws that did not touch the image */
+static struct
+{
+	uint32_t boot_writes;
+	uint32_t other_file_writes;
+	uint32_t redraws;
+} suppressed_stats = {0};
+/** Who waited for who */
+static struct
+{
+	/** Usb writes that came while the state was locked, caught up with on state_unlock */
+	uint32_t deferred_writes;
+	/** Decodes started over as the snapshot was lost or the file system was written */
+	uint32_t decode_conflicts;
+	/** Decodes that held off the writes after DECODE_OPTIMISTIC_TRIES conflicts */
+	uint32_t decode_fallbacks;
+} contention_stats = {0};
+/** Blocks written while the state was locked. One bit per block. */
+static uint32_t deferred_blocks[(DISK_BLOCK_NUM + 31) / 32] = {0};
 static button_t button = {0};
+/** From the first write of the bmp file to its last band on the lcd */
+static latency_probe_t latency_probe = {0};
+#if USB_SCREEN_STATS_FILE
+/** Any host can cat it, no tools needed */
+static fat12_virtual_file_t stats_file = {0};
+static char stats_file_text[STATS_FILE_SIZE];
+#endif
 
 static TimerHandle_t disk_write_finish_timer = NULL;
+static TimerHandle_t frame_save_timer = NULL;
+static StaticTimer_t disk_write_finish_timer_buffer;
+static StaticTimer_t frame_save_timer_buffer;
 
-enum
-{
-	LCD_COMMAND_NEW_FRAME,
-	LCD_COMMAND_TOGGLE_SLEEP
-};
-typedef uint32_t lcd_command_t;
+/** The lcd task events of this firmware, next to the ones in screen_tasks.h */
+#define LCD_EVENT_NEXT_FILE (LCD_EVENT_USER << 0)
+#define LCD_EVENT_SAVE_FRAME (LCD_EVENT_USER << 1)
+#define LCD_EVENT_FILE_CHECK (LCD_EVENT_USER << 2)
+#define LCD_EVENT_DRAW_COMMANDS (LCD_EVENT_USER << 3)
 
-static QueueHandle_t lcd_command_queue = NULL;
-static SemaphoreHandle_t disk_mutex = NULL;
+/** Flipped by the button. The lcd task follows it, two quick clicks are not lost in one event bit. */
+static volatile bool sleep_requested = false;
+/** The disk content. Writes are short, reads are either short or optimistic. */
+static rwlock_t disk_rwlock = {0};
+/** 
+ * Everything else shared between the tasks: the decoder, the write tracker, the frame buffers and the canvas.
+ * The usb task never waits for this in the write path.
+ */
+static SemaphoreHandle_t state_mutex = NULL;
+static StaticSemaphore_t state_mutex_buffer;
 
 int main()
 {
     stdio_init_all();
 
+	/** Before the disk, disk_flush takes the lock */
+	rwlock_init(&disk_rwlock);
+	state_mutex = xSemaphoreCreateMutexStatic(&state_mutex_buffer);
 	/** Init disk */
+#if USB_SCREEN_FLASH_DISK
+	flash_disk.flash_offset = FLASH_DISK_OFFSET;
+	flash_disk.size = FLASH_DISK_SIZE;
+	flash_disk_init(&flash_disk, &disk);
+#else
+	disk.mem = disk_mem;
+	disk.block_num = DISK_BLOCK_NUM;
+#endif
 	disk.hooks.rwlock_wrlock = disk_lock;
+	disk.hooks.rwlock_rdlock = disk_rdlock;
 	disk.hooks.rwlock_unlock = disk_unlock;
 	disk.callbacks.on_write = on_disk_write;
+	disk.callbacks.on_sync = on_disk_sync;
 	disk_init(&disk);
+#if USB_SCREEN_FLASH_DISK
+	/** Keep the files from the last time. Formatted on the first boot only. */
+	if(!fat12_is_formatted(&disk))
+	{
+		fat12_format(&disk);
+		disk_flush(&disk);
+	}
+#else
 	fat12_format(&disk);
+#endif
+#if USB_SCREEN_STATS_FILE
+	memcpy(stats_file.filename, "STATS   TXT", sizeof(stats_file.filename));
+	stats_file.size = STATS_FILE_SIZE;
+	stats_file.text = stats_file_text;
+	stats_file.callbacks.on_read = on_stats_file_read;
+	/** Kept on the flash disk from the last boot */
+	if(fat12_add_virtual_file(&disk, &stats_file) == 0)
+		disk_flush(&disk);
+	disk.callbacks.on_read = on_disk_read;
+#endif
+	frame_store.flash_offset = FRAME_STORE_OFFSET;
+	frame_store.size = FRAME_STORE_SIZE;
+	frame_store.frame_size = LCD_FRAME_SIZE;
+	frame_store_init(&frame_store);
+	decoder.disk = &disk;
+	decoder.frame_size = LCD_FRAME_SIZE;
+	decoder.output_format = BMP_OUTPUT_FORMAT;
+	decoder_init(&decoder);
+	decoder_set_frame(&decoder, back_buffer);
 
 	/** Static init of the usb drive */
 	char board_id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES*2+1];
 	pico_get_unique_board_id_string(board_id, sizeof(board_id));
 	board_id[sizeof(board_id)-1] = '\0';
 	usb_drive_init_singleton(board_id, &disk);
+#if USB_SCREEN_RAW_LUN
+	raw_disk.mem = raw_disk_mem;
+	raw_disk.block_num = RAW_SLOTS_BLOCK_NUM(LCD_FRAME_SIZE, RAW_SLOT_NUM);
+	raw_disk.hooks.rwlock_wrlock = disk_lock;
+	raw_disk.hooks.rwlock_rdlock = disk_rdlock;
+	raw_disk.hooks.rwlock_unlock = disk_unlock;
+	raw_disk.callbacks.on_write = on_raw_disk_write;
+	raw_disk.callbacks.on_sync = on_raw_disk_sync;
+	raw_slots.disk = &raw_disk;
+	raw_slots.frame_size = LCD_FRAME_SIZE;
+	raw_slots.slot_num = RAW_SLOT_NUM;
+	raw_slots_init(&raw_slots);
+	disk_init(&raw_disk);
+	usb_drive_add_lun(&raw_disk, "USB Screen Raw");
+#endif
+#if CFG_TUD_CDC
+	canvas.frame = drawing_buffer;
+	canvas.width = LCD_WIDTH;
+	canvas.height = LCD_HEIGHT;
+	canvas.format = BMP_OUTPUT_FORMAT;
+	canvas_init(&canvas);
+	draw_command.canvas = &canvas;
+	draw_command.callbacks.on_commit = on_draw_commit;
+	draw_command_init(&draw_command);
+	usb_drive_set_cdc_callback(on_cdc_available, NULL);
+#endif
 
-	disk_mutex = xSemaphoreCreateMutex();
-	disk_write_finish_timer = xTimerCreate("diskw", FILE_WRITE_FINISH_TIMEOUT_TICK, pdFALSE, NULL, disk_write_finish_timer_handler);
-	lcd_command_queue = xQueueCreate(10, sizeof(lcd_command_t));
-	/** Put the usb task to the lowest priority. This task is always busy. */
-    xTaskCreate(usb_device_task, "usbd", 1024, NULL, tskIDLE_PRIORITY + 1, NULL);
-	// The lcd task needs to be at a higher priority.
-	xTaskCreate(lcd_task, "lcd", 1024, NULL, configMAX_PRIORITIES - 1, NULL);
+	disk_write_finish_timer = xTimerCreateStatic("diskw", FILE_WRITE_FINISH_TIMEOUT_TICK, pdFALSE, NULL, disk_write_finish_timer_handler, &disk_write_finish_timer_buffer);
+	frame_save_timer = xTimerCreateStatic("fsave", FRAME_SAVE_DELAY_TICK, pdFALSE, NULL, frame_save_timer_handler, &frame_save_timer_buffer);
+	latency_probe.hooks.enter_critical_section = lcd_enter_critical_section;
+	latency_probe.hooks.exit_critical_section = lcd_exit_critical_section;
+	latency_probe_init(&latency_probe);
+	screen_tasks_init_singleton(usb_device_task, lcd_task);
+	screen_tasks_set_wake_callback(on_lcd_wake, NULL);
+#if USB_SCREEN_STATS_REPORT
+	screen_tasks_set_report_callback(on_stats_report, NULL);
+#endif
 
 	button.pin = 8;
 	button.callback.on_click = button_on_click;
+#if USB_SCREEN_FLASH_DISK
+	button.callback.on_long_press = button_on_long_press;
+#endif
 	button_init(&button);
 
     vTaskStartScheduler();
@@ -92,14 +350,47 @@ int main()
     return 0;
 }
 
+static void disk_rdlock(void* )
+{
+	rwlock_rdlock(&disk_rwlock);
+}
+
 static void disk_lock(void* )
 {
-	xSemaphoreTake(disk_mutex, portMAX_DELAY);
+	rwlock_wrlock(&disk_rwlock);
 }
 
 static void disk_unlock(void* )
 {
-	xSemaphoreGive(disk_mutex);
+	rwlock_unlock(&disk_rwlock);
+}
+
+static void state_lock()
+{
+	if(xSemaphoreTake(state_mutex, 0) == pdTRUE)
+		return;
+	uint32_t start_us = time_us_32();
+	xSemaphoreTake(state_mutex, portMAX_DELAY);
+	latency_probe_add(&latency_probe, LATENCY_STAGE_LOCK_WAIT, time_us_32() - start_us);
+}
+
+static void replay_deferred_writes();
+
+static void state_unlock()
+{
+	for(;;)
+	{
+		replay_deferred_writes();
+		xSemaphoreGive(state_mutex);
+		/** A write may be deferred after the replay. Catch up with it, unless someone else has the lock now. */
+		taskENTER_CRITICAL();
+		bool deferred = false;
+		for(int i = 0; i < (DISK_BLOCK_NUM + 31) / 32; i++)
+			deferred = deferred || deferred_blocks[i] != 0;
+		taskEXIT_CRITICAL();
+		if(!deferred || xSemaphoreTake(state_mutex, 0) != pdTRUE)
+			return;
+	}
 }
 
 // USB Device Driver task
@@ -119,15 +410,194 @@ static void usb_device_task(void* )
     }
 }
 
-static void on_disk_write(uint32_t , void* )
+static void on_disk_write(uint32_t block, void* )
 {
+	fat12_region_t region = fat12_get_block_region(&disk, block);
+	if(region == FAT12_REGION_BOOT)
+	{
+		suppressed_stats.boot_writes++;
+		return;
+	}
+	/** tud_msc_write10_cb writes straight through, this is right after it came in */
+	latency_probe_write(&latency_probe, time_us_32());
+#if USB_SCREEN_FLASH_DISK
+	/** 
+	 * The write is still in the flash disk cache, the decoder and the tracker read the flash.
+	 * Decode the whole file once the host is done instead.
+	 */
+	if(region == FAT12_REGION_DATA && block < FLASH_DISK_BLOCK_NUM)
+	{
+		taskENTER_CRITICAL();
+		written_blocks[block / 32] |= 1u << (block % 32);
+		taskEXIT_CRITICAL();
+	}
 	xTimerReset(disk_write_finish_timer, FILE_WRITE_FINISH_TIMEOUT_TICK);
+	return;
+#endif
+	/** Do not hold up the usb task behind a decode. The holder catches up with the block on state_unlock. */
+	if(xSemaphoreTake(state_mutex, 0) != pdTRUE)
+	{
+		taskENTER_CRITICAL();
+		deferred_blocks[block / 32] |= 1u << (block % 32);
+		taskEXIT_CRITICAL();
+		contention_stats.deferred_writes++;
+		/** The holder may have given the lock back before the bit was set */
+		if(xSemaphoreTake(state_mutex, 0) == pdTRUE)
+			state_unlock();
+		return;
+	}
+	track_disk_write(block, region);
+	state_unlock();
 }
 
+/** Call this with the state locked. The disk content must not change meanwhile. */
+static void track_disk_write(uint32_t block, fat12_region_t region)
+{
+	/** The sector is decoded into the back buffer right away. */
+	decoder_on_disk_write(&decoder, block);
+	bool file_written = fat12_write_tracker_on_write(&write_tracker, &disk, block);
+	bool other_file = false;
+	if(!file_written && region == FAT12_REGION_DATA)
+	{
+		/** e.g. .fseventsd, System Volume Information or ._ files */
+		fat12_file_reader_t reader = {0};
+		int owner = fat12_get_block_owner(&disk, block);
+		other_file = owner >= 0 && (fat12_open_next_file(&disk, &reader) != 0 || owner != reader.entry);
+	}
+	if(other_file)
+	{
+		suppressed_stats.other_file_writes++;
+	}
+	else if(file_written)
+	{
+		/** The directory entry, the FAT and all the data agree. No need to wait for the timer. */
+		xTimerStop(disk_write_finish_timer, 0);
+		file_end_stats.tracker++;
+		latency_probe_file_end(&latency_probe, time_us_32());
+		screen_tasks_schedule_frame(FRAME_SOURCE_FILE);
+	}
+	else
+	{
+		/** The FAT, the root directory or a free cluster. This may or may not be the image. */
+		xTimerReset(disk_write_finish_timer, FILE_WRITE_FINISH_TIMEOUT_TICK);
+	}
+}
+
+/** Call this with the state locked, from any task */
+static void replay_deferred_writes()
+{
+	uint32_t blocks[(DISK_BLOCK_NUM + 31) / 32];
+	taskENTER_CRITICAL();
+	memcpy(blocks, deferred_blocks, sizeof(blocks));
+	memset(deferred_blocks, 0, sizeof(deferred_blocks));
+	taskEXIT_CRITICAL();
+	bool locked = false;
+	for(uint32_t block = 0; block < DISK_BLOCK_NUM; block++)
+	{
+		if(!(blocks[block / 32] & (1u << (block % 32))))
+			continue;
+		/** Not in the usb task, the disk may be written meanwhile */
+		if(!locked)
+		{
+			disk_rdlock(NULL);
+			locked = true;
+		}
+		track_disk_write(block, fat12_get_block_region(&disk, block));
+	}
+	if(locked)
+		disk_unlock(NULL);
+}
+
+/** 
+ * @param wait How long to wait for the state lock. 
+ * The file counts as touched if the lock is not taken, the frame hash drops the frame if it was not.
+ */
+static bool is_file_touched(TickType_t wait)
+{
+#if USB_SCREEN_FLASH_DISK
+	/**
+	 * The tracker does not cover the flash disk, it would read the flash under the cache.
+	 * The FAT, the root directory and the timestamps alone do not change the image, only the data does.
+	 */
+	bool file_touched = false;
+	taskENTER_CRITICAL();
+	for(uint32_t i = 0; i < sizeof(written_blocks) / sizeof(written_blocks[0]) && !file_touched; i++)
+		file_touched = written_blocks[i] != 0;
+	taskEXIT_CRITICAL();
+	return file_touched;
+#else
+	if(xSemaphoreTake(state_mutex, wait) != pdTRUE)
+		return true;
+	disk_rdlock(NULL);
+	bool file_touched = fat12_write_tracker_is_file_touched(&write_tracker, &disk);
+	disk_unlock(NULL);
+	state_unlock();
+	return file_touched;
+#endif
+}
+
+static void on_disk_sync(void* )
+{
+	/** The host flushed. Whatever is written now is what it wants to show. */
+	if(!is_file_touched(0))
+		return;
+	xTimerStop(disk_write_finish_timer, 0);
+	file_end_stats.sync++;
+	latency_probe_file_end(&latency_probe, time_us_32());
+	screen_tasks_schedule_frame(FRAME_SOURCE_FILE);
+}
+
+#if USB_SCREEN_RAW_LUN
+static void on_raw_disk_write(uint32_t block, void* )
+{
+	/** Raw mode, the control block write commits a slot. Or the last block of the frame in the old layout. */
+	if(raw_slots_is_commit(&raw_slots, block))
+	{
+		screen_tasks_schedule_frame(FRAME_SOURCE_RAW);
+	}
+}
+
+static void on_raw_disk_sync(void* )
+{
+	screen_tasks_schedule_frame(FRAME_SOURCE_RAW);
+}
+#endif
+
 static void disk_write_finish_timer_handler(TimerHandle_t )
 {
-	lcd_command_t command = LCD_COMMAND_NEW_FRAME;
-	xQueueSend(lcd_command_queue, &command, 0);
+	/** The timer task must not wait for the locks, every other timer would stall behind it */
+	screen_tasks_notify_lcd(LCD_EVENT_FILE_CHECK);
+}
+
+/** The host went quiet. Only call this in the lcd task, it waits for the locks. */
+static void check_file_end()
+{
+	if(!is_file_touched(portMAX_DELAY))
+	{
+		/** Only metadata or other files changed. The image on the lcd is still up to date. */
+		suppressed_stats.redraws++;
+		latency_probe_ignore(&latency_probe);
+		DEBUG_PRINTF("Redraw suppressed. boot writes: %lu, other file writes: %lu, redraws: %lu\n",
+			suppressed_stats.boot_writes,
+			suppressed_stats.other_file_writes,
+			suppressed_stats.redraws);
+		return;
+	}
+	file_end_stats.timer++;
+	latency_probe_file_end(&latency_probe, time_us_32());
+	DEBUG_PRINTF("File end by timer. tracker: %lu, sync: %lu, timer: %lu, no file: %lu, broken chain: %lu, data pending: %lu\n",
+		file_end_stats.tracker,
+		file_end_stats.sync,
+		file_end_stats.timer,
+		write_tracker.stats.no_file,
+		write_tracker.stats.broken_chain,
+		write_tracker.stats.data_pending);
+	screen_tasks_schedule_frame(FRAME_SOURCE_FILE);
+}
+
+static void frame_save_timer_handler(TimerHandle_t )
+{
+	screen_tasks_notify_lcd(LCD_EVENT_SAVE_FRAME);
 }
 
 static void lcd_enter_critical_section(void* )
@@ -145,6 +615,50 @@ static void lcd_sleep(uint32_t ms, void* )
 	vTaskDelay(pdMS_TO_TICKS(ms));
 }
 
+static void lcd_on_frame_written(void* )
+{
+	/** This is called from the dma irq */
+	lcd_write_done_us = time_us_32();
+	screen_tasks_notify_lcd_from_isr(LCD_EVENT_WRITE_DONE);
+}
+
+/** Only call this in the lcd task, once LCD_EVENT_WRITE_DONE is taken */
+static void finish_lcd_write()
+{
+	lcd_write_pending = false;
+	if(lcd_write_probed)
+	{
+		lcd_write_probed = false;
+		latency_probe_lcd_end(&latency_probe, lcd_write_done_us, true);
+	}
+}
+
+/** Only call this in the lcd task */
+static void wait_lcd_write()
+{
+	if(!lcd_write_pending)
+		return;
+	screen_tasks_take_lcd_events(LCD_EVENT_WRITE_DONE, portMAX_DELAY);
+	finish_lcd_write();
+}
+
+/** 
+ * Only call this in the lcd task. 
+ * Returns when the write is started. The pixels MUST NOT be changed until wait_lcd_write returns.
+ */
+static int start_write_rows(int row, int rows, const uint8_t* pixels)
+{
+	wait_lcd_write();
+	if(lcd_write_region_async(&lcd, 0, row, LCD_WIDTH, rows, pixels, lcd_on_frame_written, NULL) != 0)
+	{
+		/** No dma channel. Fall back to the blocking write. */
+		return lcd_write_region(&lcd, 0, row, LCD_WIDTH, rows, pixels);
+	}
+	/** Other tasks and the usb stack keep running while the dma is pushing the rows. */
+	lcd_write_pending = true;
+	return 0;
+}
+
 static void lcd_task(void* )
 {
 	memset(&lcd, 0, sizeof(lcd_t));
@@ -158,98 +672,587 @@ static void lcd_task(void* )
 	lcd.hooks.enter_critical_section = lcd_enter_critical_section;
 	lcd.hooks.exit_critical_section = lcd_exit_critical_section;
 	lcd.hooks.sleep = lcd_sleep;
+	uint64_t lcd_init_start_us = time_us_64();
 	lcd_init(&lcd);
+	frame_hash_init(&frame_hash);
+	screen_tasks_report_lcd_ready(lcd_init_start_us);
+	/**
+	 * The usb task may already take host writes on its own core. A frame the host writes meanwhile is
+	 * scheduled as usual and drawn after this one.
+	 */
+	if(show_stored_frame() == 0)
+		screen_tasks_report_first_frame();
 
 	bool is_sleeping = false;
 	bool new_frame_during_sleep = false;
+#if CFG_TUD_CDC
+	bool drawing_during_sleep = false;
+#endif
+#if USB_SCREEN_RAW_LUN
+	bool raw_frame_during_sleep = false;
+#endif
 	for(;;)
 	{
-		lcd_command_t command = 0;
-		if(xQueueReceive(lcd_command_queue, &command, portMAX_DELAY) == pdTRUE)
+		uint32_t wait_us = 0;
+		/** Only the latest content is drawn. The redraws asked for meanwhile are folded into it. */
+		uint32_t sources = screen_tasks_poll_frame(&wait_us);
+		if(sources & FRAME_SOURCE_FILE)
+		{
+#if USB_SCREEN_FLASH_DISK
+			select_written_file();
+#endif
+			if(is_sleeping)
+				new_frame_during_sleep = true;
+			else if(show_back_buffer() == 0)
+				screen_tasks_report_first_frame();
+		}
+#if USB_SCREEN_RAW_LUN
+		if(sources & FRAME_SOURCE_RAW)
+		{
+			if(is_sleeping)
+				raw_frame_during_sleep = true;
+			else if(show_raw_frame() == 0)
+				screen_tasks_report_first_frame();
+		}
+#endif
+#if CFG_TUD_CDC
+		if(sources & FRAME_SOURCE_DRAWING)
+		{
+			if(is_sleeping)
+				drawing_during_sleep = true;
+			else
+				show_drawing();
+		}
+#endif
+		if(sources)
+			continue;
+		/** A frame is pending but not due, come back for it */
+		TickType_t timeout = wait_us ? pdMS_TO_TICKS(wait_us / 1000) + 1 : portMAX_DELAY;
+		/** LCD_EVENT_NEW_FRAME is only a wake up, the frame is taken from the scheduler */
+		uint32_t events = screen_tasks_take_lcd_events(LCD_EVENT_NEW_FRAME | LCD_EVENT_SLEEP | LCD_EVENT_NEXT_FILE | LCD_EVENT_SAVE_FRAME |
+			LCD_EVENT_FILE_CHECK | LCD_EVENT_DRAW_COMMANDS | (lcd_write_pending ? LCD_EVENT_WRITE_DONE : 0), timeout);
+		/** The last band is done. Counted now, not when the next frame starts. */
+		if(events & LCD_EVENT_WRITE_DONE)
+			finish_lcd_write();
+		/** Schedules the frame, taken on the next round */
+		if(events & LCD_EVENT_FILE_CHECK)
+			check_file_end();
+#if CFG_TUD_CDC
+		/** Schedules the drawing on a commit */
+		if(events & LCD_EVENT_DRAW_COMMANDS)
+			take_draw_commands();
+#endif
+		if((events & LCD_EVENT_SLEEP) && is_sleeping != sleep_requested)
 		{
-			switch(command)
+			is_sleeping = sleep_requested;
+			if(is_sleeping)
+			{
+				wait_lcd_write();
+				lcd_enter_sleep(&lcd);
+			}
+			else
 			{
-				case LCD_COMMAND_NEW_FRAME:
-					if(is_sleeping)
-					{
-						new_frame_during_sleep = true;
-					}
-					else
-					{
-						if(read_frame_buffer() == 0)
-						{
-							lcd_write_frame(&lcd, frame_buffer);
-						}
-					}
-					break;
-				case LCD_COMMAND_TOGGLE_SLEEP:
-					is_sleeping = !is_sleeping;
-					if(is_sleeping)
-					{
-						lcd_enter_sleep(&lcd);
-					}
-					else
-					{
-						if(new_frame_during_sleep)
-						{
-							new_frame_during_sleep = false;
-							if(read_frame_buffer() == 0)
-							{
-								lcd_write_frame(&lcd, frame_buffer);
-							}
-						}
-						lcd_exit_sleep(&lcd);
-					}
-					break;
+				if(new_frame_during_sleep)
+				{
+					new_frame_during_sleep = false;
+					if(show_back_buffer() == 0)
+						screen_tasks_report_first_frame();
+				}
+#if USB_SCREEN_RAW_LUN
+				if(raw_frame_during_sleep)
+				{
+					raw_frame_during_sleep = false;
+					if(show_raw_frame() == 0)
+						screen_tasks_report_first_frame();
+				}
+#endif
+#if CFG_TUD_CDC
+				if(drawing_during_sleep)
+				{
+					drawing_during_sleep = false;
+					show_drawing();
+				}
+#endif
+				wait_lcd_write();
+				lcd_exit_sleep(&lcd);
 			}
 		}
+#if USB_SCREEN_FLASH_DISK
+		if((events & LCD_EVENT_NEXT_FILE) && !is_sleeping)
+			show_next_file();
+#endif
+		if(events & LCD_EVENT_SAVE_FRAME)
+			save_frame();
 	}
 }
 
-static int read_frame_buffer()
+static bool is_row_changed(const uint8_t* frame, int row)
 {
-	disk_lock(NULL);
-	fat12_file_reader_t reader = {0};
-	/** Only read the first file. */
-	if(fat12_open_next_file(&disk, &reader) != 0)
-		goto error;
-	int sector_size = 0;
-	bool bmp_opened = false;
-	bmp_t bmp = {0};
-	int total_read_size = 0;
-	for(;;)
+	if(!front_buffer_valid)
+		return true;
+	return memcmp(frame + row * LCD_ROW_SIZE, front_buffer + row * LCD_ROW_SIZE, LCD_ROW_SIZE) != 0;
+}
+
+/** Find the bands of rows in the frame that differ from what is on the lcd. */
+static int find_changed_bands(const uint8_t* frame, lcd_band_t* bands)
+{
+	int band_num = 0;
+	int row = 0;
+	while(row < LCD_HEIGHT)
 	{
-		const uint8_t* sector = fat12_read_file_next_sector(&disk, &reader, &sector_size);
-		if(sector == NULL)
-			break;
-		if(!bmp_opened)
+		if(!is_row_changed(frame, row))
 		{
-			if(bmp_open(&bmp, sector, sector_size)!=0)
-				goto error;
-			bmp_opened = true;
+			row++;
+			continue;
 		}
-		int read_size = bmp_read_next(
-			&bmp,
-			sector,
-			sector_size,
-			frame_buffer,
-			sizeof(frame_buffer));
-		if(read_size < 0)
-			goto error;
-		total_read_size += read_size;
-	}
-	/** Only read full frames */
-	if(total_read_size != sizeof(frame_buffer))
-		goto error;
+		int band_end = row + 1;
+		int unchanged_rows = 0;
+		for(int i = band_end; i < LCD_HEIGHT; i++)
+		{
+			if(is_row_changed(frame, i))
+			{
+				band_end = i + 1;
+				unchanged_rows = 0;
+			}
+			else if(++unchanged_rows > FRAME_BAND_MERGE_ROWS)
+			{
+				break;
+			}
+		}
+		bands[band_num].row = row;
+		bands[band_num].rows = band_end - row;
+		band_num++;
+		row = band_end;
+	}
+	return band_num;
+}
+
+/**
+ * Send the bands of the front buffer. This returns once the first band is started, the dma irq starts the rest.
+ * The bands MUST NOT be changed until wait_lcd_write returns.
+ */
+static int write_bands(const lcd_band_t* bands, int band_num)
+{
+	int rc = 0;
+	wait_lcd_write();
+	if(band_num > 0 && lcd_write_bands_async(&lcd, front_buffer, bands, band_num, lcd_on_frame_written, NULL) == 0)
+	{
+		/** Other tasks and the usb stack keep running while the dma is pushing the rows. */
+		lcd_write_pending = true;
+	}
+	else
+	{
+		/** No dma channel. Fall back to the blocking write. */
+		for(int i = 0; i < band_num && rc == 0; i++)
+			rc = lcd_write_region(&lcd, 0, bands[i].row, LCD_WIDTH, bands[i].rows, front_buffer + bands[i].row * LCD_ROW_SIZE);
+	}
+	/** The lcd content is unknown if any band failed. */
+	front_buffer_valid = rc == 0;
+	if(front_buffer_valid)
+	{
+		frame_hash_set_displayed(&frame_hash);
+		xTimerReset(frame_save_timer, 0);
+	}
+	else
+	{
+		frame_hash_invalidate(&frame_hash);
+	}
+	return rc;
+}
+
+/** Call this with the state locked, after the front buffer is replaced. The drawing not shown yet is dropped. */
+static void reset_drawing()
+{
+#if CFG_TUD_CDC
+	canvas_clear_dirty(&canvas);
+	/** The next commands draw on top of the new image */
+	memcpy(drawing_buffer, front_buffer, LCD_FRAME_SIZE);
+#endif
+}
+
+/** The sectors are kept by the snapshot, the file system is not */
+static bool is_file_system_written(const disk_snapshot_t* snapshot)
+{
+	for(uint32_t i = 0; i < snapshot->block_num; i++)
+	{
+		if(fat12_get_block_region(&disk, snapshot->blocks[i]) != FAT12_REGION_DATA)
+			return true;
+	}
+	return false;
+}
+
+/** 
+ * Decode from a snapshot, without holding off the usb writes. The writes meanwhile are shown with the next frame.
+ * Start over if the snapshot is lost or the file system was written.
+ * Hold the writes off if that keeps happening. Call this with the state locked.
+ */
+static int decode_back_buffer()
+{
+	/** The decoder must have seen every write before the snapshot, or an old sector stays decoded. */
+	replay_deferred_writes();
+	for(int i = 0; i < DECODE_OPTIMISTIC_TRIES; i++)
+	{
+		disk_snapshot_begin(&disk, &disk_snapshot);
+		int rc = decoder_finish(&decoder, &disk_snapshot);
+		if(disk_snapshot_end(&disk, &disk_snapshot) && !is_file_system_written(&disk_snapshot))
+			return rc;
+		contention_stats.decode_conflicts++;
+		decoder_set_frame(&decoder, back_buffer);
+	}
+	contention_stats.decode_fallbacks++;
+	disk_rdlock(NULL);
+	int rc = decoder_finish(&decoder, NULL);
 	disk_unlock(NULL);
+	return rc;
+}
+
+/** Call this with the state locked */
+static void reset_write_tracker()
+{
+	disk_rdlock(NULL);
+	fat12_write_tracker_reset(&write_tracker, &disk);
+	disk_unlock(NULL);
+}
+
+/** 
+ * Finish the decode while the last frame is still being sent, then swap the buffers and send the changed bands.
+ * This returns once the first band is started. The decoder fills the new back buffer meanwhile.
+ */
+static int show_back_buffer()
+{
+	static lcd_band_t bands[LCD_HEIGHT];
+	latency_probe_decode_begin(&latency_probe, time_us_32());
+	/** The decoder reads the flash disk through mem. Nothing to do for the RAM disk. */
+	disk_flush(&disk);
+	state_lock();
+	/** Decode what did not make it through the usb write path. e.g. The directory entry came last. */
+	if(decode_back_buffer() != 0)
+	{
+		state_unlock();
+		latency_probe_decode_end(&latency_probe, time_us_32(), false, false);
+		return -1;
+	}
+	/** Hosts often save the same image again. This is cheaper than comparing the rows. */
+	frame_hash_begin(&frame_hash);
+	frame_hash_update(&frame_hash, back_buffer, LCD_FRAME_SIZE);
+	if(frame_hash_end(&frame_hash))
+	{
+		/** The back buffer stays with the decoder, it already holds this frame. */
+		reset_write_tracker();
+		state_unlock();
+		latency_probe_decode_end(&latency_probe, time_us_32(), true, true);
+		DEBUG_PRINTF("Frame unchanged. hits: %lu, misses: %lu\n", frame_hash.stats.hits, frame_hash.stats.misses);
+		return 0;
+	}
+	/** The old front buffer becomes the decoder's target, and the bands are in use until it is sent */
+	uint32_t decoded_us = time_us_32();
+	wait_lcd_write();
+	int band_num = find_changed_bands(back_buffer, bands);
+	uint8_t* buffer = front_buffer;
+	front_buffer = back_buffer;
+	back_buffer = buffer;
+	decoder_set_frame(&decoder, back_buffer);
+	/** The new image replaces the drawing */
+	reset_drawing();
+	/** Only the writes after this count for the next frame. */
+	reset_write_tracker();
+	state_unlock();
+	latency_probe_decode_end(&latency_probe, decoded_us, true, false);
+	latency_probe_lcd_begin(&latency_probe, time_us_32());
+	int rc = write_bands(bands, band_num);
+	/** Done here unless the bands are still in flight */
+	if(rc == 0 && lcd_write_pending)
+		lcd_write_probed = true;
+	else
+		latency_probe_lcd_end(&latency_probe, time_us_32(), rc == 0);
+	return rc;
+}
+
+/** Show the frame saved by save_frame. Only call this in the lcd task. */
+static int show_stored_frame()
+{
+	uint32_t hash = 0;
+	const uint8_t* frame = frame_store_load(&frame_store, &hash);
+	if(!frame)
+		return -1;
+	state_lock();
+	frame_hash_begin(&frame_hash);
+	frame_hash_update(&frame_hash, frame, LCD_FRAME_SIZE);
+	frame_hash_end(&frame_hash);
+	/** e.g. Drawn on but not committed when it was saved */
+	if(frame_hash_get(&frame_hash) != hash)
+	{
+		state_unlock();
+		return -1;
+	}
+	memcpy(front_buffer, frame, LCD_FRAME_SIZE);
+	reset_drawing();
+	state_unlock();
+	static const lcd_band_t band = {
+		.row = 0,
+		.rows = LCD_HEIGHT
+	};
+	return write_bands(&band, 1);
+}
+
+/** Store the frame on the lcd if it is not stored yet. Only call this in the lcd task. */
+static void save_frame()
+{
+	uint32_t hash = 0;
+	state_lock();
+#if CFG_TUD_CDC
+	/** The lcd is about to change. Do not wear the flash for this frame. */
+	bool drawing = canvas_is_dirty(&canvas);
+#else
+	bool drawing = false;
+#endif
+	bool displayed = frame_hash_get_displayed(&frame_hash, &hash);
+	state_unlock();
+	/**
+	 * Not under the state lock, the erase takes long and the usb task would defer every write meanwhile.
+	 * Only this task changes the front buffer.
+	 */
+	if(displayed && !drawing)
+		frame_store_save(&frame_store, front_buffer, hash);
+	DEBUG_PRINTF("Frame saved. saves: %lu, unchanged: %lu, errors: %lu\n",
+		frame_store.stats.saves,
+		frame_store.stats.unchanged,
+		frame_store.stats.errors);
+}
+
+#if USB_SCREEN_FLASH_DISK
+/** Show the file after the shown one, or the first file after the last. Only call this in the lcd task. */
+static int show_next_file()
+{
+	state_lock();
+	decoder_select_file(&decoder, shown_file + 1);
+	state_unlock();
+	if(show_back_buffer() == 0)
+	{
+		shown_file++;
+		return 0;
+	}
+	/** No more files, or not a full frame bmp */
+	state_lock();
+	decoder_select_file(&decoder, 0);
+	state_unlock();
+	if(show_back_buffer() != 0)
+		return -1;
+	shown_file = 0;
 	return 0;
-error:
+}
+
+/** 
+ * Switch to the file the host wrote the most data blocks of since the last time, so a ._ file written after the image does not win.
+ * The shown file stays if no file was written, e.g. only a directory entry changed. Only call this in the lcd task.
+ */
+static void select_written_file()
+{
+	static uint32_t blocks[DECODER_MAX_FILE_BLOCKS];
+	uint32_t written[(FLASH_DISK_BLOCK_NUM + 31) / 32];
+	taskENTER_CRITICAL();
+	memcpy(written, written_blocks, sizeof(written));
+	memset(written_blocks, 0, sizeof(written_blocks));
+	taskEXIT_CRITICAL();
+	/** The file system is read through mem */
+	disk_flush(&disk);
+	disk_rdlock(NULL);
+	fat12_file_reader_t reader = {0};
+	uint32_t file = 0;
+	int most_written = 0;
+	uint32_t selected = shown_file;
+	for(; fat12_open_next_file(&disk, &reader) == 0; file++)
+	{
+		int block_num = fat12_get_file_blocks(&disk, &reader, blocks, DECODER_MAX_FILE_BLOCKS);
+		int written_num = 0;
+		for(int i = 0; i < block_num; i++)
+		{
+			if(blocks[i] < FLASH_DISK_BLOCK_NUM && (written[blocks[i] / 32] & (1u << (blocks[i] % 32))))
+				written_num++;
+		}
+		if(written_num > most_written)
+		{
+			most_written = written_num;
+			selected = file;
+		}
+	}
+	disk_unlock(NULL);
+	if(most_written == 0)
+	{
+		/** e.g. The data was synced before its directory entry. Keep it for when the entry is written. */
+		taskENTER_CRITICAL();
+		for(uint32_t i = 0; i < sizeof(written_blocks) / sizeof(written_blocks[0]); i++)
+			written_blocks[i] |= written[i];
+		taskEXIT_CRITICAL();
+	}
+	shown_file = selected;
+	state_lock();
+	decoder_select_file(&decoder, shown_file);
+	state_unlock();
+}
+#endif
+
+#if USB_SCREEN_RAW_LUN
+/** 
+ * Copy the raw frame to the front buffer and send the changed bands.
+ * The raw disk is free for the next frame once this returns.
+ */
+static int show_raw_frame()
+{
+	static lcd_band_t bands[LCD_HEIGHT];
+	/** The front buffer must not be in flight. */
+	wait_lcd_write();
+	state_lock();
+	/** Short enough to hold the writes off. The usb reads still go. */
+	disk_rdlock(NULL);
+	const uint8_t* frame = raw_slots_begin_read(&raw_slots, NULL);
+	if(!frame)
+	{
+		disk_unlock(NULL);
+		state_unlock();
+		return 0;
+	}
+	frame_hash_begin(&frame_hash);
+	frame_hash_update(&frame_hash, frame, LCD_FRAME_SIZE);
+	if(frame_hash_end(&frame_hash))
+	{
+		raw_slots_end_read(&raw_slots, true);
+		disk_unlock(NULL);
+		state_unlock();
+		DEBUG_PRINTF("Frame unchanged. hits: %lu, misses: %lu\n", frame_hash.stats.hits, frame_hash.stats.misses);
+		return 0;
+	}
+	int band_num = find_changed_bands(frame, bands);
+	memcpy(front_buffer, frame, LCD_FRAME_SIZE);
+	reset_drawing();
+	raw_slots_end_read(&raw_slots, true);
 	disk_unlock(NULL);
-	return -1;
+	state_unlock();
+	return write_bands(bands, band_num);
+}
+#endif
+
+#if CFG_TUD_CDC
+static void on_cdc_available(void* )
+{
+	/** The usb task never waits for the state. The commands wait in the usb stack until the lcd task takes them. */
+	screen_tasks_notify_lcd(LCD_EVENT_DRAW_COMMANDS);
+}
+
+/** Feed what the host sent to the canvas. Only call this in the lcd task. */
+static void take_draw_commands()
+{
+	static uint8_t buffer[CFG_TUD_CDC_RX_BUFSIZE];
+	state_lock();
+	uint32_t size = usb_drive_cdc_read(buffer, sizeof(buffer));
+	if(size > 0)
+		draw_command_feed(&draw_command, buffer, size);
+	state_unlock();
+	/** One buffer a round, so a busy host does not hold off the frames. Come back for the rest. */
+	if(size == sizeof(buffer))
+		screen_tasks_notify_lcd(LCD_EVENT_DRAW_COMMANDS);
 }
 
+static void on_draw_commit(void* )
+{
+	screen_tasks_schedule_frame(FRAME_SOURCE_DRAWING);
+}
+
+/** Send the rows drawn to since the last commit. Only call this in the lcd task. */
+static int show_drawing()
+{
+	int row = 0;
+	int rows = 0;
+	/** The front buffer must not be in flight. */
+	wait_lcd_write();
+	state_lock();
+	bool drawn = canvas_take_dirty_rows(&canvas, &row, &rows);
+	if(drawn)
+		memcpy(front_buffer + row * LCD_ROW_SIZE, drawing_buffer + row * LCD_ROW_SIZE, rows * LCD_ROW_SIZE);
+	state_unlock();
+	if(!drawn)
+		return 0;
+	/** The front buffer no longer matches the hash of the last image. */
+	frame_hash_invalidate(&frame_hash);
+	if(start_write_rows(row, rows, front_buffer + row * LCD_ROW_SIZE) != 0)
+	{
+		front_buffer_valid = false;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/** The spread of the wake latency goes to STATS.TXT next to the stages it is part of */
+static void on_lcd_wake(uint32_t wake_us, void* )
+{
+	latency_probe_add(&latency_probe, LATENCY_STAGE_WAKE, wake_us);
+}
+
+#if USB_SCREEN_STATS_REPORT
+/** In the timer task, with the rest of the stats report */
+static void on_stats_report(void* )
+{
+	const latency_histogram_t* total = &latency_probe.stats.stages[LATENCY_STAGE_TOTAL];
+	printf("Write to lcd: %lu frames, average: %lu us, max: %lu us, dropped: %lu\n",
+		total->count, total->count ? (uint32_t)(total->total_us / total->count) : 0, total->max_us, latency_probe.stats.frames_dropped);
+}
+#endif
+
+#if USB_SCREEN_STATS_FILE
+static bool on_disk_read(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* )
+{
+	return fat12_read_virtual_file(&disk, &stats_file, block, offset, dst, size);
+}
+
+/** On every host read of STATS.TXT, in the usb task */
+static uint32_t on_stats_file_read(char* text, uint32_t size, void* )
+{
+	const frame_scheduler_t* frame_scheduler = screen_tasks_get_frame_scheduler();
+	uint32_t length = latency_probe_format(&latency_probe, text, size);
+	int rc = snprintf(text + length, size - length,
+		"\nfile ends: tracker %lu, sync %lu, timer %lu\n"
+		"suppressed: boot writes %lu, other file writes %lu, redraws %lu\n"
+		"frame requests: %lu, coalesced %lu, delayed %lu\n"
+		"disk lock waits: read %lu, write %lu, total %llu us, max %lu us\n"
+		"state lock: deferred writes %lu, decode conflicts %lu, decode fallbacks %lu\n"
+		"uptime: %llu ms\n",
+		file_end_stats.tracker, file_end_stats.sync, file_end_stats.timer,
+		suppressed_stats.boot_writes, suppressed_stats.other_file_writes, suppressed_stats.redraws,
+		frame_scheduler->stats.requests, frame_scheduler->stats.coalesced, frame_scheduler->stats.delayed,
+		disk_rwlock.stats.read_waits, disk_rwlock.stats.write_waits, disk_rwlock.stats.total_wait_us, disk_rwlock.stats.max_wait_us,
+		contention_stats.deferred_writes, contention_stats.decode_conflicts, contention_stats.decode_fallbacks,
+		time_us_64() / 1000);
+	if(rc > 0)
+		length += (uint32_t)rc < size - length ? (uint32_t)rc : size - length - 1;
+	/** Since the last read. Shows whether the usb stack and the lcd pipeline really got a core each. */
+	const cpu_load_t* load = screen_tasks_update_cpu_load();
+	rc = snprintf(text + length, size - length, "tasks: %s\ncpu load:",
+		screen_tasks_is_pinned() ? "usb on core 0, lcd on core 1" : "usb and lcd on one core");
+	if(rc > 0)
+		length += (uint32_t)rc < size - length ? (uint32_t)rc : size - length - 1;
+	for(uint32_t i = 0; load && i < load->stats.core_num; i++)
+	{
+		rc = snprintf(text + length, size - length, " core %lu %lu%%", i, load->stats.busy_percent[i]);
+		if(rc > 0)
+			length += (uint32_t)rc < size - length ? (uint32_t)rc : size - length - 1;
+	}
+	rc = snprintf(text + length, size - length, load ? "\n" : " no run time stats\n");
+	if(rc > 0)
+		length += (uint32_t)rc < size - length ? (uint32_t)rc : size - length - 1;
+	return length;
+}
+#endif
+
 static void button_on_click(void* )
 {
-	lcd_command_t command = LCD_COMMAND_TOGGLE_SLEEP;
-	xQueueSend(lcd_command_queue, &command, 0);
+	sleep_requested = !sleep_requested;
+	screen_tasks_notify_lcd(LCD_EVENT_SLEEP);
+}
+
+#if USB_SCREEN_FLASH_DISK
+static void button_on_long_press(void* )
+{
+	screen_tasks_notify_lcd(LCD_EVENT_NEXT_FILE);
 }
+#endif
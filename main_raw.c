@@ -5,7 +5,6 @@
 
 /** FreeRTOS */
 #include <FreeRTOS.h>
-#include <queue.h>
 #include <task.h>
 #include <timers.h>
 #include <semphr.h>
@@ -20,56 +19,112 @@
 #include "usb_drive.h"
 #include "lcd.h"
 #include "button.h"
+#include "frame_hash.h"
+#include "rwlock.h"
+#include "screen_tasks.h"
+#include "debug.h"
+#include "raw_slots.h"
+#if CFG_TUD_VENDOR
+#include "vendor_stream.h"
+#endif
 
 /** This is ample time */
 #define FILE_WRITE_FINISH_TIMEOUT_MS (30)
 #define FILE_WRITE_FINISH_TIMEOUT_TICK (pdMS_TO_TICKS(FILE_WRITE_FINISH_TIMEOUT_MS))
+#define FRAME_SOURCE_DISK (1u << 0)
+/** The host writes one while the other is on the lcd */
+#define RAW_SLOT_NUM (2)
+#define RAW_DISK_BLOCK_NUM (RAW_SLOTS_BLOCK_NUM(LCD_FRAME_SIZE, RAW_SLOT_NUM))
+/** A write to the slot on the lcd checks again after this, in case the give is missed */
+#define SLOT_READ_WAIT_TIMEOUT_MS (50)
+#define FRAME_BLOCK_NUM ((LCD_FRAME_SIZE + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE)
+/** Clean rows between two dirty bands are sent anyway if there are no more than this. */
+#define FRAME_BAND_MERGE_ROWS (2)
+
+typedef struct
+{
+	int row;
+	int rows;
+} band_t;
 
 static void disk_lock(void* );
+static void disk_rdlock(void* );
 static void disk_unlock(void* );
 static void on_disk_write(uint32_t block, void* );
+static void on_disk_sync(void* );
+static void wait_slot_read(void* );
 static void usb_device_task(void *param);
 static void lcd_task(void* param);
+static int write_rows(int row, int rows, const uint8_t* pixels);
+static int show_frame();
+#if CFG_TUD_VENDOR
+static void on_vendor_receive(const uint8_t* data, uint32_t size, void* );
+static void on_vendor_region(const vendor_stream_header_t* header, void* );
+#endif
+static void lcd_enter_critical_section(void* );
+static void lcd_exit_critical_section(void* );
 static void button_on_click(void* );
 
 static lcd_t lcd = {0};
 static disk_t disk = {0};
+static uint8_t disk_mem[RAW_DISK_BLOCK_NUM * DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+/** The frames are in slots on the disk, see raw_slots.h. The lcd pushes a slot without the disk lock. */
+static raw_slots_t raw_slots = {0};
 static button_t button = {0};
+static frame_hash_t frame_hash = {0};
+#if CFG_TUD_VENDOR
+/** Raw frames from the vendor bulk interface go to a slot, same as the raw frames through msc. */
+static vendor_stream_t vendor_stream = {0};
+static uint32_t vendor_slot = 0;
+#endif
 
-enum
-{
-	LCD_COMMAND_NEW_FRAME,
-	LCD_COMMAND_TOGGLE_SLEEP
-};
-typedef uint32_t lcd_command_t;
-
-static QueueHandle_t lcd_command_queue = NULL;
-static SemaphoreHandle_t disk_mutex = NULL;
+/** Flipped by the button. The lcd task follows it, two quick clicks are not lost in one event bit. */
+static volatile bool sleep_requested = false;
+static rwlock_t disk_rwlock = {0};
+/** Given when the lcd is done with a slot */
+static SemaphoreHandle_t slot_read_sem = NULL;
+static StaticSemaphore_t slot_read_sem_buffer;
 
 int main()
 {
     stdio_init_all();
 
+	rwlock_init(&disk_rwlock);
+	slot_read_sem = xSemaphoreCreateBinaryStatic(&slot_read_sem_buffer);
 	/** Init disk */
+	disk.mem = disk_mem;
+	disk.block_num = RAW_DISK_BLOCK_NUM;
 	disk.hooks.rwlock_wrlock = disk_lock;
+	disk.hooks.rwlock_rdlock = disk_rdlock;
 	disk.hooks.rwlock_unlock = disk_unlock;
 	disk.callbacks.on_write = on_disk_write;
+	disk.callbacks.on_sync = on_disk_sync;
+	raw_slots.disk = &disk;
+	raw_slots.frame_size = LCD_FRAME_SIZE;
+	raw_slots.slot_num = RAW_SLOT_NUM;
+	raw_slots.hooks.wait_read = wait_slot_read;
+	raw_slots_init(&raw_slots);
 	disk_init(&disk);
     /** wipe disk */
-    memset(disk.mem, 0, sizeof(disk.mem));
+    memset(disk_mem, 0, sizeof(disk_mem));
 
 	/** Static init of the usb drive */
 	char board_id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES*2+1];
 	pico_get_unique_board_id_string(board_id, sizeof(board_id));
 	board_id[sizeof(board_id)-1] = '\0';
 	usb_drive_init_singleton(board_id, &disk);
+#if CFG_TUD_VENDOR
+	vendor_stream.frame = raw_slots_take_slot(&raw_slots, vendor_slot);
+	vendor_stream.width = LCD_WIDTH;
+	vendor_stream.height = LCD_HEIGHT;
+	vendor_stream.pixel_size = LCD_PIXEL_SIZE;
+	vendor_stream.format = LCD_PIXEL_FORMAT;
+	vendor_stream.callbacks.on_region = on_vendor_region;
+	vendor_stream_init(&vendor_stream);
+	usb_drive_set_vendor_callback(on_vendor_receive, NULL);
+#endif
 
-	disk_mutex = xSemaphoreCreateMutex();
-	lcd_command_queue = xQueueCreate(10, sizeof(lcd_command_t));
-	/** Put the usb task to the lowest priority. This task is always busy. */
-    xTaskCreate(usb_device_task, "usbd", 1024, NULL, tskIDLE_PRIORITY + 1, NULL);
-	// The lcd task needs to be at a higher priority.
-	xTaskCreate(lcd_task, "lcd", 1024, NULL, configMAX_PRIORITIES - 1, NULL);
+	screen_tasks_init_singleton(usb_device_task, lcd_task);
 
 	button.pin = 8;
 	button.callback.on_click = button_on_click;
@@ -87,12 +142,17 @@ int main()
 
 static void disk_lock(void* )
 {
-	xSemaphoreTake(disk_mutex, portMAX_DELAY);
+	rwlock_wrlock(&disk_rwlock);
+}
+
+static void disk_rdlock(void* )
+{
+	rwlock_rdlock(&disk_rwlock);
 }
 
 static void disk_unlock(void* )
 {
-	xSemaphoreGive(disk_mutex);
+	rwlock_unlock(&disk_rwlock);
 }
 
 // USB Device Driver task
@@ -112,16 +172,52 @@ static void usb_device_task(void* )
     }
 }
 
+static void wait_slot_read(void* )
+{
+	xSemaphoreTake(slot_read_sem, pdMS_TO_TICKS(SLOT_READ_WAIT_TIMEOUT_MS));
+}
+
 static void on_disk_write(uint32_t block, void* )
 {
-	/** Raw mode, use write to last block as trigger */
-	if(block == LCD_FRAME_SIZE / DISK_BLOCK_SIZE)
+	/** Raw mode, the control block write commits a slot. Or the last block of the frame in the old layout. */
+	if(raw_slots_is_commit(&raw_slots, block))
 	{
-		lcd_command_t command = LCD_COMMAND_NEW_FRAME;
-		xQueueSend(lcd_command_queue, &command, 0);
+		screen_tasks_schedule_frame(FRAME_SOURCE_DISK);
 	}
 }
 
+#if CFG_TUD_VENDOR
+static void on_vendor_receive(const uint8_t* data, uint32_t size, void* )
+{
+	/** The lcd task may be pushing the frame. Wait for it. */
+	disk_lock(NULL);
+	if(vendor_stream_feed(&vendor_stream, data, size) != 0)
+		DEBUG_PRINTF("Vendor stream error. regions: %lu, errors: %lu, resyncs: %lu\n", vendor_stream.stats.regions, vendor_stream.stats.errors, vendor_stream.stats.resyncs);
+	disk_unlock(NULL);
+}
+
+static void on_vendor_region(const vendor_stream_header_t* header, void* )
+{
+	/** The disk is write locked by on_vendor_receive */
+	raw_slots_mark_dirty(&raw_slots, vendor_slot, header->y * LCD_ROW_SIZE, header->h * LCD_ROW_SIZE);
+	if(header->flags & VENDOR_STREAM_FLAG_PRESENT)
+	{
+		/** The next regions go on top of this frame in the other slot */
+		raw_slots_commit(&raw_slots, vendor_slot);
+		uint32_t committed_slot = vendor_slot;
+		vendor_slot = (vendor_slot + 1) % RAW_SLOT_NUM;
+		vendor_stream.frame = raw_slots_copy_slot(&raw_slots, vendor_slot, committed_slot);
+		screen_tasks_schedule_frame(FRAME_SOURCE_DISK);
+	}
+}
+#endif
+
+static void on_disk_sync(void* )
+{
+	/** The host may not write the last block last. The flush says the frame is complete. Repeats are skipped by the sequence and the frame hash. */
+	screen_tasks_schedule_frame(FRAME_SOURCE_DISK);
+}
+
 static void lcd_enter_critical_section(void* )
 {
 	taskENTER_CRITICAL();
@@ -137,6 +233,94 @@ static void lcd_sleep(uint32_t ms, void* )
 	vTaskDelay(pdMS_TO_TICKS(ms));
 }
 
+static void lcd_on_frame_written(void* )
+{
+	/** This is called from the dma irq */
+	screen_tasks_notify_lcd_from_isr(LCD_EVENT_WRITE_DONE);
+}
+
+/** Only call this in the lcd task */
+static int write_rows(int row, int rows, const uint8_t* pixels)
+{
+	/** Drop any stale completion */
+	screen_tasks_take_lcd_events(LCD_EVENT_WRITE_DONE, 0);
+	if(lcd_write_region_async(&lcd, 0, row, LCD_WIDTH, rows, pixels, lcd_on_frame_written, NULL) != 0)
+	{
+		/** No dma channel. Fall back to the blocking write. */
+		return lcd_write_region(&lcd, 0, row, LCD_WIDTH, rows, pixels);
+	}
+	/** Other tasks and the usb stack keep running while the dma is pushing the frame. */
+	screen_tasks_take_lcd_events(LCD_EVENT_WRITE_DONE, portMAX_DELAY);
+	return 0;
+}
+
+/** The rows under the dirty blocks. A block covers a few rows, the rows on its edges are shared with the next. */
+static int find_dirty_bands(uint64_t dirty_blocks, band_t* bands)
+{
+	int band_num = 0;
+	uint32_t block = 0;
+	while(block < FRAME_BLOCK_NUM)
+	{
+		if(!(dirty_blocks & (1ULL << block)))
+		{
+			block++;
+			continue;
+		}
+		uint32_t end_block = block + 1;
+		while(end_block < FRAME_BLOCK_NUM && (dirty_blocks & (1ULL << end_block)))
+			end_block++;
+		uint32_t end = end_block * DISK_BLOCK_SIZE < LCD_FRAME_SIZE ? end_block * DISK_BLOCK_SIZE : LCD_FRAME_SIZE;
+		int row = block * DISK_BLOCK_SIZE / LCD_ROW_SIZE;
+		int row_end = (end + LCD_ROW_SIZE - 1) / LCD_ROW_SIZE;
+		if(band_num > 0 && row <= bands[band_num - 1].row + bands[band_num - 1].rows + FRAME_BAND_MERGE_ROWS)
+		{
+			bands[band_num - 1].rows = row_end - bands[band_num - 1].row;
+		}
+		else
+		{
+			bands[band_num].row = row;
+			bands[band_num].rows = row_end - row;
+			band_num++;
+		}
+		block = end_block;
+	}
+	return band_num;
+}
+
+/** Only call this in the lcd task */
+static int show_frame()
+{
+	static band_t bands[FRAME_BLOCK_NUM];
+	int rc = 0;
+	uint64_t dirty_blocks = 0;
+	/** Raw mode, access the disk directly. Only the writes to this slot wait for the push, the host goes on with the other one. */
+	disk_rdlock(NULL);
+	const uint8_t* frame = raw_slots_begin_read(&raw_slots, &dirty_blocks);
+	disk_unlock(NULL);
+	if(!frame)
+		return 0;
+	/** Hosts often save the same image again. Do not spend the spi bus on it. */
+	frame_hash_begin(&frame_hash);
+	frame_hash_update(&frame_hash, frame, LCD_FRAME_SIZE);
+	if(frame_hash_end(&frame_hash))
+	{
+		DEBUG_PRINTF("Frame unchanged. hits: %lu, misses: %lu\n", frame_hash.stats.hits, frame_hash.stats.misses);
+		goto finish;
+	}
+	/** Only the rows the host wrote since the lcd last matched this frame */
+	int band_num = find_dirty_bands(dirty_blocks, bands);
+	for(int i = 0; i < band_num && rc == 0; i++)
+		rc = write_rows(bands[i].row, bands[i].rows, frame + bands[i].row * LCD_ROW_SIZE);
+	if(rc == 0)
+		frame_hash_set_displayed(&frame_hash);
+	else
+		frame_hash_invalidate(&frame_hash);
+finish:
+	raw_slots_end_read(&raw_slots, rc == 0);
+	xSemaphoreGive(slot_read_sem);
+	return rc;
+}
+
 static void lcd_task(void* )
 {
 	memset(&lcd, 0, sizeof(lcd_t));
@@ -150,49 +334,45 @@ static void lcd_task(void* )
 	lcd.hooks.enter_critical_section = lcd_enter_critical_section;
 	lcd.hooks.exit_critical_section = lcd_exit_critical_section;
 	lcd.hooks.sleep = lcd_sleep;
+	uint64_t lcd_init_start_us = time_us_64();
 	lcd_init(&lcd);
+	frame_hash_init(&frame_hash);
+	screen_tasks_report_lcd_ready(lcd_init_start_us);
 
 	bool is_sleeping = false;
 	bool new_frame_during_sleep = false;
 	for(;;)
 	{
-		lcd_command_t command = 0;
-		if(xQueueReceive(lcd_command_queue, &command, portMAX_DELAY) == pdTRUE)
+		uint32_t wait_us = 0;
+		/** Only the latest content is drawn. The redraws asked for meanwhile are folded into it. */
+		if(screen_tasks_poll_frame(&wait_us))
+		{
+			if(is_sleeping)
+				new_frame_during_sleep = true;
+			else if(show_frame() == 0)
+				screen_tasks_report_first_frame();
+			continue;
+		}
+		/** A frame is pending but not due, come back for it */
+		TickType_t timeout = wait_us ? pdMS_TO_TICKS(wait_us / 1000) + 1 : portMAX_DELAY;
+		/** LCD_EVENT_NEW_FRAME is only a wake up, the frame is taken from the scheduler */
+		uint32_t events = screen_tasks_take_lcd_events(LCD_EVENT_NEW_FRAME | LCD_EVENT_SLEEP, timeout);
+		if((events & LCD_EVENT_SLEEP) && is_sleeping != sleep_requested)
 		{
-			switch(command)
+			is_sleeping = sleep_requested;
+			if(is_sleeping)
+			{
+				lcd_enter_sleep(&lcd);
+			}
+			else
 			{
-				case LCD_COMMAND_NEW_FRAME:
-					if(is_sleeping)
-					{
-						new_frame_during_sleep = true;
-					}
-					else
-					{
-						/** Raw mode, access the disk directly */
-						disk_lock(NULL);
-						lcd_write_frame(&lcd, disk.mem);
-						disk_unlock(NULL);
-					}
-					break;
-				case LCD_COMMAND_TOGGLE_SLEEP:
-					is_sleeping = !is_sleeping;
-					if(is_sleeping)
-					{
-						lcd_enter_sleep(&lcd);
-					}
-					else
-					{
-						if(new_frame_during_sleep)
-						{
-							new_frame_during_sleep = false;
-							/** Raw mode, access the disk directly */
-							disk_lock(NULL);
-							lcd_write_frame(&lcd, disk.mem);
-							disk_unlock(NULL);
-						}
-						lcd_exit_sleep(&lcd);
-					}
-					break;
+				if(new_frame_during_sleep)
+				{
+					new_frame_during_sleep = false;
+					if(show_frame() == 0)
+						screen_tasks_report_first_frame();
+				}
+				lcd_exit_sleep(&lcd);
 			}
 		}
 	}
@@ -200,6 +380,6 @@ static void lcd_task(void* )
 
 static void button_on_click(void* )
 {
-	lcd_command_t command = LCD_COMMAND_TOGGLE_SLEEP;
-	xQueueSend(lcd_command_queue, &command, 0);
+	sleep_requested = !sleep_requested;
+	screen_tasks_notify_lcd(LCD_EVENT_SLEEP);
 }
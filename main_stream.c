@@ -0,0 +1,306 @@
+#include <pico/stdlib.h>
+#include <pico/unique_id.h>
+#include <hardware/gpio.h>
+#include <hardware/spi.h>
+
+/** FreeRTOS */
+#include <FreeRTOS.h>
+#include <task.h>
+#include <timers.h>
+#include <semphr.h>
+
+/** TUSB */
+#include <bsp/board.h>
+#include <tusb.h>
+// This is included in tusb.h. Put here to make intellisense happy
+#include "tusb_config.h"
+
+#include "disk.h"
+#include "fat12.h"
+#include "bmp.h"
+#include "usb_drive.h"
+#include "lcd.h"
+#include "button.h"
+#include "frame_hash.h"
+#include "rwlock.h"
+#include "screen_tasks.h"
+#include "debug.h"
+
+/** 
+ * Streaming mode. There is no frame buffer.
+ * The bmp rows are sent from the disk to the lcd in the file order, the lcd scans bottom -> up.
+ */
+#if LCD_PIXEL_FORMAT != LCD_PIXEL_FORMAT_RGB666
+#error "Streaming mode sends the bmp pixels as they are. Only LCD_PIXEL_FORMAT_RGB666 is supported."
+#endif
+
+/** This is ample time */
+#define FILE_WRITE_FINISH_TIMEOUT_MS (30)
+#define FILE_WRITE_FINISH_TIMEOUT_TICK (pdMS_TO_TICKS(FILE_WRITE_FINISH_TIMEOUT_MS))
+#define FRAME_SOURCE_DISK (1u << 0)
+
+static void disk_lock(void* );
+static void disk_rdlock(void* );
+static void disk_unlock(void* );
+static void on_disk_write(uint32_t , void* );
+static void on_disk_sync(void* );
+static void disk_write_finish_timer_handler(TimerHandle_t timer);
+static void usb_device_task(void *param);
+static void lcd_task(void* param);
+static int stream_frame();
+static void lcd_enter_critical_section(void* );
+static void lcd_exit_critical_section(void* );
+static void button_on_click(void* );
+
+static lcd_t lcd = {0};
+static disk_t disk = {0};
+static uint8_t disk_mem[DISK_BLOCK_NUM * DISK_BLOCK_SIZE] __attribute__((aligned(4)));
+static button_t button = {0};
+static frame_hash_t frame_hash = {0};
+
+static TimerHandle_t disk_write_finish_timer = NULL;
+static StaticTimer_t disk_write_finish_timer_buffer;
+
+
+/** Flipped by the button. The lcd task follows it, two quick clicks are not lost in one event bit. */
+static volatile bool sleep_requested = false;
+static rwlock_t disk_rwlock = {0};
+
+int main()
+{
+    stdio_init_all();
+
+	rwlock_init(&disk_rwlock);
+	/** Init disk */
+	disk.mem = disk_mem;
+	disk.block_num = DISK_BLOCK_NUM;
+	disk.hooks.rwlock_wrlock = disk_lock;
+	disk.hooks.rwlock_rdlock = disk_rdlock;
+	disk.hooks.rwlock_unlock = disk_unlock;
+	disk.callbacks.on_write = on_disk_write;
+	disk.callbacks.on_sync = on_disk_sync;
+	disk_init(&disk);
+	fat12_format(&disk);
+
+	/** Static init of the usb drive */
+	char board_id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES*2+1];
+	pico_get_unique_board_id_string(board_id, sizeof(board_id));
+	board_id[sizeof(board_id)-1] = '\0';
+	usb_drive_init_singleton(board_id, &disk);
+
+	disk_write_finish_timer = xTimerCreateStatic("diskw", FILE_WRITE_FINISH_TIMEOUT_TICK, pdFALSE, NULL, disk_write_finish_timer_handler, &disk_write_finish_timer_buffer);
+	screen_tasks_init_singleton(usb_device_task, lcd_task);
+
+	button.pin = 8;
+	button.callback.on_click = button_on_click;
+	button_init(&button);
+
+    vTaskStartScheduler();
+
+    for (;;)
+	{
+		tight_loop_contents();
+	}
+
+    return 0;
+}
+
+static void disk_lock(void* )
+{
+	rwlock_wrlock(&disk_rwlock);
+}
+
+static void disk_rdlock(void* )
+{
+	rwlock_rdlock(&disk_rwlock);
+}
+
+static void disk_unlock(void* )
+{
+	rwlock_unlock(&disk_rwlock);
+}
+
+// USB Device Driver task
+// This top level thread process all usb events and invoke callbacks
+static void usb_device_task(void* )
+{
+    // init device stack on configured roothub port
+    // This should be called after scheduler/kernel is started.
+    // Otherwise it could cause kernel issue since USB IRQ handler does use RTOS queue API.
+    tud_init(BOARD_TUD_RHPORT);
+
+    // RTOS forever loop
+    for(;;)
+    {
+        // put this thread to waiting state until there is new events
+        tud_task();
+    }
+}
+
+static void on_disk_write(uint32_t , void* )
+{
+	xTimerReset(disk_write_finish_timer, FILE_WRITE_FINISH_TIMEOUT_TICK);
+}
+
+static void on_disk_sync(void* )
+{
+	/** The host flushed. No need to wait for the timer. */
+	xTimerStop(disk_write_finish_timer, 0);
+	screen_tasks_schedule_frame(FRAME_SOURCE_DISK);
+}
+
+static void disk_write_finish_timer_handler(TimerHandle_t )
+{
+	screen_tasks_schedule_frame(FRAME_SOURCE_DISK);
+}
+
+static void lcd_enter_critical_section(void* )
+{
+	taskENTER_CRITICAL();
+}
+
+static void lcd_exit_critical_section(void* )
+{
+	taskEXIT_CRITICAL();
+}
+
+static void lcd_sleep(uint32_t ms, void* )
+{
+	vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+static void lcd_task(void* )
+{
+	memset(&lcd, 0, sizeof(lcd_t));
+	lcd.spi = spi0;
+	lcd.pin_clk = 2;
+	lcd.pin_mosi = 3;
+	lcd.pin_ncs = 7;
+	lcd.pin_dc = 5;
+	lcd.pin_nrst = 6;
+	lcd.options.spi_baudrate = 20 * 1000 * 1000;
+	lcd.hooks.enter_critical_section = lcd_enter_critical_section;
+	lcd.hooks.exit_critical_section = lcd_exit_critical_section;
+	lcd.hooks.sleep = lcd_sleep;
+	uint64_t lcd_init_start_us = time_us_64();
+	lcd_init(&lcd);
+	frame_hash_init(&frame_hash);
+	screen_tasks_report_lcd_ready(lcd_init_start_us);
+
+	bool is_sleeping = false;
+	bool new_frame_during_sleep = false;
+	for(;;)
+	{
+		uint32_t wait_us = 0;
+		/** Only the latest content is drawn. The redraws asked for meanwhile are folded into it. */
+		if(screen_tasks_poll_frame(&wait_us))
+		{
+			if(is_sleeping)
+				new_frame_during_sleep = true;
+			else if(stream_frame() == 0)
+				screen_tasks_report_first_frame();
+			continue;
+		}
+		/** A frame is pending but not due, come back for it */
+		TickType_t timeout = wait_us ? pdMS_TO_TICKS(wait_us / 1000) + 1 : portMAX_DELAY;
+		/** LCD_EVENT_NEW_FRAME is only a wake up, the frame is taken from the scheduler */
+		uint32_t events = screen_tasks_take_lcd_events(LCD_EVENT_NEW_FRAME | LCD_EVENT_SLEEP, timeout);
+		if((events & LCD_EVENT_SLEEP) && is_sleeping != sleep_requested)
+		{
+			is_sleeping = sleep_requested;
+			if(is_sleeping)
+			{
+				lcd_enter_sleep(&lcd);
+			}
+			else
+			{
+				if(new_frame_during_sleep)
+				{
+					new_frame_during_sleep = false;
+					if(stream_frame() == 0)
+						screen_tasks_report_first_frame();
+				}
+				lcd_exit_sleep(&lcd);
+			}
+		}
+	}
+}
+
+/** There is no way back once the stream is started. Check everything that can be checked before that. */
+static int stream_frame()
+{
+	disk_rdlock(NULL);
+	fat12_file_reader_t reader = {0};
+	/** Only read the first file. */
+	if(fat12_open_next_file(&disk, &reader) != 0)
+		goto error;
+	/** There is no copy of what is on the lcd. Hash the whole file instead. */
+	fat12_file_reader_t hash_reader = reader;
+	int sector_size = 0;
+	const uint8_t* sector = fat12_read_file_next_sector(&disk, &reader, &sector_size);
+	if(sector == NULL)
+		goto error;
+	bmp_t bmp = {0};
+	if(bmp_open(&bmp, sector, sector_size, BMP_OUTPUT_BGR888) != 0)
+		goto error;
+	if(bmp.width != LCD_WIDTH || bmp.height != LCD_HEIGHT)
+		goto error;
+	uint32_t total_bytes_in_row = (bmp.width * 3 + 3) & ~3;
+	if(bmp.pixel_array_size < total_bytes_in_row * bmp.height)
+		goto error;
+	if(reader.size < bmp.pixel_array_offset + total_bytes_in_row * bmp.height)
+		goto error;
+	frame_hash_begin(&frame_hash);
+	const uint8_t* hash_sector = NULL;
+	int hash_sector_size = 0;
+	while((hash_sector = fat12_read_file_next_sector(&disk, &hash_reader, &hash_sector_size)) != NULL)
+		frame_hash_update(&frame_hash, hash_sector, hash_sector_size);
+	if(frame_hash_end(&frame_hash))
+	{
+		/** Hosts often save the same image again. Do not spend the spi bus on it. */
+		DEBUG_PRINTF("Frame unchanged. hits: %lu, misses: %lu\n", frame_hash.stats.hits, frame_hash.stats.misses);
+		disk_unlock(NULL);
+		return 0;
+	}
+	if(lcd_stream_begin(&lcd, true) != 0)
+		goto error;
+	int total_write_size = 0;
+	while(sector != NULL)
+	{
+		uint32_t pos = 0;
+		const uint8_t* run = NULL;
+		int run_size = 0;
+		while((run_size = bmp_next_pixel_run(&bmp, sector, sector_size, &pos, &run)) > 0)
+		{
+			/** Zero copy, the disk memory goes to spi directly. */
+			if(lcd_stream_write(&lcd, run, run_size) != 0)
+				goto stream_error;
+			total_write_size += run_size;
+		}
+		if(run_size < 0)
+			goto stream_error;
+		if(total_write_size >= LCD_FRAME_SIZE)
+			break;
+		sector = fat12_read_file_next_sector(&disk, &reader, &sector_size);
+	}
+	lcd_stream_end(&lcd);
+	if(total_write_size != LCD_FRAME_SIZE)
+		goto partial_error;
+	frame_hash_set_displayed(&frame_hash);
+	disk_unlock(NULL);
+	return 0;
+stream_error:
+	lcd_stream_end(&lcd);
+partial_error:
+	/** Part of the lcd may have changed. */
+	frame_hash_invalidate(&frame_hash);
+error:
+	disk_unlock(NULL);
+	return -1;
+}
+
+static void button_on_click(void* )
+{
+	sleep_requested = !sleep_requested;
+	screen_tasks_notify_lcd(LCD_EVENT_SLEEP);
+}
@@ -0,0 +1,81 @@
+# Prints where the SRAM of a firmware goes, from the symbols of the linked elf.
+# Run after the link:
+#   cmake -DNM=<nm> -DELF=<elf> [-DBUDGET=<bytes>] -P ram_budget.cmake
+# BUDGET is the most the static data may take. The build fails past it. 0 or unset for no check.
+
+if(NOT NM OR NOT ELF)
+    message(FATAL_ERROR "ram_budget: NM and ELF are needed")
+endif()
+
+execute_process(
+    COMMAND ${NM} -S --size-sort -t d ${ELF}
+    OUTPUT_VARIABLE symbols
+    RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "ram_budget: ${NM} failed on ${ELF}")
+endif()
+
+# First match wins. Local statics get a .<n> suffix from the compiler.
+set(groups disk frames stacks rtos heap tinyusb)
+set(disk_label "Disk")
+set(disk_regex "disk_mem|disk_snapshot|flash_disk")
+set(frames_label "Frame buffers")
+set(frames_regex "^frame_buffers?$|^drawing_buffer$|^bands(\\.[0-9]+)?$")
+set(stacks_label "Task stacks")
+set(stacks_regex "(_stack|Stack)(\\.[0-9]+)?$")
+set(rtos_label "RTOS objects")
+set(rtos_regex "(_buffer|TCB)(\\.[0-9]+)?$")
+set(heap_label "RTOS heap")
+set(heap_regex "^ucHeap$")
+set(tinyusb_label "TinyUSB buffers")
+set(tinyusb_regex "^_(usbd|mscd|cdcd|vendord|ctrl)|^hw_endpoints$|^_desc_str$")
+set(other_label "Everything else")
+foreach(group ${groups} other)
+    set(${group}_total 0)
+    set(${group}_lines "")
+endforeach()
+set(total 0)
+
+string(REPLACE "\n" ";" symbols "${symbols}")
+foreach(line ${symbols})
+    # Only the data and bss symbols take SRAM
+    if(NOT line MATCHES "^[0-9]+ ([0-9]+) [bBdD] (.+)$")
+        continue()
+    endif()
+    set(name "${CMAKE_MATCH_2}")
+    # nm pads with zeros
+    math(EXPR size "${CMAKE_MATCH_1}")
+    set(found other)
+    foreach(group ${groups})
+        if(name MATCHES "${${group}_regex}")
+            set(found ${group})
+            break()
+        endif()
+    endforeach()
+    math(EXPR ${found}_total "${${found}_total} + ${size}")
+    math(EXPR total "${total} + ${size}")
+    # The small ones only add up
+    if(size GREATER_EQUAL 256)
+        list(APPEND ${found}_lines "      ${size}  ${name}")
+    endif()
+endforeach()
+
+get_filename_component(elf_name ${ELF} NAME)
+message(STATUS "RAM budget of ${elf_name}:")
+foreach(group ${groups} other)
+    message(STATUS "  ${${group}_label}: ${${group}_total}")
+    # nm sorts by size up, the biggest first reads better
+    list(REVERSE ${group}_lines)
+    foreach(line ${${group}_lines})
+        message(STATUS "${line}")
+    endforeach()
+endforeach()
+if(BUDGET)
+    math(EXPR left "${BUDGET} - ${total}")
+    message(STATUS "  Total: ${total} of ${BUDGET}, ${left} left")
+    if(total GREATER BUDGET)
+        message(FATAL_ERROR "${elf_name} takes ${total} bytes of SRAM, over the budget of ${BUDGET}")
+    endif()
+else()
+    message(STATUS "  Total: ${total}")
+endif()
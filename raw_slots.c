@@ -0,0 +1,201 @@
+#include <string.h>
+#include "raw_slots.h"
+
+static bool get_control(const raw_slots_t* raw_slots, raw_slots_control_t* control)
+{
+    memcpy(control, raw_slots->disk->mem + RAW_SLOTS_CONTROL_BLOCK * DISK_BLOCK_SIZE, sizeof(raw_slots_control_t));
+    return control->magic == RAW_SLOTS_MAGIC;
+}
+
+static uint32_t get_slot_block(const raw_slots_t* raw_slots, uint32_t slot)
+{
+    return RAW_SLOTS_CONTROL_BLOCK + 1 + slot * raw_slots->internal.slot_blocks;
+}
+
+static uint64_t get_all_blocks(const raw_slots_t* raw_slots)
+{
+    if(raw_slots->internal.slot_blocks >= 64)
+        return ~0ULL;
+    return (1ULL << raw_slots->internal.slot_blocks) - 1;
+}
+
+/** Every frame that has the block in it may differ from the lcd now. The old layout too. */
+static void mark_written(raw_slots_t* raw_slots, uint32_t block)
+{
+    for(uint32_t i = 0; i < raw_slots->slot_num; i++)
+    {
+        uint32_t slot_block = get_slot_block(raw_slots, i);
+        if(block >= slot_block && block < slot_block + raw_slots->internal.slot_blocks)
+            raw_slots->internal.dirty_blocks[i] |= 1ULL << (block - slot_block);
+    }
+    if(block < raw_slots->internal.slot_blocks)
+        raw_slots->internal.dirty_blocks[raw_slots->slot_num] |= 1ULL << block;
+}
+
+/** Call this with the write lock held. The reader drops the read lock, so only the blocks keep it away. */
+static void wait_read(raw_slots_t* raw_slots, uint32_t block, uint32_t block_num)
+{
+    if(!raw_slots->hooks.wait_read)
+        return;
+    for(;;)
+    {
+        __sync_synchronize();
+        if(!raw_slots->internal.reading)
+            return;
+        uint32_t reading_block = raw_slots->internal.reading_block;
+        if(block + block_num <= reading_block || block >= reading_block + raw_slots->internal.slot_blocks)
+            return;
+        raw_slots->stats.write_waits++;
+        raw_slots->hooks.wait_read(raw_slots->hooks.wait_read_ctx);
+    }
+}
+
+static int backend_write(uint32_t block, uint32_t offset, void const* src, uint32_t size, void* ctx)
+{
+    raw_slots_t* raw_slots = ctx;
+    wait_read(raw_slots, block, 1);
+    memcpy(raw_slots->disk->mem + block * DISK_BLOCK_SIZE + offset, src, size);
+    mark_written(raw_slots, block);
+    return size;
+}
+
+static int backend_read(uint32_t block, uint32_t offset, void* dst, uint32_t size, void* ctx)
+{
+    raw_slots_t* raw_slots = ctx;
+    memcpy(dst, raw_slots->disk->mem + block * DISK_BLOCK_SIZE + offset, size);
+    return size;
+}
+
+int raw_slots_init(raw_slots_t* raw_slots)
+{
+    if(!raw_slots || !raw_slots->disk || raw_slots->frame_size == 0)
+        return -1;
+    if(raw_slots->slot_num < 2 || raw_slots->slot_num > RAW_SLOTS_MAX_NUM)
+        return -1;
+    if(raw_slots->frame_size > RAW_SLOTS_MAX_FRAME_BLOCKS * DISK_BLOCK_SIZE)
+        return -1;
+    if(raw_slots->disk->block_num < RAW_SLOTS_BLOCK_NUM(raw_slots->frame_size, raw_slots->slot_num))
+        return -1;
+    memset(&raw_slots->stats, 0, sizeof(raw_slots->stats));
+    memset(&raw_slots->internal, 0, sizeof(raw_slots->internal));
+    raw_slots->internal.slot_blocks = (raw_slots->frame_size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    raw_slots->internal.invalid = true;
+    raw_slots->disk->backend.write = backend_write;
+    raw_slots->disk->backend.read = backend_read;
+    raw_slots->disk->backend.ctx = raw_slots;
+    return 0;
+}
+
+bool raw_slots_is_commit(const raw_slots_t* raw_slots, uint32_t block)
+{
+    raw_slots_control_t control;
+    if(get_control(raw_slots, &control))
+        return block == RAW_SLOTS_CONTROL_BLOCK;
+    /** The old layout. The host writes the frame in order. */
+    return block == (raw_slots->frame_size - 1) / DISK_BLOCK_SIZE;
+}
+
+const uint8_t* raw_slots_begin_read(raw_slots_t* raw_slots, uint64_t* dirty_blocks)
+{
+    raw_slots_control_t control;
+    uint32_t block = 0;
+    uint32_t index = raw_slots->slot_num;
+    bool is_slot = get_control(raw_slots, &control);
+    if(is_slot)
+    {
+        if(control.slot >= raw_slots->slot_num)
+        {
+            raw_slots->stats.errors++;
+            return NULL;
+        }
+        if(raw_slots->internal.read_valid && control.sequence == raw_slots->internal.read_sequence)
+        {
+            raw_slots->stats.repeats++;
+            return NULL;
+        }
+        block = get_slot_block(raw_slots, control.slot);
+        index = control.slot;
+    }
+    if(raw_slots->internal.invalid)
+    {
+        raw_slots->internal.invalid = false;
+        for(uint32_t i = 0; i <= raw_slots->slot_num; i++)
+            raw_slots->internal.dirty_blocks[i] = get_all_blocks(raw_slots);
+    }
+    /** The lcd becomes this frame. The others differ from it where they differ from the lcd, or where this does. */
+    uint64_t taken = raw_slots->internal.dirty_blocks[index];
+    for(uint32_t i = 0; i <= raw_slots->slot_num; i++)
+        raw_slots->internal.dirty_blocks[i] |= taken;
+    raw_slots->internal.dirty_blocks[index] = 0;
+    if(dirty_blocks)
+        *dirty_blocks = taken;
+    raw_slots->internal.reading_block = block;
+    raw_slots->internal.reading_sequence = control.sequence;
+    raw_slots->internal.reading_slot = is_slot;
+    __sync_synchronize();
+    raw_slots->internal.reading = true;
+    __sync_synchronize();
+    return raw_slots->disk->mem + block * DISK_BLOCK_SIZE;
+}
+
+void raw_slots_end_read(raw_slots_t* raw_slots, bool done)
+{
+    __sync_synchronize();
+    raw_slots->internal.reading = false;
+    __sync_synchronize();
+    if(!done)
+    {
+        raw_slots->internal.invalid = true;
+        return;
+    }
+    raw_slots->internal.read_valid = raw_slots->internal.reading_slot;
+    raw_slots->internal.read_sequence = raw_slots->internal.reading_sequence;
+    if(raw_slots->internal.reading_slot)
+        raw_slots->stats.commits++;
+}
+
+uint8_t* raw_slots_take_slot(raw_slots_t* raw_slots, uint32_t slot)
+{
+    if(slot >= raw_slots->slot_num)
+        return NULL;
+    uint32_t block = get_slot_block(raw_slots, slot);
+    wait_read(raw_slots, block, raw_slots->internal.slot_blocks);
+    return raw_slots->disk->mem + block * DISK_BLOCK_SIZE;
+}
+
+uint8_t* raw_slots_copy_slot(raw_slots_t* raw_slots, uint32_t dst, uint32_t src)
+{
+    if(dst >= raw_slots->slot_num || src >= raw_slots->slot_num)
+        return NULL;
+    uint8_t* frame = raw_slots_take_slot(raw_slots, dst);
+    if(dst == src)
+        return frame;
+    memcpy(frame, raw_slots->disk->mem + get_slot_block(raw_slots, src) * DISK_BLOCK_SIZE, raw_slots->frame_size);
+    for(uint32_t i = 0; i < raw_slots->internal.slot_blocks; i++)
+        mark_written(raw_slots, get_slot_block(raw_slots, dst) + i);
+    /** Same content, same difference from the lcd */
+    raw_slots->internal.dirty_blocks[dst] = raw_slots->internal.dirty_blocks[src];
+    return frame;
+}
+
+void raw_slots_mark_dirty(raw_slots_t* raw_slots, uint32_t slot, uint32_t offset, uint32_t size)
+{
+    if(slot >= raw_slots->slot_num || size == 0 || offset + size > raw_slots->frame_size)
+        return;
+    uint32_t slot_block = get_slot_block(raw_slots, slot);
+    for(uint32_t i = offset / DISK_BLOCK_SIZE; i <= (offset + size - 1) / DISK_BLOCK_SIZE; i++)
+        mark_written(raw_slots, slot_block + i);
+}
+
+int raw_slots_commit(raw_slots_t* raw_slots, uint32_t slot)
+{
+    if(slot >= raw_slots->slot_num)
+        return -1;
+    raw_slots_control_t control;
+    uint32_t sequence = get_control(raw_slots, &control) ? control.sequence + 1 : 1;
+    control.magic = RAW_SLOTS_MAGIC;
+    control.sequence = sequence;
+    control.slot = slot;
+    memcpy(raw_slots->disk->mem + RAW_SLOTS_CONTROL_BLOCK * DISK_BLOCK_SIZE, &control, sizeof(control));
+    return 0;
+}
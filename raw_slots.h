@@ -0,0 +1,161 @@
+#pragma once
+
+/**
+ * Frame slots on a raw disk, so the host can write the next frame while the last one is on the lcd.
+ * Block 0 is the control block. The slots follow it, each one frame in the lcd pixel format, starting on a block.
+ * The host writes a frame to a slot that is not active, then writes the control block with the slot and a new sequence.
+ * Only committed slots are read, a slot being written is never shown.
+ * Without the magic in the control block the disk has the old layout, one frame from the start of the disk.
+ *
+ * A slot keeps what was last written to it. The blocks written since the lcd last matched a slot are tracked,
+ * so a commit only sends the rows under them. For a partial update, write the changed blocks to the active slot
+ * and commit it again with a new sequence. In the old layout, the sync commits the blocks written so far.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "disk.h"
+
+/** "SLOT" */
+#define RAW_SLOTS_MAGIC (0x544F4C53)
+#define RAW_SLOTS_CONTROL_BLOCK (0)
+/** Size of a disk for the slots. Enough for the old layout too. */
+#define RAW_SLOTS_BLOCK_NUM(frame_size, slot_num) (1 + (slot_num) * (((frame_size) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE))
+#define RAW_SLOTS_MAX_NUM (4)
+/** One bit per block of the frame */
+#define RAW_SLOTS_MAX_FRAME_BLOCKS (64)
+
+/** At the start of the control block. Little endian, the rest of the block is ignored. */
+typedef struct
+{
+    uint32_t magic;
+    /** Changed by the host on every commit. The same sequence again is not shown again. */
+    uint32_t sequence;
+    /** 0 for the slot from block 1 */
+    uint32_t slot;
+} raw_slots_control_t;
+
+typedef struct
+{
+    /** At least RAW_SLOTS_BLOCK_NUM blocks */
+    disk_t* disk;
+    uint32_t frame_size;
+    /** At least 2, at most RAW_SLOTS_MAX_NUM */
+    uint32_t slot_num;
+    struct
+    {
+        /**
+         * Optional. Called with the write lock held when a write goes to the slot being read.
+         * Return after raw_slots_end_read, or a while. The slot is checked again.
+         * Set this to read the slots without the lock.
+         */
+        void (*wait_read)(void* ctx);
+        void* wait_read_ctx;
+    } hooks;
+    struct
+    {
+        uint32_t commits;
+        /** The sequence was already read */
+        uint32_t repeats;
+        /** The control block points to no slot */
+        uint32_t errors;
+        /** Writes held off by a slot being read */
+        uint32_t write_waits;
+    } stats;
+    struct
+    {
+        uint32_t slot_blocks;
+        /** 
+         * Blocks of the frame where each slot may differ from the lcd, the old layout last. Bit 0 for the first block.
+         * Changed with one of the disk locks held.
+         */
+        uint64_t dirty_blocks[RAW_SLOTS_MAX_NUM + 1];
+        /** The lcd content is unknown, all the blocks are dirty */
+        volatile bool invalid;
+        /** The last commit read. Not valid in the old layout. */
+        uint32_t read_sequence;
+        bool read_valid;
+        /** The frame being read, between raw_slots_begin_read and raw_slots_end_read */
+        volatile bool reading;
+        uint32_t reading_block;
+        uint32_t reading_sequence;
+        bool reading_slot;
+    } internal;
+} raw_slots_t;
+
+/**
+ * @brief Check the sizes and set the disk backend, which tracks the written blocks. Call it before disk_init.
+ * The content of the disk is kept. What is on the lcd is taken as unknown.
+ *
+ * @param raw_slots
+ * @return int
+ */
+int raw_slots_init(raw_slots_t* raw_slots);
+
+/**
+ * @brief Tell if a write to the block makes a new frame.
+ * It is the control block, or the last block of the frame in the old layout. Call it from on_write.
+ *
+ * @param raw_slots
+ * @param block
+ * @return true
+ */
+bool raw_slots_is_commit(const raw_slots_t* raw_slots, uint32_t block);
+
+/**
+ * @brief Get the frame of the last commit. Call this with the read lock held.
+ * With hooks.wait_read the lock can be dropped until raw_slots_end_read, the writes to the frame wait for it.
+ *
+ * @param raw_slots
+ * @param dirty_blocks Can be NULL. The blocks of the frame that may differ from the lcd. Bit 0 for the first block.
+ * The lcd is taken to match the frame after raw_slots_end_read, so send at least these.
+ * @return const uint8_t* frame_size bytes. NULL if there is nothing new, raw_slots_end_read is not needed then.
+ */
+const uint8_t* raw_slots_begin_read(raw_slots_t* raw_slots, uint64_t* dirty_blocks);
+
+/**
+ * @brief The frame is no longer used.
+ *
+ * @param raw_slots
+ * @param done false to read the same commit again next time, e.g. the lcd write failed. All the blocks are dirty then.
+ */
+void raw_slots_end_read(raw_slots_t* raw_slots, bool done);
+
+/**
+ * @brief Get a slot to write from the device, e.g. from another interface. Call this with the write lock held.
+ * Waits while the slot is being read. Tell what is written with raw_slots_mark_dirty.
+ *
+ * @param raw_slots
+ * @param slot
+ * @return uint8_t* frame_size bytes. NULL if there is no such slot.
+ */
+uint8_t* raw_slots_take_slot(raw_slots_t* raw_slots, uint32_t slot);
+
+/**
+ * @brief Copy a slot to another from the device. Call this with the write lock held. Waits while dst is being read.
+ *
+ * @param raw_slots
+ * @param dst
+ * @param src
+ * @return uint8_t* The dst slot, frame_size bytes. NULL if there is no such slot.
+ */
+uint8_t* raw_slots_copy_slot(raw_slots_t* raw_slots, uint32_t dst, uint32_t src);
+
+/**
+ * @brief A part of the slot was written from the device. Call this with the write lock held.
+ *
+ * @param raw_slots
+ * @param slot
+ * @param offset From the start of the frame
+ * @param size
+ */
+void raw_slots_mark_dirty(raw_slots_t* raw_slots, uint32_t slot, uint32_t offset, uint32_t size);
+
+/**
+ * @brief Write the control block from the device. Call this with the write lock held. on_write is not called.
+ *
+ * @param raw_slots
+ * @param slot
+ * @return int
+ */
+int raw_slots_commit(raw_slots_t* raw_slots, uint32_t slot);
@@ -0,0 +1,85 @@
+#include <string.h>
+#include <pico/stdlib.h>
+#include "rwlock.h"
+
+int rwlock_init(rwlock_t* rwlock)
+{
+    if(!rwlock)
+        return -1;
+    memset(rwlock, 0, sizeof(rwlock_t));
+    /** A mutex, so the writer inherits the priority of whoever waits for it */
+    rwlock->internal.write_mutex = xSemaphoreCreateMutexStatic(&rwlock->internal.write_mutex_buffer);
+    rwlock->internal.readers_done = xSemaphoreCreateBinaryStatic(&rwlock->internal.readers_done_buffer);
+    if(!rwlock->internal.write_mutex || !rwlock->internal.readers_done)
+        return -1;
+    return 0;
+}
+
+static void count_wait(rwlock_t* rwlock, uint32_t* waits, uint64_t start_us)
+{
+    uint32_t wait_us = time_us_64() - start_us;
+    (*waits)++;
+    rwlock->stats.total_wait_us += wait_us;
+    if(wait_us > rwlock->stats.max_wait_us)
+        rwlock->stats.max_wait_us = wait_us;
+}
+
+/** @return true if it had to wait */
+static bool take_write_mutex(rwlock_t* rwlock)
+{
+    if(xSemaphoreTake(rwlock->internal.write_mutex, 0) == pdTRUE)
+        return false;
+    xSemaphoreTake(rwlock->internal.write_mutex, portMAX_DELAY);
+    return true;
+}
+
+void rwlock_rdlock(rwlock_t* rwlock)
+{
+    uint64_t start_us = time_us_64();
+    bool waited = take_write_mutex(rwlock);
+    taskENTER_CRITICAL();
+    rwlock->internal.readers++;
+    taskEXIT_CRITICAL();
+    xSemaphoreGive(rwlock->internal.write_mutex);
+    if(waited)
+        count_wait(rwlock, &rwlock->stats.read_waits, start_us);
+}
+
+void rwlock_wrlock(rwlock_t* rwlock)
+{
+    uint64_t start_us = time_us_64();
+    bool waited = take_write_mutex(rwlock);
+    /** No reader gets in from here, wait for the ones already in */
+    taskENTER_CRITICAL();
+    while(rwlock->internal.readers > 0)
+    {
+        rwlock->internal.writer_waiting = true;
+        taskEXIT_CRITICAL();
+        xSemaphoreTake(rwlock->internal.readers_done, portMAX_DELAY);
+        waited = true;
+        taskENTER_CRITICAL();
+    }
+    rwlock->internal.writer_waiting = false;
+    taskEXIT_CRITICAL();
+    rwlock->internal.writer = xTaskGetCurrentTaskHandle();
+    if(waited)
+        count_wait(rwlock, &rwlock->stats.write_waits, start_us);
+}
+
+void rwlock_unlock(rwlock_t* rwlock)
+{
+    /** No reader can be in while the writer is */
+    if(rwlock->internal.writer == xTaskGetCurrentTaskHandle())
+    {
+        rwlock->internal.writer = NULL;
+        xSemaphoreGive(rwlock->internal.write_mutex);
+        return;
+    }
+    taskENTER_CRITICAL();
+    bool last = --rwlock->internal.readers == 0 && rwlock->internal.writer_waiting;
+    if(last)
+        rwlock->internal.writer_waiting = false;
+    taskEXIT_CRITICAL();
+    if(last)
+        xSemaphoreGive(rwlock->internal.readers_done);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+/**
+ * A readers-writer lock on FreeRTOS, for the disk hooks. Many readers or one writer.
+ * The writer holds a mutex, which the readers also take for a moment to get in.
+ * So a reader waiting for a writer lends it its priority, e.g. the lcd task to the usb task.
+ * A waiting writer keeps new readers out. A read lock can not be taken again by its holder.
+ * The time spent waiting is counted, to see who holds up who.
+ */
+
+#include <stdint.h>
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+
+typedef struct
+{
+    struct
+    {
+        /** Times a reader had to wait for a writer */
+        uint32_t read_waits;
+        /** Times a writer had to wait for the readers or another writer */
+        uint32_t write_waits;
+        uint64_t total_wait_us;
+        uint32_t max_wait_us;
+    } stats;
+    struct
+    {
+        /** Held by the writer. Readers only hold it to get in. */
+        SemaphoreHandle_t write_mutex;
+        /** Given by the last reader out to a writer waiting for it */
+        SemaphoreHandle_t readers_done;
+        StaticSemaphore_t write_mutex_buffer;
+        StaticSemaphore_t readers_done_buffer;
+        /** Changed in a critical section, the readers leave without the mutex */
+        volatile uint32_t readers;
+        volatile bool writer_waiting;
+        TaskHandle_t writer;
+    } internal;
+} rwlock_t;
+
+int rwlock_init(rwlock_t* rwlock);
+
+void rwlock_rdlock(rwlock_t* rwlock);
+
+void rwlock_wrlock(rwlock_t* rwlock);
+
+/** Either a read or a write lock held by this task */
+void rwlock_unlock(rwlock_t* rwlock);
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include <timers.h>
+#include "screen_tasks.h"
+#include "cpu_load.h"
+#include "debug.h"
+
+/**
+ * With SMP FreeRTOS the usb stack keeps core 0 to itself. A long decode or spi burst on core 1 does not hold it off.
+ * Without it both tasks share the core, the lcd task at a higher priority.
+ * FreeRTOSConfig.h is outside of this tree, so say so at build time when the tasks are not pinned.
+ */
+#define USB_CORE (0)
+#define LCD_CORE (1)
+#if configNUMBER_OF_CORES > 1 && configUSE_CORE_AFFINITY
+#define TASKS_PINNED (1)
+#else
+#define TASKS_PINNED (0)
+#warning "The usb and the lcd task share one core. Set configNUMBER_OF_CORES 2 and configUSE_CORE_AFFINITY 1 in FreeRTOSConfig.h to pin them."
+#endif
+/** In words. The free part is in the stats report, the whole of them in the ram budget of the build. */
+#define USB_TASK_STACK_SIZE (1024)
+#define LCD_TASK_STACK_SIZE (1024)
+/** The frames the lcd can show are not worth pushing faster than this. 0 for no limit. */
+#ifndef USB_SCREEN_MAX_FPS
+#define USB_SCREEN_MAX_FPS (60)
+#endif
+
+static void enter_critical_section(void* );
+static void exit_critical_section(void* );
+#if USB_SCREEN_STATS_REPORT
+#define STATS_REPORT_MS (10000)
+static void stats_timer_handler(TimerHandle_t timer);
+#endif
+
+static frame_scheduler_t frame_scheduler = {0};
+static TaskHandle_t usb_task_handle = NULL;
+static TaskHandle_t lcd_task_handle = NULL;
+/** No RTOS object comes from the heap */
+static StackType_t usb_task_stack[USB_TASK_STACK_SIZE];
+static StaticTask_t usb_task_buffer;
+static StackType_t lcd_task_stack[LCD_TASK_STACK_SIZE];
+static StaticTask_t lcd_task_buffer;
+/** Taken from the notification while waiting for other events. Only used by the lcd task. */
+static uint32_t lcd_events = 0;
+static screen_tasks_wake_stats_t wake_stats = {0};
+static volatile uint32_t signal_us = 0;
+static volatile bool signaled = false;
+static void (*report_callback)(void* ctx) = NULL;
+static void* report_ctx = NULL;
+static void (*wake_callback)(uint32_t wake_us, void* ctx) = NULL;
+static void* wake_ctx = NULL;
+static cpu_load_t cpu_load = {0};
+static bool cpu_load_enabled = false;
+#if USB_SCREEN_STATS_REPORT
+static StaticTimer_t stats_timer_buffer;
+#endif
+
+int screen_tasks_init_singleton(TaskFunction_t usb_task, TaskFunction_t lcd_task)
+{
+    if(!usb_task || !lcd_task)
+        return -1;
+    frame_scheduler.min_interval_us = USB_SCREEN_MAX_FPS > 0 ? 1000000 / USB_SCREEN_MAX_FPS : 0;
+    frame_scheduler.hooks.enter_critical_section = enter_critical_section;
+    frame_scheduler.hooks.exit_critical_section = exit_critical_section;
+    frame_scheduler_init(&frame_scheduler);
+    /** Put the usb task to the lowest priority. This task is always busy. */
+    // The lcd task needs to be at a higher priority.
+#if TASKS_PINNED
+    usb_task_handle = xTaskCreateStaticAffinitySet(usb_task, "usbd", USB_TASK_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1, usb_task_stack, &usb_task_buffer, 1 << USB_CORE);
+    lcd_task_handle = xTaskCreateStaticAffinitySet(lcd_task, "lcd", LCD_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES - 1, lcd_task_stack, &lcd_task_buffer, 1 << LCD_CORE);
+#else
+    usb_task_handle = xTaskCreateStatic(usb_task, "usbd", USB_TASK_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1, usb_task_stack, &usb_task_buffer);
+    lcd_task_handle = xTaskCreateStatic(lcd_task, "lcd", LCD_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES - 1, lcd_task_stack, &lcd_task_buffer);
+#endif
+    if(!usb_task_handle || !lcd_task_handle)
+        return -1;
+    cpu_load_enabled = cpu_load_init(&cpu_load) == 0;
+#if USB_SCREEN_STATS_REPORT
+    xTimerStart(xTimerCreateStatic("stats", pdMS_TO_TICKS(STATS_REPORT_MS), pdTRUE, NULL, stats_timer_handler, &stats_timer_buffer), 0);
+#endif
+    return 0;
+}
+
+int screen_tasks_set_report_callback(void (*on_report)(void* ctx), void* ctx)
+{
+    report_callback = on_report;
+    report_ctx = ctx;
+    return 0;
+}
+
+int screen_tasks_set_wake_callback(void (*on_wake)(uint32_t wake_us, void* ctx), void* ctx)
+{
+    wake_callback = on_wake;
+    wake_ctx = ctx;
+    return 0;
+}
+
+void screen_tasks_schedule_frame(uint32_t sources)
+{
+    if(frame_scheduler_request(&frame_scheduler, sources))
+        screen_tasks_notify_lcd(LCD_EVENT_NEW_FRAME);
+}
+
+uint32_t screen_tasks_poll_frame(uint32_t* wait_us)
+{
+    return frame_scheduler_poll(&frame_scheduler, time_us_64(), wait_us);
+}
+
+void screen_tasks_notify_lcd(uint32_t events)
+{
+    /** The first event since the lcd task last woke starts the clock */
+    if(!signaled)
+    {
+        signal_us = time_us_32();
+        signaled = true;
+    }
+    xTaskNotify(lcd_task_handle, events, eSetBits);
+}
+
+void screen_tasks_notify_lcd_from_isr(uint32_t events)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    xTaskNotifyFromISR(lcd_task_handle, events, eSetBits, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+uint32_t screen_tasks_take_lcd_events(uint32_t events, TickType_t timeout)
+{
+    while(!(lcd_events & events))
+    {
+        uint32_t value = 0;
+        if(xTaskNotifyWait(0, UINT32_MAX, &value, timeout) != pdTRUE)
+            break;
+        if(signaled && (value & ~LCD_EVENT_WRITE_DONE))
+        {
+            uint32_t wake_us = time_us_32() - signal_us;
+            signaled = false;
+            wake_stats.wakes++;
+            wake_stats.total_us += wake_us;
+            if(wake_us > wake_stats.max_us)
+                wake_stats.max_us = wake_us;
+            if(wake_callback)
+                wake_callback(wake_us, wake_ctx);
+        }
+        lcd_events |= value;
+    }
+    uint32_t taken = lcd_events & events;
+    lcd_events &= ~taken;
+    return taken;
+}
+
+void screen_tasks_report_lcd_ready(uint64_t init_start_us)
+{
+    uint64_t now_us = time_us_64();
+    DEBUG_PRINTF("LCD ready: %llu us after boot, init took %llu us\n", now_us, now_us - init_start_us);
+}
+
+void screen_tasks_report_first_frame()
+{
+    static bool reported = false;
+    if(reported)
+        return;
+    reported = true;
+    DEBUG_PRINTF("First frame: %llu us after boot\n", time_us_64());
+}
+
+const frame_scheduler_t* screen_tasks_get_frame_scheduler()
+{
+    return &frame_scheduler;
+}
+
+const screen_tasks_wake_stats_t* screen_tasks_get_wake_stats()
+{
+    return &wake_stats;
+}
+
+bool screen_tasks_is_pinned()
+{
+    return TASKS_PINNED;
+}
+
+const cpu_load_t* screen_tasks_update_cpu_load()
+{
+    if(!cpu_load_enabled)
+        return NULL;
+    cpu_load_update(&cpu_load);
+    return &cpu_load;
+}
+
+static void enter_critical_section(void* )
+{
+    taskENTER_CRITICAL();
+}
+
+static void exit_critical_section(void* )
+{
+    taskEXIT_CRITICAL();
+}
+
+#if USB_SCREEN_STATS_REPORT
+static void stats_timer_handler(TimerHandle_t )
+{
+    printf("Frames: %lu, coalesced: %lu, delayed: %lu\n",
+        frame_scheduler.stats.frames, frame_scheduler.stats.coalesced, frame_scheduler.stats.delayed);
+    printf("LCD wakes: %lu, average: %lu us, max: %lu us\n",
+        wake_stats.wakes, wake_stats.wakes ? (uint32_t)(wake_stats.total_us / wake_stats.wakes) : 0, wake_stats.max_us);
+    if(report_callback)
+        report_callback(report_ctx);
+#if INCLUDE_uxTaskGetStackHighWaterMark
+    /** The least stack left so far, in words. What is never near 0 can be given to the disk. */
+    printf("Stack free: usbd %lu, lcd %lu\n",
+        (uint32_t)uxTaskGetStackHighWaterMark(usb_task_handle), (uint32_t)uxTaskGetStackHighWaterMark(lcd_task_handle));
+#endif
+    const cpu_load_t* load = screen_tasks_update_cpu_load();
+    if(!load)
+        return;
+    if(load->stats.core_num > 1)
+        printf("CPU load: core 0 %lu%%, core 1 %lu%%\n", load->stats.busy_percent[0], load->stats.busy_percent[1]);
+    else
+        printf("CPU load: %lu%%\n", load->stats.busy_percent[0]);
+}
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+/**
+ * Singleton library.
+ * The two tasks of every firmware and what goes between them. The usb task takes the host writes, the lcd task draws.
+ * The lcd task is woken with the bits of its notification value. The frames are paced by a frame_scheduler.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include "frame_scheduler.h"
+#include "cpu_load.h"
+
+/** Bits of the lcd task notification value. Set straight from where they happen, without a queue copy. */
+#define LCD_EVENT_NEW_FRAME (1u << 0)
+#define LCD_EVENT_SLEEP (1u << 1)
+#define LCD_EVENT_WRITE_DONE (1u << 2)
+/** The firmware's own events start here */
+#define LCD_EVENT_USER (1u << 3)
+
+/** From the first event set to the lcd task taking it. LCD_EVENT_WRITE_DONE alone is not counted. */
+typedef struct
+{
+    uint32_t wakes;
+    uint64_t total_us;
+    uint32_t max_us;
+} screen_tasks_wake_stats_t;
+
+/**
+ * @brief Create the tasks and the frame scheduler. They start with the scheduler.
+ *
+ * @param usb_task Runs the usb stack at idle + 1
+ * @param lcd_task Runs at the highest priority
+ * @return int
+ */
+int screen_tasks_init_singleton(TaskFunction_t usb_task, TaskFunction_t lcd_task);
+
+/**
+ * @brief The firmware's own lines of the stats report go to this. Called in the timer task.
+ * There is no report unless the build sets USB_SCREEN_STATS_REPORT.
+ *
+ * @param on_report
+ * @param ctx
+ * @return int
+ */
+int screen_tasks_set_report_callback(void (*on_report)(void* ctx), void* ctx);
+
+/**
+ * @brief on_wake gets each wake of the lcd task counted in the wake stats. Called in the lcd task.
+ *
+ * @param on_wake
+ * @param ctx
+ * @return int
+ */
+int screen_tasks_set_wake_callback(void (*on_wake)(uint32_t wake_us, void* ctx), void* ctx);
+
+/** Ask for a frame. Wakes the lcd task only if no frame is pending, otherwise this is drawn with the pending one. */
+void screen_tasks_schedule_frame(uint32_t sources);
+
+/**
+ * @brief Take the sources to draw if a frame is due. Only call this in the lcd task.
+ *
+ * @param wait_us Set if a frame is pending but not due. Poll again after this. 0 if there is nothing to wait for.
+ * @return uint32_t The sources to draw. 0 for none.
+ */
+uint32_t screen_tasks_poll_frame(uint32_t* wait_us);
+
+/** Set lcd events from a task, not from an isr */
+void screen_tasks_notify_lcd(uint32_t events);
+
+void screen_tasks_notify_lcd_from_isr(uint32_t events);
+
+/**
+ * Wait for any of the events. The other events taken meanwhile are kept for later.
+ * Only call this in the lcd task.
+ */
+uint32_t screen_tasks_take_lcd_events(uint32_t events, TickType_t timeout);
+
+/** Time to first pixel, as we power cycle often. Printed in debug builds. Call this once the lcd is initialized. */
+void screen_tasks_report_lcd_ready(uint64_t init_start_us);
+
+/** Call this on every frame shown. Only the first one is reported. */
+void screen_tasks_report_first_frame();
+
+const frame_scheduler_t* screen_tasks_get_frame_scheduler();
+
+const screen_tasks_wake_stats_t* screen_tasks_get_wake_stats();
+
+/** The usb task and the lcd task have a core each. Needs configNUMBER_OF_CORES 2 and configUSE_CORE_AFFINITY 1. */
+bool screen_tasks_is_pinned();
+
+/**
+ * @brief Take the busy time of each core since the last call, from wherever it was made. Not in an isr.
+ *
+ * @return const cpu_load_t* NULL without configGENERATE_RUN_TIME_STATS
+ */
+const cpu_load_t* screen_tasks_update_cpu_load();
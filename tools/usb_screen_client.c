@@ -0,0 +1,260 @@
+/**
+ * Linux host client for the vendor bulk interface of usb_screen_raw (built with -DUSB_SCREEN_VENDOR=ON).
+ * Sends raw frames in the lcd pixel format and reports the throughput.
+ * The lcd takes blue first, as the bmp decoder writes it: B, G, R bytes or a 565 word with blue in the high bits.
+ *
+ * Build:
+ *   gcc -O2 -I.. usb_screen_client.c ../vendor_stream.c -lusb-1.0 -o usb_screen_client
+ * Build without libusb, loopback only:
+ *   gcc -O2 -I.. -DUSB_SCREEN_CLIENT_LOOPBACK_ONLY usb_screen_client.c ../vendor_stream.c -o usb_screen_client
+ *
+ * Usage:
+ *   usb_screen_client [-l] [-p rgb666|rgb565] [-n frames] [raw_frame_file]
+ *   -l  Loopback. Feed the device side parser in this process instead of the usb device,
+ *       in max packet size pieces, and check every frame it puts together.
+ * Without a file, a moving test pattern is sent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef USB_SCREEN_CLIENT_LOOPBACK_ONLY
+#include <libusb-1.0/libusb.h>
+#endif
+#include "vendor_stream.h"
+
+#define LCD_WIDTH (50)
+#define LCD_HEIGHT (160)
+/** Same as LCD_PIXEL_FORMAT_xxx in lcd.h */
+#define PIXEL_FORMAT_RGB666 (0)
+#define PIXEL_FORMAT_RGB565 (1)
+
+/** Same as usb_drive.c */
+#define USB_VID (0xCafe)
+#define USB_PID (0x4000 | (1 << 1) | (1 << 4))
+#define VENDOR_INTERFACE (1)
+#define VENDOR_EP_OUT (0x02)
+#define USB_PACKET_SIZE (64)
+#define USB_TIMEOUT_MS (1000)
+
+typedef struct
+{
+    bool loopback;
+    uint8_t format;
+    int pixel_size;
+#ifndef USB_SCREEN_CLIENT_LOOPBACK_ONLY
+    libusb_context* usb;
+    libusb_device_handle* device;
+#endif
+    vendor_stream_t stream;
+    uint8_t* loopback_frame;
+    int presented;
+} client_t;
+
+static void on_loopback_region(const vendor_stream_header_t* header, void* ctx)
+{
+    client_t* client = ctx;
+    if(header->flags & VENDOR_STREAM_FLAG_PRESENT)
+        client->presented++;
+}
+
+static int open_client(client_t* client)
+{
+    if(client->loopback)
+    {
+        client->loopback_frame = calloc(1, LCD_WIDTH * LCD_HEIGHT * client->pixel_size);
+        if(!client->loopback_frame)
+            return -1;
+        client->stream.frame = client->loopback_frame;
+        client->stream.width = LCD_WIDTH;
+        client->stream.height = LCD_HEIGHT;
+        client->stream.pixel_size = client->pixel_size;
+        client->stream.format = client->format;
+        client->stream.callbacks.on_region = on_loopback_region;
+        client->stream.callbacks.on_region_ctx = client;
+        return vendor_stream_init(&client->stream);
+    }
+#ifndef USB_SCREEN_CLIENT_LOOPBACK_ONLY
+    if(libusb_init(&client->usb) != 0)
+        return -1;
+    client->device = libusb_open_device_with_vid_pid(client->usb, USB_VID, USB_PID);
+    if(!client->device)
+    {
+        fprintf(stderr, "Device %04x:%04x not found\n", USB_VID, USB_PID);
+        return -1;
+    }
+    if(libusb_claim_interface(client->device, VENDOR_INTERFACE) != 0)
+    {
+        fprintf(stderr, "Cannot claim interface %d\n", VENDOR_INTERFACE);
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "Built without libusb. Only the loopback is available.\n");
+    return -1;
+#endif
+}
+
+static void close_client(client_t* client)
+{
+    free(client->loopback_frame);
+#ifndef USB_SCREEN_CLIENT_LOOPBACK_ONLY
+    if(client->device)
+    {
+        libusb_release_interface(client->device, VENDOR_INTERFACE);
+        libusb_close(client->device);
+    }
+    if(client->usb)
+        libusb_exit(client->usb);
+#endif
+}
+
+static int send_data(client_t* client, uint8_t* data, int size)
+{
+    if(client->loopback)
+    {
+        /** The device gets the data in packets. Split the same way to cover the packet borders. */
+        for(int i = 0; i < size; i += USB_PACKET_SIZE)
+        {
+            int packet_size = size - i < USB_PACKET_SIZE ? size - i : USB_PACKET_SIZE;
+            if(vendor_stream_feed(&client->stream, data + i, packet_size) != 0)
+                return -1;
+        }
+        return 0;
+    }
+#ifndef USB_SCREEN_CLIENT_LOOPBACK_ONLY
+    int transferred = 0;
+    if(libusb_bulk_transfer(client->device, VENDOR_EP_OUT, data, size, &transferred, USB_TIMEOUT_MS) != 0 ||
+        transferred != size)
+        return -1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void draw_test_pattern(uint8_t* frame, int pixel_size, int frame_index)
+{
+    for(int y = 0; y < LCD_HEIGHT; y++)
+    {
+        for(int x = 0; x < LCD_WIDTH; x++)
+        {
+            uint8_t* pixel = frame + (y * LCD_WIDTH + x) * pixel_size;
+            uint8_t r = (uint8_t)((x * 5 + frame_index * 3) & 0xFF);
+            uint8_t g = (uint8_t)((y + frame_index * 2) & 0xFF);
+            uint8_t b = (uint8_t)((x + y + frame_index) & 0xFF);
+            if(pixel_size == 2)
+            {
+                uint16_t color = ((b & 0xF8) << 8) | ((g & 0xFC) << 3) | (r >> 3);
+                pixel[0] = color >> 8;
+                pixel[1] = color & 0xFF;
+            }
+            else
+            {
+                pixel[0] = b;
+                pixel[1] = g;
+                pixel[2] = r;
+            }
+        }
+    }
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    client_t client = {0};
+    client.format = PIXEL_FORMAT_RGB666;
+    int frame_num = 100;
+    const char* file = NULL;
+    int opt = 0;
+    while((opt = getopt(argc, argv, "lp:n:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'l':
+                client.loopback = true;
+                break;
+            case 'p':
+                client.format = strcmp(optarg, "rgb565") == 0 ? PIXEL_FORMAT_RGB565 : PIXEL_FORMAT_RGB666;
+                break;
+            case 'n':
+                frame_num = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-p rgb666|rgb565] [-n frames] [raw_frame_file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind < argc)
+        file = argv[optind];
+    client.pixel_size = client.format == PIXEL_FORMAT_RGB565 ? 2 : 3;
+    int frame_size = LCD_WIDTH * LCD_HEIGHT * client.pixel_size;
+
+    int rc = 1;
+    /** One bulk transfer per frame. The header goes right before the pixels. */
+    uint8_t* message = calloc(1, sizeof(vendor_stream_header_t) + frame_size);
+    if(!message)
+        return 1;
+    uint8_t* frame = message + sizeof(vendor_stream_header_t);
+    if(file)
+    {
+        FILE* f = fopen(file, "rb");
+        if(!f || fread(frame, 1, frame_size, f) != (size_t)frame_size)
+        {
+            fprintf(stderr, "Cannot read %d bytes from %s\n", frame_size, file);
+            if(f)
+                fclose(f);
+            goto finish;
+        }
+        fclose(f);
+    }
+    if(open_client(&client) != 0)
+        goto finish;
+
+    double start = now_s();
+    for(int i = 0; i < frame_num; i++)
+    {
+        if(!file)
+            draw_test_pattern(frame, client.pixel_size, i);
+        vendor_stream_header_t header = {
+            .magic = VENDOR_STREAM_MAGIC,
+            .format = client.format,
+            .flags = VENDOR_STREAM_FLAG_PRESENT,
+            .frame_id = i,
+            .x = 0,
+            .y = 0,
+            .w = LCD_WIDTH,
+            .h = LCD_HEIGHT
+        };
+        memcpy(message, &header, sizeof(header));
+        if(send_data(&client, message, sizeof(header) + frame_size) != 0)
+        {
+            fprintf(stderr, "Frame %d failed\n", i);
+            goto finish;
+        }
+        if(client.loopback && (client.presented != i + 1 || memcmp(client.loopback_frame, frame, frame_size) != 0))
+        {
+            fprintf(stderr, "Loopback frame %d does not match\n", i);
+            goto finish;
+        }
+    }
+    double elapsed = now_s() - start;
+    printf("%d frames, %.1f fps, %.1f KB/s\n",
+        frame_num,
+        frame_num / elapsed,
+        frame_num * (double)(sizeof(vendor_stream_header_t) + frame_size) / elapsed / 1024);
+    rc = 0;
+finish:
+    close_client(&client);
+    free(message);
+    return rc;
+}
@@ -91,15 +91,31 @@
 #endif
 
 //------------- CLASS -------------//
+// The cdc interface for the drawing commands. Enabled from the compiler definitions.
+#ifndef CFG_TUD_CDC
 #define CFG_TUD_CDC               0
+#endif
 #define CFG_TUD_MSC               1
 #define CFG_TUD_HID               0
 #define CFG_TUD_MIDI              0
+// The vendor bulk interface for raw frames. Enabled from the compiler definitions.
+#ifndef CFG_TUD_VENDOR
 #define CFG_TUD_VENDOR            0
+#endif
 
 // MSC Buffer size of Device Mass storage
 #define CFG_TUD_MSC_EP_BUFSIZE    512
 
+// Vendor FIFO size. Room for a few packets so the host does not wait for the lcd task
+#define CFG_TUD_VENDOR_EPSIZE     64
+#define CFG_TUD_VENDOR_RX_BUFSIZE 1024
+#define CFG_TUD_VENDOR_TX_BUFSIZE 64
+
+// CDC FIFO size. The drawing commands are small, except for the blits
+#define CFG_TUD_CDC_EP_BUFSIZE    64
+#define CFG_TUD_CDC_RX_BUFSIZE    512
+#define CFG_TUD_CDC_TX_BUFSIZE    64
+
 #ifdef __cplusplus
     }
 #endif
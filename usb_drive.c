@@ -35,15 +35,31 @@
 #define USB_MANUFACTURER "FENG"
 #define USB_PRODUCT      "USBSCREEN"
 
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+/** Vendor specific. Show the frame now. No data, same as SYNCHRONIZE CACHE. */
+#define SCSI_CMD_VENDOR_COMMIT_FRAME 0xC0
+
 static void init_device_serial(const char* src);
 
-static disk_t* disk_ref = NULL;
+static disk_t* disk_refs[USB_DRIVE_MAX_LUN] = {0};
+static const char* product_ids[USB_DRIVE_MAX_LUN] = {0};
+static uint8_t lun_num = 0;
+#if CFG_TUD_VENDOR
+static void (*vendor_on_receive)(const uint8_t* data, uint32_t size, void* ctx) = NULL;
+static void* vendor_on_receive_ctx = NULL;
+#endif
+#if CFG_TUD_CDC
+static void (*cdc_on_available)(void* ctx) = NULL;
+static void* cdc_on_available_ctx = NULL;
+#endif
 
 int usb_drive_init_singleton(const char* serial, disk_t* disk)
 {
     if(!disk)
         return -1;
-    disk_ref = disk;
+    disk_refs[0] = disk;
+    product_ids[0] = "USB Screen";
+    lun_num = 1;
     if(serial)
     {
         init_device_serial(serial);
@@ -51,26 +67,85 @@ int usb_drive_init_singleton(const char* serial, disk_t* disk)
     return 0;
 }
 
+int usb_drive_add_lun(disk_t* disk, const char* product_id)
+{
+    if(!disk || !product_id || lun_num == 0 || lun_num >= USB_DRIVE_MAX_LUN)
+        return -1;
+    disk_refs[lun_num] = disk;
+    product_ids[lun_num] = product_id;
+    return lun_num++;
+}
+
+static disk_t* get_disk(uint8_t lun)
+{
+    return lun < lun_num ? disk_refs[lun] : NULL;
+}
+
+#if CFG_TUD_VENDOR
+int usb_drive_set_vendor_callback(void (*on_receive)(const uint8_t* data, uint32_t size, void* ctx), void* ctx)
+{
+    vendor_on_receive = on_receive;
+    vendor_on_receive_ctx = ctx;
+    return 0;
+}
+
+/** Vendor callbacks */
+
+// Invoked when received new data
+void tud_vendor_rx_cb(uint8_t itf)
+{
+    static uint8_t buffer[CFG_TUD_VENDOR_RX_BUFSIZE];
+    uint32_t size = 0;
+    while((size = tud_vendor_n_read(itf, buffer, sizeof(buffer))) > 0)
+    {
+        if(vendor_on_receive)
+            vendor_on_receive(buffer, size, vendor_on_receive_ctx);
+    }
+}
+#endif
+
+#if CFG_TUD_CDC
+int usb_drive_set_cdc_callback(void (*on_available)(void* ctx), void* ctx)
+{
+    cdc_on_available = on_available;
+    cdc_on_available_ctx = ctx;
+    return 0;
+}
+
+uint32_t usb_drive_cdc_read(uint8_t* buffer, uint32_t size)
+{
+    return tud_cdc_read(buffer, size);
+}
+
+/** CDC callbacks */
+
+// Invoked when received new data
+void tud_cdc_rx_cb(uint8_t itf)
+{
+    (void)itf;
+    if(cdc_on_available)
+        cdc_on_available(cdc_on_available_ctx);
+}
+#endif
+
 /** Disk callbacks */
 
 // Invoked to determine max LUN
 uint8_t tud_msc_get_maxlun_cb(void)
 {
-    return 1;
+    return lun_num;
 }
 
 // Invoked when received SCSI_CMD_INQUIRY
 // Application fill vendor id, product id and revision with string up to 8, 16, 4 characters respectively
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
 {
-    (void)lun;
-
     const char vid[] = USB_MANUFACTURER;
-    const char pid[] = "USB Screen";
+    const char* pid = lun < lun_num ? product_ids[lun] : "";
     const char rev[] = "1.0";
 
     memcpy(vendor_id, vid, strlen(vid));
-    memcpy(product_id, pid, strlen(pid));
+    memcpy(product_id, pid, strnlen(pid, 16));
     memcpy(product_rev, rev, strlen(rev));
 }
 
@@ -85,9 +160,8 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 // Application update block count and block size
 void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
 {
-    (void)lun;
-
-    *block_count = DISK_BLOCK_NUM;
+    disk_t* disk = get_disk(lun);
+    *block_count = disk ? disk->block_num : 0;
     *block_size = DISK_BLOCK_SIZE;
 }
 
@@ -118,9 +192,10 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 // Copy disk's data to buffer (up to bufsize) and return number of copied bytes.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
 {
-    if(!disk_ref)
+    disk_t* disk = get_disk(lun);
+    if(!disk)
         return -1;
-    return disk_read(disk_ref, lba, offset, buffer, bufsize);
+    return disk_read(disk, lba, offset, buffer, bufsize);
 }
 
 bool tud_msc_is_writable_cb(uint8_t lun)
@@ -133,9 +208,10 @@ bool tud_msc_is_writable_cb(uint8_t lun)
 // Process data in buffer to disk's storage and return number of written bytes
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
 {
-    if(!disk_ref)
+    disk_t* disk = get_disk(lun);
+    if(!disk)
         return -1;
-    return disk_write(disk_ref, lba, offset, buffer, bufsize);
+    return disk_write(disk, lba, offset, buffer, bufsize);
 }
 
 // Callback invoked when received an SCSI command not in built-in list below
@@ -153,6 +229,14 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, u
 
     switch (scsi_cmd[0])
     {
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    case SCSI_CMD_VENDOR_COMMIT_FRAME:
+        // Sent after the host flushed its writes. Take it as the end of the frame.
+        if(get_disk(lun))
+            disk_sync(get_disk(lun));
+        resplen = 0;
+        break;
+
     default:
         // Set Sense = Invalid Command Operation
         tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
@@ -201,9 +285,17 @@ static tusb_desc_device_t const desc_device =
         .bLength = sizeof(tusb_desc_device_t),
         .bDescriptorType = TUSB_DESC_DEVICE,
         .bcdUSB = 0x0200,
+#if CFG_TUD_CDC
+        // Use Interface Association Descriptor (IAD) for CDC
+        // As required by USB Specs IAD's subclass must be common class (2) and protocol must be IAD (1)
+        .bDeviceClass = TUSB_CLASS_MISC,
+        .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+        .bDeviceProtocol = MISC_PROTOCOL_IAD,
+#else
         .bDeviceClass = 0x00,
         .bDeviceSubClass = 0x00,
         .bDeviceProtocol = 0x00,
+#endif
         .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
 
         .idVendor = 0xCafe,
@@ -230,13 +322,25 @@ uint8_t const *tud_descriptor_device_cb(void)
 enum
 {
     ITF_NUM_MSC,
+#if CFG_TUD_VENDOR
+    ITF_NUM_VENDOR,
+#endif
+#if CFG_TUD_CDC
+    ITF_NUM_CDC,
+    ITF_NUM_CDC_DATA,
+#endif
     ITF_NUM_TOTAL
 };
 
-#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN)
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN + CFG_TUD_VENDOR * TUD_VENDOR_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN)
 
 #define EPNUM_MSC_OUT 0x01
 #define EPNUM_MSC_IN 0x81
+#define EPNUM_VENDOR_OUT 0x02
+#define EPNUM_VENDOR_IN 0x82
+#define EPNUM_CDC_NOTIF 0x83
+#define EPNUM_CDC_OUT 0x04
+#define EPNUM_CDC_IN 0x84
 
 static uint8_t const desc_fs_configuration[] =
     {
@@ -245,6 +349,16 @@ static uint8_t const desc_fs_configuration[] =
 
         // Interface number, string index, EP Out & EP In address, EP size
         TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
+
+#if CFG_TUD_VENDOR
+        // Interface number, string index, EP Out & IN address, EP size
+        TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 0, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, 64),
+#endif
+
+#if CFG_TUD_CDC
+        // Interface number, string index, EP notification address and size, EP data address (out, in) and size.
+        TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, 0, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+#endif
 };
 
 #if TUD_OPT_HIGH_SPEED
@@ -255,6 +369,16 @@ uint8_t const desc_hs_configuration[] =
 
         // Interface number, string index, EP Out & EP In address, EP size
         TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EPNUM_MSC_OUT, EPNUM_MSC_IN, 512),
+
+#if CFG_TUD_VENDOR
+        // Interface number, string index, EP Out & IN address, EP size
+        TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 0, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, 512),
+#endif
+
+#if CFG_TUD_CDC
+        // Interface number, string index, EP notification address and size, EP data address (out, in) and size.
+        TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, 0, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 512),
+#endif
 };
 #endif
 
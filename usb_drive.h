@@ -2,6 +2,58 @@
 
 /** Singleton library */
 
+#include <stdint.h>
+#include "tusb_config.h"
 #include "disk.h"
 
+#define USB_DRIVE_MAX_LUN (2)
+
+/**
+ * @brief The disk becomes LUN 0.
+ * 
+ * @param serial 
+ * @param disk 
+ * @return int 
+ */
 int usb_drive_init_singleton(const char* serial, disk_t* disk);
+
+/**
+ * @brief Expose one more disk as the next LUN. Call this before the usb stack starts.
+ * 
+ * @param disk 
+ * @param product_id Up to 16 characters, shown by the host.
+ * @return int The LUN. -1 on error.
+ */
+int usb_drive_add_lun(disk_t* disk, const char* product_id);
+
+#if CFG_TUD_VENDOR
+/**
+ * @brief Data from the vendor bulk out endpoint goes to this. Called in the usb task.
+ * 
+ * @param on_receive 
+ * @param ctx 
+ * @return int 
+ */
+int usb_drive_set_vendor_callback(void (*on_receive)(const uint8_t* data, uint32_t size, void* ctx), void* ctx);
+#endif
+
+#if CFG_TUD_CDC
+/**
+ * @brief on_available is called in the usb task when the cdc interface has data. Take it with usb_drive_cdc_read.
+ * The data waits in the usb stack meanwhile. The host is held off once that is full, nothing is lost.
+ * 
+ * @param on_available 
+ * @param ctx 
+ * @return int 
+ */
+int usb_drive_set_cdc_callback(void (*on_available)(void* ctx), void* ctx);
+
+/**
+ * @brief Take the data received on the cdc interface. Any task, the usb stack locks its fifo.
+ * 
+ * @param buffer 
+ * @param size 
+ * @return uint32_t The bytes taken. 0 if there is nothing.
+ */
+uint32_t usb_drive_cdc_read(uint8_t* buffer, uint32_t size);
+#endif
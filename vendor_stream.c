@@ -0,0 +1,99 @@
+#include <string.h>
+#include "vendor_stream.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static int check_header(vendor_stream_t* stream);
+static uint32_t write_payload(vendor_stream_t* stream, const uint8_t* data, uint32_t size);
+
+int vendor_stream_init(vendor_stream_t* stream)
+{
+    if(!stream || !stream->frame || stream->width <= 0 || stream->height <= 0 || stream->pixel_size <= 0)
+        return -1;
+    memset(&stream->stats, 0, sizeof(stream->stats));
+    memset(&stream->internal, 0, sizeof(stream->internal));
+    return 0;
+}
+
+int vendor_stream_feed(vendor_stream_t* stream, const uint8_t* data, uint32_t size)
+{
+    if(!stream || !data)
+        return -1;
+    stream->stats.bytes += size;
+    int rc = 0;
+    while(size > 0)
+    {
+        if(stream->internal.header_received < sizeof(vendor_stream_header_t))
+        {
+            uint32_t header_size = MIN(size, sizeof(vendor_stream_header_t) - stream->internal.header_received);
+            memcpy((uint8_t*)&stream->internal.header + stream->internal.header_received, data, header_size);
+            stream->internal.header_received += header_size;
+            data += header_size;
+            size -= header_size;
+            if(stream->internal.header_received < sizeof(vendor_stream_header_t))
+                break;
+            if(check_header(stream) != 0)
+            {
+                /** Look for the magic one byte further on. The region the bad header was in is lost. */
+                if(!stream->internal.resyncing)
+                    stream->stats.errors++;
+                stream->internal.resyncing = true;
+                memmove(&stream->internal.header, (uint8_t*)&stream->internal.header + 1, sizeof(vendor_stream_header_t) - 1);
+                stream->internal.header_received = sizeof(vendor_stream_header_t) - 1;
+                rc = -1;
+                continue;
+            }
+            if(stream->internal.resyncing)
+            {
+                stream->internal.resyncing = false;
+                stream->stats.resyncs++;
+            }
+            continue;
+        }
+        uint32_t payload_size = write_payload(stream, data, size);
+        data += payload_size;
+        size -= payload_size;
+        if(stream->internal.payload_received < stream->internal.payload_size)
+            break;
+        stream->internal.header_received = 0;
+        stream->stats.regions++;
+        if(stream->callbacks.on_region)
+            stream->callbacks.on_region(&stream->internal.header, stream->callbacks.on_region_ctx);
+    }
+    return rc;
+}
+
+static int check_header(vendor_stream_t* stream)
+{
+    const vendor_stream_header_t* header = &stream->internal.header;
+    if(header->magic != VENDOR_STREAM_MAGIC)
+        return -1;
+    if(header->format != stream->format)
+        return -1;
+    if(header->w == 0 || header->h == 0)
+        return -1;
+    if(header->x + header->w > stream->width || header->y + header->h > stream->height)
+        return -1;
+    stream->internal.payload_size = header->w * header->h * stream->pixel_size;
+    stream->internal.payload_received = 0;
+    return 0;
+}
+
+/** Copy the pixels to where they are in the frame, up to one row at a time. */
+static uint32_t write_payload(vendor_stream_t* stream, const uint8_t* data, uint32_t size)
+{
+    const vendor_stream_header_t* header = &stream->internal.header;
+    uint32_t region_row_size = header->w * stream->pixel_size;
+    uint32_t written = 0;
+    while(written < size && stream->internal.payload_received < stream->internal.payload_size)
+    {
+        uint32_t row = stream->internal.payload_received / region_row_size;
+        uint32_t row_offset = stream->internal.payload_received % region_row_size;
+        uint32_t copy_size = MIN(size - written, region_row_size - row_offset);
+        uint8_t* dst = stream->frame + ((header->y + row) * stream->width + header->x) * stream->pixel_size + row_offset;
+        memcpy(dst, data + written, copy_size);
+        written += copy_size;
+        stream->internal.payload_received += copy_size;
+    }
+    return written;
+}
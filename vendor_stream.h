@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * The protocol of the vendor bulk interface. Raw pixels without the scsi and the file system in between.
+ * Each region is a header followed by w*h pixels in the lcd pixel format, rows top -> down.
+ * A region can span many usb packets. A packet can hold the end of one region and the start of the next.
+ * Everything is little endian.
+ * This does not depend on the pico sdk, so the host client can run it as a loopback.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VENDOR_STREAM_MAGIC (0x5355)
+/** Show the frame once this region is written. */
+#define VENDOR_STREAM_FLAG_PRESENT (0x01)
+
+typedef struct
+{
+    uint16_t magic;
+    /** LCD_PIXEL_FORMAT_xxx */
+    uint8_t format;
+    uint8_t flags;
+    uint32_t frame_id;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} __attribute__((packed)) vendor_stream_header_t;
+
+typedef struct
+{
+    /** The display buffer. The pixels are written here directly. */
+    uint8_t* frame;
+    int width;
+    int height;
+    int pixel_size;
+    uint8_t format;
+    struct
+    {
+        /** The region is fully written to the frame. DO NOT put a lot of logic in this! */
+        void (*on_region)(const vendor_stream_header_t* header, void* ctx);
+        void* on_region_ctx;
+    } callbacks;
+    struct
+    {
+        uint32_t regions;
+        /** Bad headers. The stream is lost from each of them until the next good one. */
+        uint32_t errors;
+        /** Good headers found again after an error */
+        uint32_t resyncs;
+        uint32_t bytes;
+    } stats;
+    struct
+    {
+        vendor_stream_header_t header;
+        uint32_t header_received;
+        uint32_t payload_size;
+        uint32_t payload_received;
+        /** Looking for the next header one byte at a time */
+        bool resyncing;
+    } internal;
+} vendor_stream_t;
+
+int vendor_stream_init(vendor_stream_t* stream);
+
+/**
+ * @brief Feed the data received from the bulk endpoint.
+ * 
+ * @param stream 
+ * @param data 
+ * @param size 
+ * @return int 0 on success. -1 on a protocol error or while resyncing after one.
+ * The bytes are then dropped until a valid header is found, then the stream goes on from there.
+ */
+int vendor_stream_feed(vendor_stream_t* stream, const uint8_t* data, uint32_t size);